@@ -1,149 +1,90 @@
-#define PROGRAM_FILE "add_numbers.cl"
-#define KERNEL_FUNC "add_numbers"
-
-#include "../utils.h"
-
-int main(int argc, char *argv[]) {
-
-   cl_device_id device;
-   cl_context context;
-   cl_program program;
-   cl_kernel kernel;
-   cl_command_queue queue;
-   cl_int i, err;
-   size_t local_size, global_size;
+#include "../asp.h"
+
+/* Sum 1..M over every selected device at once. A short calibration launch 
+   measures each device's throughput and the range is split in proportion */
+long add_numbers_multi(cl_device_id* devices, int num_devices, long M) {
+
+   struct asp_session* sessions[MAX_DEVICES];
+   double throughput[MAX_DEVICES] = { 0 };
+   long counts[MAX_DEVICES], offset, res = 0;
+   char name[256];
+   bool timed = true;
+   double ms;
+   int d;
+
+   long calibration = M / (8 * num_devices);
+   if(calibration < ASP_SUM_WG_SIZE * 64)
+      calibration = ASP_SUM_WG_SIZE * 64;
+
+   /* Calibration: items per ms on each device (it also builds the kernel). 
+      A launch too short for the timer gives no rate to compare, so then 
+      every device is taken as equally fast (all zero: even split) */
+   for(d = 0; d < num_devices; d++) {
+      sessions[d] = asp_session_create(devices[d]);
+      asp_sum(sessions[d], calibration);
+      ms = asp_kernel_ms(sessions[d]);
+      if(ms > 0)
+         throughput[d] = calibration / ms;
+      else
+         timed = false;
+   }
+   if(!timed)
+      for(d = 0; d < num_devices; d++)
+         throughput[d] = 0;
 
-   cl_mem sum_buffer;
-   cl_int num_groups;
+   split_work(M, throughput, num_devices, counts);
 
-   // variable donde se almacenará el resultado
-	long res = 0;
+   for(d = 0, offset = 0; d < num_devices; offset += counts[d], d++)
+      asp_sum_start(sessions[d], counts[d], offset);
 
-	clock_t t = clock();
+   for(d = 0; d < num_devices; d++) {
+      res += asp_sum_wait(sessions[d]);
 
-	int M = 64;
-	if (argc == 2)
-		M = atoi(argv[1]);
-
-   /* Create device and context 
-
-   Creates a context containing only one device — the device structure 
-   created earlier.
-   */
-   device = create_device();
-   context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-   if(err < 0) {
-      perror("Couldn't create a context");
-      exit(1);   
+      name[0] = '\0';
+      clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(name), name, NULL);
+      printf("Device %d (%s): %ld numbers, %.3f ms\n", d, name, counts[d], asp_kernel_ms(sessions[d]));
+      asp_session_release(sessions[d]);
    }
 
-   /* Build program */
-   program = build_program(context, device, PROGRAM_FILE);
-
-   /* Create data buffer 
-
-   • `global_size`: total number of work items that will be 
-      executed on the GPU (e.g. total size of your array)
-   • `local_size`: size of local workgroup. Each workgroup contains 
-      several work items and goes to a compute unit 
-
-   In this example, the kernel is executed by eight work-items divided into 
-   two work-groups of four work-items each. Returning to my analogy, 
-   this corresponds to a school containing eight students divided into 
-   two classrooms of four students each.   
-
-     Notes: 
-   • Intel recommends workgroup size of 64-128. Often 128 is minimum to 
-   get good performance on GPU
-   • On NVIDIA Fermi, workgroup size must be at least 192 for full 
-   utilization of cores
-   • Optimal workgroup size differs across applications
-   */
-   local_size = 32; 
-   num_groups = M / local_size;
-   global_size = local_size*num_groups;
-   printf("Num groups: %d GlobalSize: %ld LocalSize: %ld\n", num_groups, global_size, local_size);
-   sum_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, num_groups * sizeof(long), NULL, &err); // <=====OUTPUT
-   if(err < 0) {
-      perror("Couldn't create a buffer");
-      exit(1);   
-   };
-
-   /* Create a command queue 
-
-   Does not support profiling or out-of-order-execution
-   */
-   queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
-   if(err < 0) {
-      perror("Couldn't create a command queue");
-      exit(1);   
-   };
-
-   /* Create a kernel */
-   kernel = clCreateKernel(program, KERNEL_FUNC, &err);
-   if(err < 0) {
-      perror("Couldn't create a kernel");
-      exit(1);
-   };
-
-   /* Create kernel arguments */
-   err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &sum_buffer); // <=====OUTPUT
-   err |= clSetKernelArg(kernel, 1, sizeof(int), &M);
-   err |= clSetKernelArg(kernel, 2, local_size * sizeof(long), NULL);
-   if(err < 0) {
-      perror("Couldn't create a kernel argument");
-      exit(1);
-   }
+   return res;
+}
 
-   /* Enqueue kernel 
-
-   At this point, the application has created all the data structures 
-   (device, kernel, program, command queue, and context) needed by an 
-   OpenCL host application. Now, it deploys the kernel to a device.
-
-   Of the OpenCL functions that run on the host, clEnqueueNDRangeKernel 
-   is probably the most important to understand. Not only does it deploy 
-   kernels to devices, it also identifies how many work-items should 
-   be generated to execute the kernel (global_size) and the number of 
-   work-items in each work-group (local_size).
-   */
-  cl_event event;
-   err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_size, 
-         &local_size, 0, NULL, &event); 
-   if(err < 0) {
-      perror("Couldn't enqueue the kernel");
-      exit(1);
-   }
+int main(int argc, char *argv[]) {
 
-   long* part_sum = (long*) calloc(num_groups, sizeof(long));
+   struct asp_session* session = NULL;
 
-   clWaitForEvents(1, &event);
-   clFinish(queue);
+   // variable donde se almacenará el resultado
+	long res = 0;
+   bool ok = true;
 
-   print_time_exec(event);
+	double t = wall_time_ms();
 
-   /* Read the kernel's output    */
-   err = clEnqueueReadBuffer(queue, sum_buffer, CL_TRUE, 0, 
-         num_groups * sizeof(long), part_sum, 0, NULL, NULL); // <=====GET OUTPUT
-   if(err < 0) {
-      perror("Couldn't read the buffer");
-      exit(1);
+	long M = 64;
+   parse_common_args(&argc, argv);
+	if (argc == 2)
+		M = atol(argv[1]);
+
+   /* Several devices selected: split the range between all of them */
+   cl_device_id devices[MAX_DEVICES];
+   int num_devices = select_devices(devices, MAX_DEVICES);
+   if(num_devices > 1)
+      res = add_numbers_multi(devices, num_devices, M);
+   else {
+      session = num_devices == 1 ? asp_session_create(devices[0]) : asp_session_open();
+      session->verbose = true;
+
+      res = asp_sum(session, M);
+      asp_print_time(session);
    }
 
-   /* Check result */
-   for(i=0; i<num_groups; i++)
-      res += part_sum[i];
-   
    printf("Computed sum = %ld.\n", res);
-   printf("Total tiempo: %f s\n", ((double)clock() - t) / CLOCKS_PER_SEC);
+   printf("Total tiempo: %f s\n", (wall_time_ms() - t) / 1000.0);
+
+   if(session != NULL ? asp_verify_against_cpu(session, "sum") : verify_enabled())
+      ok = verify_long("sum", res, cpu_sum(1, M));
 
-   free(part_sum);
+   if(session != NULL)
+      asp_session_release(session);
 
-   /* Deallocate resources */
-   clReleaseKernel(kernel);
-   clReleaseMemObject(sum_buffer);
-   clReleaseCommandQueue(queue);
-   clReleaseProgram(program);
-   clReleaseContext(context);
-   return 0;
+   return ok ? 0 : 1;
 }
@@ -1,4 +1,32 @@
+/* With -DWG_SIZE=... the work-group size is fixed, so the reduction below 
+   has a constant trip count and is unrolled. The loop strides over the whole 
+   grid, so any grid size covers any range.
 
+   -DREDUCE_VARIANT picks how the work-group is reduced (asp.h chooses per
+   device):
+      0  tree in local memory with a barrier per step (also without WG_SIZE)
+      1  long4 accumulators, then FOLD-wide unrolled sums and two barriers
+      2  as 1, with sub_group_reduce_add when the compiler has subgroups
+*/
+#if defined(WG_SIZE) && REDUCE_VARIANT > 0
+   #if REDUCE_VARIANT == 2 && (defined(cl_khr_subgroups) || defined(cl_intel_subgroups))
+      #define USE_SUBGROUPS
+   #endif
+   #if WG_SIZE >= 1024
+      #define FOLD 32
+   #elif WG_SIZE >= 256
+      #define FOLD 16
+   #elif WG_SIZE >= 16
+      #define FOLD 4
+   #else
+      #define FOLD 1
+   #endif
+   #define LANES (WG_SIZE / FOLD)
+#endif
+
+#ifdef WG_SIZE
+__attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+#endif
 __kernel void add_numbersMPI(__global long* group_sum, long init, long final, __local long* local_sum) {
 
    long tid, gid, total_hilos, register_sum, s;
@@ -8,14 +36,65 @@ __kernel void add_numbersMPI(__global long* group_sum, long init, long final, __
 	total_hilos = get_global_size(0);
 
    register_sum = 0;
+#ifdef LANES
+   // cuatro numeros consecutivos por iteracion en cuatro acumuladores
+   const long4 lane = (long4)(0, 1, 2, 3);
+   long4 acc = 0;
+   long i = init + 4*gid;
+   for(; i + 3 <= final; i += 4*total_hilos)
+      acc += (long4)(i) + lane;
+   for(; i <= final; i++)      // bloque final incompleto
+      register_sum += i;
+   register_sum += acc.s0 + acc.s1 + acc.s2 + acc.s3;
+#else
 	for(long i= init + gid; i <= final; i += total_hilos)
 		register_sum += i;
+#endif
+
+#if defined(USE_SUBGROUPS)
+   register_sum = sub_group_reduce_add(register_sum);
+   if(get_sub_group_local_id() == 0)
+      local_sum[get_sub_group_id()] = register_sum;
+
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if(tid == 0) {
+      for(uint g = 1; g < get_num_sub_groups(); g++)
+         register_sum += local_sum[g];
+      group_sum[get_group_id(0)] = register_sum;
+   }
+#elif defined(LANES)
+	local_sum[tid] = register_sum;
 
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   // LANES work-items suman FOLD valores cada uno (sin conflictos de banco)
+   if(tid < LANES) {
+      #pragma unroll
+      for(s = 1; s < FOLD; s++)
+         register_sum += local_sum[tid + s*LANES];
+      local_sum[tid] = register_sum;
+   }
+
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if(tid == 0) {
+      #pragma unroll
+      for(s = 1; s < LANES; s++)
+         register_sum += local_sum[s];
+      group_sum[get_group_id(0)] = register_sum;
+   }
+#else
 	local_sum[tid] = register_sum;
-   
+
    barrier(CLK_LOCAL_MEM_FENCE);
 
-   for(s=get_local_size(0) / 2; s>0; s>>=1) { // En cada iteracion se opera sobre la mitad de array
+#ifdef WG_SIZE
+   #pragma unroll
+   for(s=WG_SIZE / 2; s>0; s>>=1) {
+#else
+   for(s=get_local_size(0) / 2; s>0; s>>=1) {
+#endif // En cada iteracion se opera sobre la mitad de array
 		if (tid < s)
 			local_sum[tid] += local_sum[tid + s];
 		barrier(CLK_LOCAL_MEM_FENCE);
@@ -23,4 +102,5 @@ __kernel void add_numbersMPI(__global long* group_sum, long init, long final, __
 
    if (tid == 0)
  		group_sum[get_group_id(0)] = local_sum[0];
+#endif
 }
@@ -0,0 +1,2975 @@
+#ifndef ASP_H
+#define ASP_H
+
+#include "utils.h"
+#include "asp_cpu.h"
+
+/* Reusable OpenCL session
+
+   Every exercise used to create its context, queue, program and kernel
+   inside main() and throw all of it away at exit, so nothing could be run
+   twice without paying the whole setup again. A session owns those objects
+   for one device: asp_sum(), asp_pi(), asp_gemm() and asp_conv1d() can be
+   called any number of times in one process, and only the first call of
+   each kernel variant builds a program. The executables in every folder
+   are thin front-ends over these functions.
+
+   The .cl files are looked up relative to the repository root: ASP_ROOT
+   if set, else the current folder when it holds utils.h, else "..".
+
+   asp_session_open() falls back to a CPU session when no OpenCL device is
+   available (or with --device host): the same calls then run the OpenMP
+   backend of asp_cpu.h and asp_kernel_ms() reports its wall time.
+*/
+
+/* Kernel files, relative to the repository root */
+#define ASP_SUM_FILE "add_numbers/add_numbers.cl"
+#define ASP_SUM_RANGE_FILE "add_numbersMPI/add_numbersMPI.cl"
+#define ASP_PI_FILE "pi/pi_opencl.cl"
+#define ASP_GEMM_FILE "matrix_mult/mtrx_opencl.cl"
+#define ASP_CONV_FILE "convolucion/conv_opencl.cl"
+#define ASP_CONV2D_FILE "convolucion2d/conv2d.cl"
+#define ASP_REDUCE_FILE "reduccion/reduccion.cl"
+#define ASP_MC_FILE "montecarlo/montecarlo.cl"
+
+#define ASP_SUM_WG_SIZE 32
+#define ASP_PI_WG_SIZE 32
+#define ASP_REDUCE_WG_SIZE 256
+#define ASP_GROUPS_PER_CU 8          // persistent grid: groups per compute unit
+
+/* Kernels with a tunable launch configuration (see asp_autotune()) */
+enum { ASP_TUNE_SUM, ASP_TUNE_SUM_RANGE, ASP_TUNE_PI, ASP_TUNE_GEMM, ASP_TUNE_CONV, ASP_TUNE_REDUCE,
+      ASP_NUM_TUNED };
+const char* asp_tune_names[ASP_NUM_TUNED] = { "add_numbers", "add_numbersMPI", "pi_opencl", 
+      "mtrx_opencl", "conv_opencl", "reduccion" };
+#define ASP_MAX_CANDIDATES 256
+
+/* Work-group stage of the reductions (-DREDUCE_VARIANT): a tree with a 
+   barrier per step (the fallback), vector accumulators with a two-barrier 
+   unrolled stage, or subgroup reductions where the compiler offers them */
+enum { ASP_VARIANT_TREE, ASP_VARIANT_VECTOR, ASP_VARIANT_SUBGROUP, ASP_NUM_VARIANTS };
+const char* asp_variant_names[ASP_NUM_VARIANTS] = { "tree", "vector", "subgroup" };
+
+/* GEMM kernels, in the same `variant` field: the naive one reads a row and 
+   a column from global memory per element of C, the tiled one stages 
+   TILE_SIZE x TILE_SIZE blocks in local memory and the blocked one also
+   keeps an `items` x `items` block of C per work-item in registers, loading
+   the panels `width` ints at a time */
+enum { ASP_GEMM_NAIVE, ASP_GEMM_TILED, ASP_GEMM_BLOCKED, ASP_GEMM_NUM_KERNELS };
+const char* asp_gemm_kernel_names[ASP_GEMM_NUM_KERNELS] = { "naive", "tiled", "blocked" };
+const char* asp_gemm_kernel_functions[ASP_GEMM_NUM_KERNELS] = { "mtrx_opencl", "mtrx_tiled", "mtrx_blocked" };
+#define ASP_GEMM_MAX_TILE 16         // default tile edge of the blocked kernel
+
+/* Name of variant `variant` of tuned kernel `which` */
+const char* asp_variant_name(int which, int variant) {
+   if(which == ASP_TUNE_GEMM)
+      return asp_gemm_kernel_names[variant];
+   return asp_variant_names[variant];
+}
+
+/* Buffer pool entry: a device buffer, or a pinned host staging buffer 
+   (CL_MEM_ALLOC_HOST_PTR, kept mapped) when `host` is set */
+struct asp_pool_entry {
+   cl_mem buffer;
+   void* host;
+   size_t size;                  // size class in bytes
+   bool in_use;
+};
+
+struct asp_pool_stats {
+   size_t in_use, high_water;    // bytes handed out now / at most
+   size_t footprint;             // bytes allocated by the pool
+   unsigned long created, reused;
+};
+
+struct asp_kernel {
+   char file[128];
+   char name[64];
+   char options[512];
+   char* prefix;                 // format_source_defines(), NULL if none
+   cl_program program;
+   cl_kernel kernel;
+};
+
+struct asp_session {
+   bool cpu;                     // native CPU backend, no OpenCL objects
+   cl_device_id device;
+   cl_context context;
+   cl_command_queue queue;
+   size_t max_workgroup;
+   cl_uint compute_units;
+   cl_ulong local_mem;
+   cl_ulong max_constant;        // __constant buffer size, for the convolution filters
+   bool subgroups;               // cl_khr_subgroups or cl_intel_subgroups
+   bool images;                  // 2D images of CL_R / CL_FLOAT, for conv2d_image
+   char root[256];
+
+   /* Every variant built so far. The table only grows: a handle returned
+      by asp_get_kernel() stays valid until asp_session_release() */
+   struct asp_kernel* kernels;
+   int num_kernels, kernels_capacity;
+
+   bool verbose;                 // print the launch geometry like the old programs
+   cl_event last_event;          // kernel event of the last call, for print_time_exec()
+
+   /* Copies since the last asp_transfer_ms(), for the benchmark: the ones 
+      still tracked as events and the time of those already folded in */
+   cl_event* transfers;
+   int num_transfers, transfers_capacity;
+   double transfers_ms;
+
+   /* asp_sum_start() state until asp_sum_wait() */
+   cl_mem sum_buffer;
+   cl_int sum_groups;
+   long cpu_sum;
+
+   /* Band image of asp_convolve2d(), kept for the next bands and grown to
+      the largest one (images do not go through the buffer pool) */
+   cl_mem band_image;
+   size_t band_image_width, band_image_height;
+
+   double call_ms;               // last call not timed by one event (CPU backend, pipeline)
+
+   /* Chunked pipeline: write, compute and read queues (the same 
+   out-of-order queue three times with ASP_PIPELINE_QUEUE=ooo) */
+   cl_command_queue pipe_queues[3];
+   double pipeline_saved_ms;     // overlap gain of the last pipelined call
+
+   /* Buffer pool */
+   struct asp_pool_entry* pool;
+   int pool_size, pool_capacity;
+   struct asp_pool_stats device_stats, host_stats;
+
+   /* Launch configuration of each kernel: defaults, tuning database or sweep */
+   struct tune_config config[ASP_NUM_TUNED];
+   bool config_loaded[ASP_NUM_TUNED], tuned[ASP_NUM_TUNED];
+   bool tuning, tune_failed;
+};
+
+
+bool asp_has_extension(struct asp_session* s, const char* name) {
+   char extensions[4096] = "";
+   clGetDeviceInfo(s->device, CL_DEVICE_EXTENSIONS, sizeof(extensions), extensions, NULL);
+   return strstr(extensions, name) != NULL;
+}
+
+/* Image support with single-channel float images */
+bool asp_has_images(struct asp_session* s) {
+
+   cl_image_format formats[256];
+   cl_bool support = CL_FALSE;
+   cl_uint num_formats = 0;
+
+   clGetDeviceInfo(s->device, CL_DEVICE_IMAGE_SUPPORT, sizeof(support), &support, NULL);
+   if(!support || clGetSupportedImageFormats(s->context, CL_MEM_READ_ONLY, CL_MEM_OBJECT_IMAGE2D, 256, 
+         formats, &num_formats) < 0)
+      return false;
+   for(cl_uint i = 0; i < num_formats && i < 256; i++)
+      if(formats[i].image_channel_order == CL_R && formats[i].image_channel_data_type == CL_FLOAT)
+         return true;
+   return false;
+}
+
+/* Find the folder that holds the exercise folders */
+void asp_find_root(char* root, size_t size) {
+
+   const char* env = getenv("ASP_ROOT");
+   FILE* probe;
+
+   if(env != NULL && env[0] != '\0') {
+      snprintf(root, size, "%s", env);
+      return;
+   }
+
+   probe = fopen("utils.h", "r");
+   if(probe != NULL) {
+      fclose(probe);
+      snprintf(root, size, ".");
+   }
+   else
+      snprintf(root, size, "..");
+}
+
+/* Buffer pool
+
+   Sums, pi, GEMM and convolution used to create fresh cl_mem objects (and 
+   malloc their host arrays) on every call, which dominates at small sizes 
+   when they run repeatedly. Buffers are now taken from a per-session pool 
+   in power of two size classes: asp_acquire()/asp_release() for device 
+   buffers and asp_acquire_host()/asp_release_host() for pinned host staging 
+   memory. Released buffers are reused by later calls of the same class and 
+   only freed with the session (or asp_pool_trim()). ASP_POOL_STATS=1 
+   prints the high-water marks when the session ends.
+*/
+#define ASP_POOL_MIN_CLASS 4096
+
+size_t asp_pool_class(size_t size) {
+   size_t size_class = ASP_POOL_MIN_CLASS;
+   while(size_class < size)
+      size_class *= 2;
+   return size_class;
+}
+
+/* Free every buffer that is not in use */
+void asp_pool_trim(struct asp_session* s) {
+
+   int kept = 0;
+
+   for(int i = 0; i < s->pool_size; i++) {
+      struct asp_pool_entry* entry = &s->pool[i];
+      if(entry->in_use) {
+         s->pool[kept++] = *entry;
+         continue;
+      }
+      if(s->cpu) {
+         free(entry->host);
+         s->host_stats.footprint -= entry->size;
+         continue;
+      }
+      if(entry->host) {
+         clEnqueueUnmapMemObject(s->queue, entry->buffer, entry->host, 0, NULL, NULL);
+         clFinish(s->queue);
+         s->host_stats.footprint -= entry->size;
+      }
+      else
+         s->device_stats.footprint -= entry->size;
+      clReleaseMemObject(entry->buffer);
+   }
+   s->pool_size = kept;
+}
+
+struct asp_pool_entry* asp_pool_append(struct asp_session* s) {
+   if(s->pool_size == s->pool_capacity) {
+      s->pool_capacity = s->pool_capacity ? 2 * s->pool_capacity : 16;
+      s->pool = (struct asp_pool_entry*) realloc(s->pool, 
+            s->pool_capacity * sizeof(struct asp_pool_entry));
+   }
+   return &s->pool[s->pool_size++];
+}
+
+struct asp_pool_entry* asp_pool_take(struct asp_session* s, size_t size, bool pinned) {
+
+   struct asp_pool_stats* stats = pinned || s->cpu ? &s->host_stats : &s->device_stats;
+   struct asp_pool_entry* entry = NULL;
+   size_t size_class = asp_pool_class(size);
+   cl_mem_flags flags = CL_MEM_READ_WRITE | (pinned ? CL_MEM_ALLOC_HOST_PTR : 0);
+   int err;
+
+   for(int i = 0; i < s->pool_size && entry == NULL; i++)
+      if(!s->pool[i].in_use && s->pool[i].size == size_class && 
+            (s->cpu || (s->pool[i].host != NULL) == pinned))
+         entry = &s->pool[i];
+
+   if(entry != NULL)
+      stats->reused++;
+   else if(s->cpu) {
+      /* CPU session: plain aligned host memory, the same on both sides */
+      void* host = NULL;
+      if(posix_memalign(&host, 64, size_class) != 0) {
+         asp_pool_trim(s);
+         if(posix_memalign(&host, 64, size_class) != 0) {
+            perror("Couldn't allocate memory");
+            exit(1);
+         }
+      }
+      entry = asp_pool_append(s);
+      entry->buffer = NULL;
+      entry->host = host;
+      entry->size = size_class;
+      stats->created++;
+      stats->footprint += size_class;
+   }
+   else {
+      cl_mem buffer = clCreateBuffer(s->context, flags, size_class, NULL, &err);
+      if(err < 0) {
+         /* Out of memory: give back what is cached and try once more */
+         asp_pool_trim(s);
+         buffer = clCreateBuffer(s->context, flags, size_class, NULL, &err);
+      }
+      if(err < 0) {
+         perror("Couldn't create a buffer");
+         exit(1);
+      }
+
+      entry = asp_pool_append(s);
+      entry->buffer = buffer;
+      entry->size = size_class;
+      entry->host = NULL;
+
+      /* Staging buffers stay mapped: their pointer is pinned host memory */
+      if(pinned) {
+         entry->host = clEnqueueMapBuffer(s->queue, buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 
+               0, size_class, 0, NULL, NULL, &err);
+         if(err < 0) {
+            perror("Couldn't map a staging buffer");
+            exit(1);
+         }
+      }
+
+      stats->created++;
+      stats->footprint += size_class;
+   }
+
+   entry->in_use = true;
+   stats->in_use += entry->size;
+   if(stats->in_use > stats->high_water)
+      stats->high_water = stats->in_use;
+   return entry;
+}
+
+cl_mem asp_acquire(struct asp_session* s, size_t size) {
+   return asp_pool_take(s, size, false)->buffer;
+}
+
+void* asp_acquire_host(struct asp_session* s, size_t size) {
+   return asp_pool_take(s, size, true)->host;
+}
+
+void asp_release(struct asp_session* s, cl_mem buffer) {
+   for(int i = 0; i < s->pool_size; i++)
+      if(s->pool[i].buffer == buffer && s->pool[i].in_use) {
+         s->pool[i].in_use = false;
+         s->device_stats.in_use -= s->pool[i].size;
+         return;
+      }
+}
+
+void asp_release_host(struct asp_session* s, void* host) {
+   for(int i = 0; i < s->pool_size; i++)
+      if(s->pool[i].host == host && s->pool[i].in_use) {
+         s->pool[i].in_use = false;
+         s->host_stats.in_use -= s->pool[i].size;
+         return;
+      }
+}
+
+void asp_pool_print_stats(struct asp_session* s) {
+   const struct asp_pool_stats* stats[2] = { &s->device_stats, &s->host_stats };
+   const char* names[2] = { "device", "pinned host" };
+   for(int i = 0; i < 2; i++)
+      printf("Buffer pool (%s): %lu created, %lu reused, high water %.2f MB, footprint %.2f MB\n",
+            names[i], stats[i]->created, stats[i]->reused, stats[i]->high_water / 1048576.0, 
+            stats[i]->footprint / 1048576.0);
+}
+
+struct asp_session* asp_session_create(cl_device_id device) {
+
+   struct asp_session* s;
+   double start = wall_time_ms();
+   int err;
+
+   s = (struct asp_session*) calloc(1, sizeof(struct asp_session));
+   s->device = device;
+
+   /* Create a context containing only this device */
+   s->context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+   if(err < 0) {
+      perror("Couldn't create a context");
+      exit(1);
+   }
+
+   /* One in-order queue with profiling, shared by every call */
+   s->queue = clCreateCommandQueue(s->context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+   if(err < 0) {
+      perror("Couldn't create a command queue");
+      exit(1);
+   }
+
+   clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &s->max_workgroup, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &s->compute_units, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &s->local_mem, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(cl_ulong), &s->max_constant, NULL);
+   s->subgroups = asp_has_extension(s, "cl_khr_subgroups") || asp_has_extension(s, "cl_intel_subgroups");
+   s->images = asp_has_images(s);
+   asp_find_root(s->root, sizeof(s->root));
+
+   trace_host("session", "init", start, wall_time_ms());
+   return s;
+}
+
+/* Session on the native CPU backend */
+struct asp_session* asp_session_create_cpu() {
+
+   struct asp_session* s = (struct asp_session*) calloc(1, sizeof(struct asp_session));
+
+   s->cpu = true;
+#ifdef _OPENMP
+   s->compute_units = omp_get_max_threads();
+#else
+   s->compute_units = 1;
+#endif
+   asp_find_root(s->root, sizeof(s->root));
+   return s;
+}
+
+/* Session on the selected device, or on the CPU backend when there is none */
+struct asp_session* asp_session_open() {
+
+   cl_device_id device;
+
+   if(select_devices(&device, 1) == 1)
+      return asp_session_create(device);
+
+   fprintf(stderr, "No OpenCL device available, using the CPU backend\n");
+   return asp_session_create_cpu();
+}
+
+/* Device name, for reports */
+void asp_device_name(struct asp_session* s, char* name, size_t size) {
+   name[0] = '\0';
+   if(s->cpu)
+      snprintf(name, size, "host (OpenMP, %u threads)", s->compute_units);
+   else
+      clGetDeviceInfo(s->device, CL_DEVICE_NAME, size, name, NULL);
+}
+
+void asp_session_release(struct asp_session* s) {
+
+   for(int i = 0; i < s->num_kernels; i++) {
+      clReleaseKernel(s->kernels[i].kernel);
+      clReleaseProgram(s->kernels[i].program);
+      free(s->kernels[i].prefix);
+   }
+   free(s->kernels);
+   if(s->last_event)
+      clReleaseEvent(s->last_event);
+   for(int i = 0; i < s->num_transfers; i++)
+      clReleaseEvent(s->transfers[i]);
+   free(s->transfers);
+   if(s->band_image)
+      clReleaseMemObject(s->band_image);
+
+   const char* env = getenv("ASP_POOL_STATS");
+   if(env != NULL && strcmp(env, "0") != 0)
+      asp_pool_print_stats(s);
+
+   /* Everything goes, including buffers the caller did not release */
+   for(int i = 0; i < s->pool_size; i++)
+      s->pool[i].in_use = false;
+   asp_pool_trim(s);
+   free(s->pool);
+
+   if(s->cpu) {
+      free(s);
+      return;
+   }
+
+   for(int i = 0; i < 3; i++)
+      if(s->pipe_queues[i]) {
+         trace_release_queue(s->pipe_queues[i]);
+         clReleaseCommandQueue(s->pipe_queues[i]);
+      }
+   trace_release_queue(s->queue);
+   release_context_variants(s->context);
+   clReleaseCommandQueue(s->queue);
+   clReleaseContext(s->context);
+   free(s);
+}
+
+/* Kernel `name` of `file` specialized for a define set. Built the first
+   time, then served from the session */
+cl_kernel asp_get_kernel(struct asp_session* s, const char* file, const char* name,
+      const struct build_define* defines, int num_defines) {
+
+   struct asp_kernel* entry;
+   char options[512], path[512];
+   char* prefix;
+   int err;
+
+   format_defines(options, sizeof(options), defines, num_defines);
+   prefix = format_source_defines(defines, num_defines);
+
+   for(int i = 0; i < s->num_kernels; i++) {
+      entry = &s->kernels[i];
+      if(strcmp(entry->file, file) == 0 && strcmp(entry->name, name) == 0 &&
+            strcmp(entry->options, options) == 0 && same_prefix(entry->prefix, prefix)) {
+         free(prefix);
+         return entry->kernel;
+      }
+   }
+
+   if(s->num_kernels == s->kernels_capacity) {
+      s->kernels_capacity = s->kernels_capacity ? 2 * s->kernels_capacity : 32;
+      s->kernels = (struct asp_kernel*) realloc(s->kernels, 
+            s->kernels_capacity * sizeof(struct asp_kernel));
+   }
+   entry = &s->kernels[s->num_kernels++];
+
+   snprintf(path, sizeof(path), "%s/%s", s->root, file);
+   entry->program = build_program_variant_source(s->context, s->device, path, prefix, options);
+   entry->kernel = clCreateKernel(entry->program, name, &err);
+   if(err < 0) {
+      perror("Couldn't create a kernel");
+      exit(1);
+   }
+   snprintf(entry->file, sizeof(entry->file), "%s", file);
+   snprintf(entry->name, sizeof(entry->name), "%s", name);
+   snprintf(entry->options, sizeof(entry->options), "%s", options);
+   entry->prefix = prefix;
+
+   return entry->kernel;
+}
+
+/* Keep the event of the last kernel so the caller can time it */
+void asp_set_event(struct asp_session* s, cl_event event) {
+   if(s->last_event)
+      clReleaseEvent(s->last_event);
+   s->last_event = event;
+}
+
+double asp_kernel_ms(struct asp_session* s) {
+   if(s->cpu || s->last_event == NULL)
+      return s->call_ms;
+   return s->last_event ? getTimeExec(s->last_event) : 0.0;
+}
+
+/* print_time_exec() of the last kernel, or the CPU backend time */
+void asp_print_time(struct asp_session* s) {
+   if(s->cpu)
+      printf("CPU backend execution time is: %0.3f mili seconds \n", s->call_ms);
+   else if(s->last_event == NULL)
+      printf("OpenCl pipeline time is: %0.3f mili seconds \n", s->call_ms);
+   else
+      print_time_exec(s->last_event);
+}
+
+/* --verify for a result that the CPU backend computes with the very code
+   of the reference: on a CPU session the check would compare it with
+   itself, so it is reported as skipped */
+bool asp_verify_against_cpu(struct asp_session* s, const char* what) {
+   if(!verify_enabled())
+      return false;
+   if(s->cpu) {
+      printf("Verify %s: skipped (CPU backend, nothing to compare against)\n", what);
+      return false;
+   }
+   return true;
+}
+
+/* Time a CPU backend call like a kernel: asp_kernel_ms() and the trace */
+void asp_cpu_done(struct asp_session* s, const char* name, double start) {
+   double end = wall_time_ms();
+   s->call_ms = end - start;
+   trace_host(name, "kernel", start, end);
+}
+
+/* When the list is full the copies that already finished are folded into 
+   transfers_ms, so it only grows with the ones still in flight */
+void asp_track_transfer(struct asp_session* s, cl_event event) {
+
+   cl_int status;
+   int kept = 0;
+
+   if(s->num_transfers == s->transfers_capacity) {
+      for(int i = 0; i < s->num_transfers; i++) {
+         clGetEventInfo(s->transfers[i], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), 
+               &status, NULL);
+         if(status > CL_COMPLETE)
+            s->transfers[kept++] = s->transfers[i];
+         else {
+            if(status == CL_COMPLETE)
+               s->transfers_ms += getTimeExec(s->transfers[i]);
+            clReleaseEvent(s->transfers[i]);
+         }
+      }
+      s->num_transfers = kept;
+   }
+
+   if(s->num_transfers == s->transfers_capacity) {
+      s->transfers_capacity = s->transfers_capacity ? 2 * s->transfers_capacity : 16;
+      s->transfers = (cl_event*) realloc(s->transfers, s->transfers_capacity * sizeof(cl_event));
+   }
+   clRetainEvent(event);
+   s->transfers[s->num_transfers++] = event;
+}
+
+/* Device time of the writes and reads issued since the previous call */
+double asp_transfer_ms(struct asp_session* s) {
+
+   double ms = s->transfers_ms;
+
+   if(s->num_transfers > 0)
+      clWaitForEvents(s->num_transfers, s->transfers);
+   for(int i = 0; i < s->num_transfers; i++) {
+      ms += getTimeExec(s->transfers[i]);
+      clReleaseEvent(s->transfers[i]);
+   }
+   s->num_transfers = 0;
+   s->transfers_ms = 0;
+   return ms;
+}
+
+/* Host -> device copy into a pool buffer. The write is traced instead of 
+   hiding in CL_MEM_COPY_HOST_PTR; it does not block, so `host` must stay 
+   valid until the next blocking call on the queue */
+cl_mem asp_upload(struct asp_session* s, size_t size, const void* host) {
+
+   cl_mem buffer;
+   cl_event event;
+
+   buffer = asp_acquire(s, size);
+   if(clEnqueueWriteBuffer(s->queue, buffer, CL_FALSE, 0, size, host, 0, NULL, &event) < 0) {
+      perror("Couldn't write the buffer");
+      exit(1);
+   }
+   trace_event(event, "write", "write");
+   asp_track_transfer(s, event);
+   clReleaseEvent(event);
+   return buffer;
+}
+
+void asp_run(struct asp_session* s, cl_kernel kernel, cl_uint dims,
+      const size_t* global_size, const size_t* local_size) {
+
+   cl_event event;
+   char name[64];
+   int err;
+
+   /* Enqueue kernel
+
+   clEnqueueNDRangeKernel deploys the kernel to the device and says how
+   many work-items are generated (global_size) and how many go in each
+   work-group (local_size).
+   */
+   err = clEnqueueNDRangeKernel(s->queue, kernel, dims, NULL, global_size,
+         local_size, 0, NULL, &event);
+   if(err < 0 && s->tuning) {
+      /* A configuration the device rejects is just a losing candidate */
+      s->tune_failed = true;
+      return;
+   }
+   if(err < 0) {
+      perror("Couldn't enqueue the kernel");
+      printf("%d\n", err);
+      exit(1);
+   }
+   asp_set_event(s, event);
+
+   if(trace_active()) {
+      name[0] = '\0';
+      clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, NULL);
+      trace_event(event, name, "kernel");
+   }
+}
+
+void asp_read(struct asp_session* s, cl_mem buffer, size_t size, void* host) {
+
+   cl_event event;
+
+   if(clEnqueueReadBuffer(s->queue, buffer, CL_TRUE, 0, size, host, 0, NULL, &event) < 0) {
+      perror("Couldn't read the buffer");
+      exit(1);
+   }
+   trace_event(event, "read", "read");
+   asp_track_transfer(s, event);
+   clReleaseEvent(event);
+}
+
+
+/* Overlapped pipeline
+
+   With --pipeline[=CHUNKS] (ASP_PIPELINE=CHUNKS) large convolutions and 
+   GEMMs are split into blocks. Writes, kernels and reads go to three queues 
+   tied by events, so uploading block i+1, computing block i and reading 
+   block i-1 overlap; ASP_PIPELINE_SLOTS buffer sets are reused in turn. 
+   ASP_PIPELINE_QUEUE=ooo uses one out-of-order queue instead when the 
+   device supports it. The wall time saved is the serial sum of the 
+   commands minus the span they actually took.
+*/
+#define ASP_PIPE_WRITE 0
+#define ASP_PIPE_COMPUTE 1
+#define ASP_PIPE_READ 2
+#define ASP_PIPELINE_SLOTS 3
+#define ASP_PIPELINE_MAX_CHUNKS 256
+#define ASP_PIPELINE_MIN_CONV (1 << 16)
+#define ASP_PIPELINE_MIN_GEMM 256
+
+void asp_pipeline_init(struct asp_session* s) {
+
+   cl_command_queue_properties supported = 0;
+   const cl_command_queue_properties profiling = CL_QUEUE_PROFILING_ENABLE;
+   const char* env = getenv("ASP_PIPELINE_QUEUE");
+   int err = 0;
+
+   if(s->pipe_queues[0] != NULL)
+      return;
+
+   clGetDeviceInfo(s->device, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, NULL);
+   if(env != NULL && strcmp(env, "ooo") == 0 && (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)) {
+      s->pipe_queues[0] = clCreateCommandQueue(s->context, s->device, 
+            profiling | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &err);
+      for(int i = 1; i < 3 && err >= 0; i++) {
+         clRetainCommandQueue(s->pipe_queues[0]);
+         s->pipe_queues[i] = s->pipe_queues[0];
+      }
+   }
+   else
+      for(int i = 0; i < 3 && err >= 0; i++)
+         s->pipe_queues[i] = clCreateCommandQueue(s->context, s->device, profiling, &err);
+
+   if(err < 0) {
+      perror("Couldn't create the pipeline queues");
+      exit(1);
+   }
+}
+
+/* Chunks actually used for `units` rows or elements */
+int asp_pipeline_plan(int units) {
+   int chunks = pipeline_chunks();
+   if(chunks > ASP_PIPELINE_MAX_CHUNKS)
+      chunks = ASP_PIPELINE_MAX_CHUNKS;
+   if(chunks > units)
+      chunks = units;
+   return chunks;
+}
+
+/* Wait for the pipeline, compare the busy time of its commands with the span 
+   they took and release the events */
+void asp_pipeline_finish(struct asp_session* s, const char* what, cl_event* events, 
+      int num_events, int chunks) {
+
+   cl_ulong start, end, first = 0, last = 0;
+   double busy = 0, span;
+
+   for(int i = 0; i < 3; i++)
+      clFinish(s->pipe_queues[i]);
+
+   for(int i = 0; i < num_events; i++) {
+      clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+      clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+      busy += (end - start) / 1000000.0;
+      if(i == 0 || start < first) first = start;
+      if(i == 0 || end > last) last = end;
+      clReleaseEvent(events[i]);
+   }
+   span = (last - first) / 1000000.0;
+
+   /* The call is timed by its span, not by one kernel event */
+   asp_set_event(s, NULL);
+   s->call_ms = span;
+   s->pipeline_saved_ms = busy > span ? busy - span : 0;
+
+   if(s->verbose)
+      printf("Pipeline %s: %d chunks, %.3f ms of commands in %.3f ms, overlap saved %.3f ms (%.1f%%)\n",
+            what, chunks, busy, span, s->pipeline_saved_ms, 
+            busy > 0 ? 100.0 * s->pipeline_saved_ms / busy : 0.0);
+}
+
+/* Enqueue helpers of the pipeline: they trace the command and keep its event */
+cl_event asp_pipeline_write(struct asp_session* s, cl_mem buffer, size_t size, const void* host,
+      cl_uint num_wait, const cl_event* wait) {
+
+   cl_event event;
+
+   if(clEnqueueWriteBuffer(s->pipe_queues[ASP_PIPE_WRITE], buffer, CL_FALSE, 0, size, host, 
+         num_wait, num_wait ? wait : NULL, &event) < 0) {
+      perror("Couldn't write the buffer");
+      exit(1);
+   }
+   trace_event(event, "write", "write");
+   return event;
+}
+
+cl_event asp_pipeline_run(struct asp_session* s, cl_kernel kernel, cl_uint dims, const size_t* global_size,
+      const size_t* local_size, cl_uint num_wait, const cl_event* wait) {
+
+   cl_event event;
+   char name[64];
+
+   if(clEnqueueNDRangeKernel(s->pipe_queues[ASP_PIPE_COMPUTE], kernel, dims, NULL, global_size, 
+         local_size, num_wait, num_wait ? wait : NULL, &event) < 0) {
+      perror("Couldn't enqueue the kernel");
+      exit(1);
+   }
+   if(trace_active()) {
+      name[0] = '\0';
+      clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, NULL);
+      trace_event(event, name, "kernel");
+   }
+   return event;
+}
+
+cl_event asp_pipeline_read(struct asp_session* s, cl_mem buffer, size_t size, void* host,
+      cl_uint num_wait, const cl_event* wait) {
+
+   cl_event event;
+
+   if(clEnqueueReadBuffer(s->pipe_queues[ASP_PIPE_READ], buffer, CL_FALSE, 0, size, host, 
+         num_wait, num_wait ? wait : NULL, &event) < 0) {
+      perror("Couldn't read the buffer");
+      exit(1);
+   }
+   trace_event(event, "read", "read");
+   return event;
+}
+
+void asp_pipeline_flush(struct asp_session* s) {
+   for(int i = 0; i < 3; i++)
+      clFlush(s->pipe_queues[i]);
+}
+
+
+/* Launch configurations
+
+   Every kernel reads its launch configuration from asp_config(): the 
+   defaults below, replaced by the tuning database entry of this device when 
+   there is one. With --autotune (ASP_AUTOTUNE=1) the first call of each 
+   kernel in a session sweeps local size, global size and the kernel's own 
+   tunables on the caller's problem, keeps the fastest and stores it.
+*/
+struct tune_config* asp_config(struct asp_session* s, int which) {
+
+   struct tune_config* config = &s->config[which];
+   struct tune_config stored;
+
+   if(s->config_loaded[which])
+      return config;
+   s->config_loaded[which] = true;
+
+   memset(config, 0, sizeof(*config));
+   config->items = 1;
+   switch(which) {
+      case ASP_TUNE_SUM:
+         config->local_size = ASP_SUM_WG_SIZE;
+         break;
+      case ASP_TUNE_SUM_RANGE:
+         config->local_size = s->max_workgroup / 4;
+         break;
+      case ASP_TUNE_PI:
+         config->local_size = ASP_PI_WG_SIZE;
+         break;
+      case ASP_TUNE_GEMM:
+         config->tile = sqrt(s->max_workgroup);
+         if(config->tile > ASP_GEMM_MAX_TILE)
+            config->tile = ASP_GEMM_MAX_TILE;
+         config->local_size = config->tile * config->tile;
+         config->items = 4;
+         config->width = 4;
+         config->variant = ASP_GEMM_BLOCKED;
+         break;
+      case ASP_TUNE_CONV:
+         config->local_size = s->max_workgroup;
+         break;
+      case ASP_TUNE_REDUCE:
+         config->local_size = ASP_REDUCE_WG_SIZE;
+         break;
+   }
+
+   /* The reductions start with the variant the device should run best */
+   if(which != ASP_TUNE_GEMM && which != ASP_TUNE_CONV)
+      config->variant = s->subgroups ? ASP_VARIANT_SUBGROUP : ASP_VARIANT_VECTOR;
+
+   if(tuning_lookup(s->device, asp_tune_names[which], &stored) && 
+         stored.local_size > 0 && stored.local_size <= s->max_workgroup && stored.items > 0 &&
+         stored.variant >= 0 && stored.variant < (which == ASP_TUNE_GEMM ? ASP_GEMM_NUM_KERNELS : ASP_NUM_VARIANTS))
+      *config = stored;
+
+   return config;
+}
+
+/* Configurations worth trying for a kernel on this device */
+int asp_tune_candidates(struct asp_session* s, int which, struct tune_config* candidates, int max) {
+
+   const int sum_items[] = { 1, 4, 16, 64, 256 };
+   const int range_items[] = { 1, 16, 256 };
+   const size_t group_factors[] = { 1, 2, 4, 8, 16, 32 };
+   const int num_variants = which == ASP_TUNE_CONV ? 1 : s->subgroups ? ASP_NUM_VARIANTS : ASP_VARIANT_SUBGROUP;
+   struct tune_config c;
+   int n = 0;
+
+   memset(&c, 0, sizeof(c));
+   c.items = 1;
+
+   if(which == ASP_TUNE_GEMM) {
+      for(c.variant = 0; c.variant < ASP_GEMM_BLOCKED; c.variant++)
+         for(c.tile = 2; c.tile * c.tile <= s->max_workgroup && n < max; c.tile *= 2) {
+            c.local_size = c.tile * c.tile;
+            candidates[n++] = c;
+         }
+      /* Blocked: work-items of 2x2 to 8x8 outputs, whose two panels fit in 
+         local memory, and loads of up to `items` ints */
+      c.variant = ASP_GEMM_BLOCKED;
+      for(c.tile = 4; c.tile * c.tile <= s->max_workgroup; c.tile *= 2)
+         for(c.items = 2; c.items <= 8 && 2 * c.tile * c.tile * c.items * sizeof(cl_int) <= s->local_mem; 
+               c.items *= 2)
+            for(c.width = 1; c.width <= c.items && n < max; c.width *= 2) {
+               c.local_size = c.tile * c.tile;
+               candidates[n++] = c;
+            }
+      return n;
+   }
+
+   /* The reductions need power of two work-groups */
+   for(c.variant = 0; c.variant < num_variants; c.variant++) {
+      for(c.local_size = 16; c.local_size <= s->max_workgroup; c.local_size *= 2) {
+         switch(which) {
+            case ASP_TUNE_SUM:
+               for(int i = 0; i < 5 && n < max; i++) {
+                  c.items = sum_items[i];
+                  candidates[n++] = c;
+               }
+               break;
+            case ASP_TUNE_SUM_RANGE:
+               for(int i = 0; i < 3 && n < max; i++) {
+                  c.items = range_items[i];
+                  candidates[n++] = c;
+               }
+               break;
+            case ASP_TUNE_PI:
+            case ASP_TUNE_REDUCE:
+               for(int i = 0; i < 6 && n < max; i++) {
+                  c.num_groups = s->compute_units * group_factors[i];
+                  candidates[n++] = c;
+               }
+               break;
+            case ASP_TUNE_CONV:
+               if(n < max)
+                  candidates[n++] = c;
+               break;
+         }
+      }
+   }
+   return n;
+}
+
+typedef void (*asp_tune_fn)(struct asp_session* s, const void* args);
+
+/* Run `run` with every candidate (best of 3 kernel times), keep the fastest 
+   and store it in the tuning database */
+void asp_autotune(struct asp_session* s, int which, asp_tune_fn run, const void* args) {
+
+   struct tune_config candidates[ASP_MAX_CANDIDATES], best;
+   struct tune_config* config = asp_config(s, which);
+   bool verbose = s->verbose;
+   int num_candidates;
+
+   s->tuned[which] = true;
+   num_candidates = asp_tune_candidates(s, which, candidates, ASP_MAX_CANDIDATES);
+   best = *config;
+   best.ms = -1;
+
+   s->tuning = true;
+   s->verbose = false;
+   for(int c = 0; c < num_candidates; c++) {
+      double ms = -1;
+      *config = candidates[c];
+      for(int rep = 0; rep < 3; rep++) {
+         s->tune_failed = false;
+         run(s, args);
+         asp_transfer_ms(s);
+         if(s->tune_failed) {
+            ms = -1;
+            break;
+         }
+         if(ms < 0 || asp_kernel_ms(s) < ms)
+            ms = asp_kernel_ms(s);
+      }
+      if(ms >= 0 && (best.ms < 0 || ms < best.ms)) {
+         best = candidates[c];
+         best.ms = ms;
+      }
+   }
+   s->tuning = false;
+   s->verbose = verbose;
+
+   if(best.ms < 0) {
+      s->config_loaded[which] = false;
+      asp_config(s, which);
+      return;
+   }
+
+   *config = best;
+   tuning_store(s->device, asp_tune_names[which], &best);
+   printf("Autotune %s: local %zu groups %zu tile %d items %d width %d variant %s -> %.3f ms (%d configurations)\n",
+         asp_tune_names[which], best.local_size, best.num_groups, best.tile, best.items, best.width,
+         asp_variant_name(which, best.variant), best.ms, num_candidates);
+}
+
+bool asp_should_tune(struct asp_session* s, int which) {
+   return !s->cpu && autotune_enabled() && !s->tuning && !s->tuned[which];
+}
+
+
+/* Launch planner
+
+   The kernels are grid-stride loops, so any problem size runs on any grid. 
+   asp_plan_launch() picks the grid: a power of two work-group (the tuned 
+   size, shrunk to the device's work-group and local memory limits for 
+   `local_bytes` of local memory per work-item) and enough groups for the 
+   work, but no more than ASP_GROUPS_PER_CU per compute unit (or the tuned 
+   number of groups): past that every work-item just loops more times. 
+   asp_get_planned_kernel() builds the kernel with -DWG_SIZE and shrinks the 
+   work-group again if the compiled kernel allows less than the device.
+*/
+struct asp_launch {
+   size_t local_size, global_size;
+   size_t num_groups, max_groups;
+   long work;                    // work-items wanted, one per element or per `items`
+};
+
+/* Largest power of two <= local_size that the device can run */
+size_t asp_fit_local(struct asp_session* s, size_t local_size, size_t local_bytes) {
+
+   size_t fit = 1;
+
+   if(local_size > s->max_workgroup)
+      local_size = s->max_workgroup;
+   if(local_bytes > 0 && local_size * local_bytes > s->local_mem)
+      local_size = s->local_mem / local_bytes;
+   while(fit * 2 <= local_size)
+      fit *= 2;
+   return fit;
+}
+
+void asp_size_grid(struct asp_launch* launch) {
+   size_t groups = (launch->work + launch->local_size - 1) / launch->local_size;
+   if(groups > launch->max_groups)
+      groups = launch->max_groups;
+   if(groups < 1)
+      groups = 1;
+   launch->num_groups = groups;
+   launch->global_size = groups * launch->local_size;
+}
+
+struct asp_launch asp_plan_launch(struct asp_session* s, int which, long work, size_t local_bytes) {
+
+   struct tune_config* config = asp_config(s, which);
+   struct asp_launch launch;
+
+   launch.work = work;
+   launch.local_size = asp_fit_local(s, config->local_size, local_bytes);
+   launch.max_groups = config->num_groups > 0 ? config->num_groups : s->compute_units * ASP_GROUPS_PER_CU;
+   if(launch.max_groups < 1)
+      launch.max_groups = 1;
+   asp_size_grid(&launch);
+   return launch;
+}
+
+/* asp_get_kernel() with WG_SIZE=launch->local_size added to the defines */
+cl_kernel asp_get_planned_kernel(struct asp_session* s, const char* file, const char* name,
+      const struct build_define* defines, int num_defines, struct asp_launch* launch) {
+
+   struct build_define all[16];
+   size_t kernel_max = 0;
+   cl_kernel kernel;
+
+   memcpy(all, defines, num_defines * sizeof(struct build_define));
+   all[num_defines].name = "WG_SIZE";
+   all[num_defines].text = NULL;
+
+   for(;;) {
+      all[num_defines].value = launch->local_size;
+      kernel = asp_get_kernel(s, file, name, all, num_defines + 1);
+      clGetKernelWorkGroupInfo(kernel, s->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_max), 
+            &kernel_max, NULL);
+      if(kernel_max == 0 || launch->local_size <= kernel_max || launch->local_size == 1)
+         break;
+      launch->local_size /= 2;
+   }
+   asp_size_grid(launch);
+
+   if(s->verbose)
+      printf("Num groups: %zu GlobalSize: %zu LocalSize: %zu\n", launch->num_groups, 
+            launch->global_size, launch->local_size);
+   return kernel;
+}
+
+
+/* Reductions
+
+   asp_reduce() folds n values of type ASP_INT/LONG/FLOAT/DOUBLE with any
+   operator of asp_cpu.h (sum, min, max, argmin, argmax, count-if) entirely
+   on the device: reduce_first leaves one partial per work-group of a 
+   persistent grid and a single work-group of reduce_next folds them, so 
+   only the result (and its position) is read back. asp_reduce_partials() 
+   runs only the folding pass over the long partial sums of add_numbers and 
+   add_numbersMPI.
+*/
+
+/* Device accumulator of a type and operator, as in reduccion.cl */
+size_t asp_reduce_acc_size(int type, int op) {
+   if(op == ASP_REDUCE_COUNT_IF || type <= ASP_LONG)
+      return sizeof(long);
+   return type == ASP_FLOAT ? sizeof(float) : sizeof(double);
+}
+
+
+/* Passes of a reduction enqueued by asp_reduce_enqueue() and not read yet */
+struct asp_reduce_pending {
+   cl_mem in, out, out_index;
+   cl_event main_event;
+   long n;
+   int type, op;
+};
+
+/* Enqueue the passes that fold `n` values of `in` to one. With `partials` 
+   set, `in` (and `in_index`) already hold accumulators of an earlier kernel 
+   and only reduce_next runs. The buffers passed in stay with the caller. The
+   kernel timed by asp_kernel_ms() is the first pass, or the caller's kernel 
+   for partials: the later passes only touch a few values */
+void asp_reduce_enqueue(struct asp_session* s, cl_mem in, cl_mem in_index, long n, int type, int op,
+      const struct asp_predicate* pred, bool partials, struct asp_reduce_pending* pending) {
+
+   const bool has_index = op == ASP_REDUCE_ARGMIN || op == ASP_REDUCE_ARGMAX;
+   const size_t acc_size = asp_reduce_acc_size(type, op);
+   const size_t local_bytes = acc_size + (has_index ? sizeof(long) : 0);
+   cl_mem src = in, src_index = in_index, dst, dst_index;
+   cl_event main_event = NULL;
+   bool first = !partials;
+   long count = n;
+   int err;
+
+   union { int i; long l; float f; double d; } threshold;
+
+   const struct build_define defines[] = { { "REDUCE_TYPE", type }, { "REDUCE_OP", op }, 
+         { "REDUCE_CMP", op == ASP_REDUCE_COUNT_IF ? pred->compare : 0 },
+         { "REDUCE_VARIANT", asp_config(s, ASP_TUNE_REDUCE)->variant } };
+
+   switch(type) {
+      case ASP_INT: threshold.i = pred ? (int) pred->threshold : 0; break;
+      case ASP_LONG: threshold.l = pred ? (long) pred->threshold : 0; break;
+      case ASP_FLOAT: threshold.f = pred ? (float) pred->threshold : 0; break;
+      default: threshold.d = pred ? pred->threshold : 0; break;
+   }
+
+   if(partials && s->last_event) {
+      clRetainEvent(s->last_event);
+      main_event = s->last_event;
+   }
+
+   while(first || count > 1) {
+      struct asp_launch launch = asp_plan_launch(s, ASP_TUNE_REDUCE, count, local_bytes);
+      bool verbose = s->verbose;
+
+      /* The grid is persistent, so there are few partials: one group folds them */
+      if(!first)
+         launch.max_groups = 1;
+
+      s->verbose = verbose && first;
+      cl_kernel kernel = asp_get_planned_kernel(s, ASP_REDUCE_FILE, first ? "reduce_first" : "reduce_next", 
+            defines, 4, &launch);
+      s->verbose = verbose;
+
+      dst = asp_acquire(s, launch.num_groups * acc_size);
+      dst_index = has_index ? asp_acquire(s, launch.num_groups * sizeof(long)) : NULL;
+
+      err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &src);
+      if(first) {
+         err |= clSetKernelArg(kernel, 1, sizeof(long), &count);
+         err |= clSetKernelArg(kernel, 2, asp_type_sizes[type], &threshold);
+      }
+      else {
+         err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &src_index);
+         err |= clSetKernelArg(kernel, 2, sizeof(long), &count);
+      }
+      err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &dst);
+      err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &dst_index);
+      if(err < 0) {
+         perror("Couldn't create a kernel argument");
+         exit(1);
+      }
+
+      asp_run(s, kernel, 1, &launch.global_size, &launch.local_size);
+      if(first && s->last_event) {
+         clRetainEvent(s->last_event);
+         main_event = s->last_event;
+      }
+
+      /* In-order queue: the pool may hand the source out again right away */
+      if(src != in) {
+         asp_release(s, src);
+         if(src_index)
+            asp_release(s, src_index);
+      }
+      src = dst;
+      src_index = dst_index;
+      count = launch.num_groups;
+      first = false;
+   }
+
+   pending->in = in;
+   pending->out = src;
+   pending->out_index = src_index;
+   pending->main_event = main_event;
+   pending->n = n;
+   pending->type = type;
+   pending->op = op;
+}
+
+/* Wait for the passes and read the result: a single value (and position) 
+   crosses the bus */
+struct asp_reduction asp_reduce_finish(struct asp_session* s, struct asp_reduce_pending* pending) {
+
+   const int type = pending->type, op = pending->op;
+   struct asp_reduction res = { 0, 0, -1 };
+   union { int i; long l; float f; double d; } value;
+   long at = -1;
+
+   asp_read(s, pending->out, asp_reduce_acc_size(type, op), &value);
+   if(pending->out_index)
+      asp_read(s, pending->out_index, sizeof(long), &at);
+   if(pending->out != pending->in) {
+      asp_release(s, pending->out);
+      if(pending->out_index)
+         asp_release(s, pending->out_index);
+   }
+   asp_set_event(s, pending->main_event);
+
+   if(op == ASP_REDUCE_COUNT_IF || type <= ASP_LONG) {
+      res.ivalue = value.l;
+      res.fvalue = value.l;
+   }
+   else {
+      res.fvalue = type == ASP_FLOAT ? value.f : value.d;
+      res.ivalue = (long) res.fvalue;
+   }
+   if((op == ASP_REDUCE_ARGMIN || op == ASP_REDUCE_ARGMAX) && pending->n > 0)
+      res.index = at;
+   return res;
+}
+
+/* Fold `n` values of `in` to one and read it back (see asp_reduce_enqueue()) */
+struct asp_reduction asp_reduce_buffer(struct asp_session* s, cl_mem in, cl_mem in_index, long n,
+      int type, int op, const struct asp_predicate* pred, bool partials) {
+
+   struct asp_reduce_pending pending;
+
+   asp_reduce_enqueue(s, in, in_index, n, type, op, pred, partials, &pending);
+   return asp_reduce_finish(s, &pending);
+}
+
+/* Sum of the `n` long partials left by a kernel in `partials` */
+long asp_reduce_partials(struct asp_session* s, cl_mem partials, long n) {
+   return asp_reduce_buffer(s, partials, NULL, n, ASP_LONG, ASP_REDUCE_SUM, NULL, true).ivalue;
+}
+
+struct asp_reduce_args {
+   const void* data;
+   long n;
+   int type, op;
+   const struct asp_predicate* pred;
+};
+
+struct asp_reduction asp_reduce_run(struct asp_session* s, const struct asp_reduce_args* a) {
+
+   cl_mem in = asp_upload(s, a->n * asp_type_sizes[a->type], a->data);
+   struct asp_reduction res = asp_reduce_buffer(s, in, NULL, a->n, a->type, a->op, a->pred, false);
+
+   asp_release(s, in);
+   return res;
+}
+
+void asp_reduce_tune_run(struct asp_session* s, const void* args) {
+   asp_reduce_run(s, (const struct asp_reduce_args*) args);
+}
+
+/* Reduce `n` values of `type` on the host with `op`. `pred` is only read 
+   by ASP_REDUCE_COUNT_IF */
+struct asp_reduction asp_reduce(struct asp_session* s, const void* data, long n, int type, int op,
+      const struct asp_predicate* pred) {
+
+   const struct asp_reduce_args args = { data, n, type, op, pred };
+   struct asp_reduction res = { 0, 0, -1 };
+
+   if(n <= 0)
+      return res;
+
+   bool host = s->cpu;
+   if(!host && type == ASP_DOUBLE && !asp_has_extension(s, "cl_khr_fp64")) {
+      fprintf(stderr, "The device has no double precision, reducing on the CPU backend\n");
+      asp_set_event(s, NULL);
+      host = true;
+   }
+
+   if(host) {
+      double start = wall_time_ms();
+      res = cpu_reduce(data, n, type, op, pred);
+      asp_cpu_done(s, "reduccion", start);
+      return res;
+   }
+
+   if(asp_should_tune(s, ASP_TUNE_REDUCE))
+      asp_autotune(s, ASP_TUNE_REDUCE, asp_reduce_tune_run, &args);
+
+   return asp_reduce_run(s, &args);
+}
+
+
+/* Streaming reduction of a binary file of `type` values (native byte
+   order), which may be much larger than device or host memory. The file is
+   mapped and goes through two pinned staging buffers of `chunk_bytes`
+   (ASP_STREAM_CHUNK with 0): while chunk i is uploaded and reduced, chunk
+   i+1 is read from disk into the other buffer. Each chunk reads back one
+   value, and the chunks are combined on the host. The call is timed by its
+   wall time */
+#define ASP_STREAM_CHUNK (64 << 20)
+
+struct asp_reduction asp_reduce_file(struct asp_session* s, const char* path, int type, int op,
+      const struct asp_predicate* pred, size_t chunk_bytes) {
+
+   const size_t elem = asp_type_sizes[type];
+   const size_t page = sysconf(_SC_PAGESIZE);
+   struct asp_reduction res = { 0, 0, -1 }, part;
+   struct asp_reduce_pending pending;
+   const char* data;
+   void* staging[2];
+   size_t size;
+   long n, chunk, chunks = 0;
+   double start, t;
+
+   data = (const char*) map_file(path, &size);
+   n = size / elem;
+   if(size % elem)
+      fprintf(stderr, "%s: ignoring %zu trailing bytes\n", path, size % elem);
+
+   /* Whole pages, so the chunks already used can be dropped */
+   if(chunk_bytes == 0)
+      chunk_bytes = ASP_STREAM_CHUNK;
+   chunk_bytes = (chunk_bytes + page - 1) / page * page;
+   chunk = chunk_bytes / elem;
+
+   bool host = s->cpu;
+   if(!host && type == ASP_DOUBLE && !asp_has_extension(s, "cl_khr_fp64")) {
+      fprintf(stderr, "The device has no double precision, reducing on the CPU backend\n");
+      asp_set_event(s, NULL);
+      host = true;
+   }
+
+   start = wall_time_ms();
+
+   if(host) {
+      for(long first = 0; first < n; first += chunk, chunks++) {
+         const long count = first + chunk <= n ? chunk : n - first;
+         part = cpu_reduce(data + first * elem, count, type, op, pred);
+         cpu_reduce_combine(&res, part, first, type, op);
+         map_file_done(data, first * elem, count * elem);
+      }
+      asp_cpu_done(s, "reduccion", start);
+   }
+   else if(n > 0) {
+      staging[0] = asp_acquire_host(s, chunk * elem);
+      staging[1] = asp_acquire_host(s, chunk * elem);
+
+      t = wall_time_ms();
+      memcpy(staging[0], data, (n < chunk ? n : chunk) * elem);
+      trace_host("file", "read", t, wall_time_ms());
+
+      for(long first = 0; first < n; first += chunk, chunks++) {
+         const long count = first + chunk <= n ? chunk : n - first;
+         const long next = first + count;
+         const bool verbose = s->verbose;
+
+         s->verbose = verbose && chunks == 0;
+         cl_mem in = asp_upload(s, count * elem, staging[chunks % 2]);
+         asp_reduce_enqueue(s, in, NULL, count, type, op, pred, false, &pending);
+         clFlush(s->queue);
+         s->verbose = verbose;
+
+         /* The upload of the chunk before this one has finished, so its
+            buffer takes the next chunk while the device works */
+         if(next < n) {
+            t = wall_time_ms();
+            memcpy(staging[(chunks + 1) % 2], data + next * elem,
+                  (next + chunk <= n ? chunk : n - next) * elem);
+            trace_host("file", "read", t, wall_time_ms());
+         }
+         map_file_done(data, first * elem, count * elem);
+
+         part = asp_reduce_finish(s, &pending);
+         asp_release(s, in);
+         cpu_reduce_combine(&res, part, first, type, op);
+      }
+
+      asp_release_host(s, staging[0]);
+      asp_release_host(s, staging[1]);
+   }
+
+   /* The span of the whole pass, not one chunk's kernel */
+   if(!host) {
+      asp_set_event(s, NULL);
+      s->call_ms = wall_time_ms() - start;
+   }
+   if(s->verbose)
+      printf("Streamed %ld values in %ld chunks of %.1f MB: %.3f GB/s\n", n, chunks,
+            chunk_bytes / 1048576.0, s->call_ms > 0 ? size / (s->call_ms * 1e6) : 0.0);
+
+   unmap_file(data, size);
+   return res;
+}
+
+
+/* Sum of offset+1 .. offset+M (add_numbers). asp_sum_start() only enqueues,
+   so several sessions can work at the same time; asp_sum_wait() returns the
+   result */
+void asp_sum_start(struct asp_session* s, long M, long offset) {
+
+   struct tune_config* config;
+   struct asp_launch launch;
+   cl_kernel kernel;
+   int err;
+
+   if(s->cpu) {
+      double start = wall_time_ms();
+      s->cpu_sum = cpu_sum(offset + 1, offset + M);
+      asp_cpu_done(s, "add_numbers", start);
+      return;
+   }
+
+   /* Work-items sum at least `items` numbers each with stride global_size, 
+   then each work-group reduces its local_size partial sums in local memory */
+   config = asp_config(s, ASP_TUNE_SUM);
+   const struct build_define defines[] = { { "REDUCE_VARIANT", config->variant } };
+   launch = asp_plan_launch(s, ASP_TUNE_SUM, (M + config->items - 1) / config->items, sizeof(long));
+   kernel = asp_get_planned_kernel(s, ASP_SUM_FILE, "add_numbers", defines, 1, &launch);
+   s->sum_groups = launch.num_groups;
+
+   if(s->sum_buffer)
+      asp_release(s, s->sum_buffer);
+   s->sum_buffer = asp_acquire(s, s->sum_groups * sizeof(long));
+
+   err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &s->sum_buffer);
+   err |= clSetKernelArg(kernel, 1, sizeof(long), &M);
+   err |= clSetKernelArg(kernel, 2, launch.local_size * sizeof(long), NULL);
+   err |= clSetKernelArg(kernel, 3, sizeof(long), &offset);
+   if(err < 0) {
+      perror("Couldn't create a kernel argument");
+      exit(1);
+   }
+
+   asp_run(s, kernel, 1, &launch.global_size, &launch.local_size);
+   clFlush(s->queue);
+}
+
+long asp_sum_wait(struct asp_session* s) {
+
+   long res;
+
+   if(s->cpu)
+      return s->cpu_sum;
+
+   /* The partial sums of the work-groups are folded on the device */
+   res = asp_reduce_partials(s, s->sum_buffer, s->sum_groups);
+
+   asp_release(s, s->sum_buffer);
+   s->sum_buffer = NULL;
+   return res;
+}
+
+void asp_sum_tune_run(struct asp_session* s, const void* args) {
+   asp_sum_start(s, *(const long*) args, 0);
+   asp_sum_wait(s);
+}
+
+/* Sum of 1..M */
+long asp_sum(struct asp_session* s, long M) {
+   if(asp_should_tune(s, ASP_TUNE_SUM))
+      asp_autotune(s, ASP_TUNE_SUM, asp_sum_tune_run, &M);
+
+   asp_sum_start(s, M, 0);
+   return asp_sum_wait(s);
+}
+
+unsigned long asp_sum_range_run(struct asp_session* s, long first, long last) {
+
+   const struct tune_config* config = asp_config(s, ASP_TUNE_SUM_RANGE);
+   const struct build_define defines[] = { { "REDUCE_VARIANT", config->variant } };
+   struct asp_launch launch;
+   cl_kernel kernel;
+   cl_mem sum_buffer;
+   unsigned long res;
+   int err;
+
+   launch = asp_plan_launch(s, ASP_TUNE_SUM_RANGE, (last - first + config->items) / config->items, 
+         sizeof(long));
+   kernel = asp_get_planned_kernel(s, ASP_SUM_RANGE_FILE, "add_numbersMPI", defines, 1, &launch);
+   sum_buffer = asp_acquire(s, launch.num_groups * sizeof(long));
+
+   err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &sum_buffer);
+   err |= clSetKernelArg(kernel, 1, sizeof(long), &first);
+   err |= clSetKernelArg(kernel, 2, sizeof(long), &last);
+   err |= clSetKernelArg(kernel, 3, launch.local_size * sizeof(long), NULL);
+   if(err < 0) {
+      perror("Couldn't create a kernel argument");
+      exit(1);
+   }
+
+   asp_run(s, kernel, 1, &launch.global_size, &launch.local_size);
+
+   /* The partial sums of the work-groups are folded on the device */
+   res = asp_reduce_partials(s, sum_buffer, launch.num_groups);
+
+   asp_release(s, sum_buffer);
+   return res;
+}
+
+void asp_sum_range_tune_run(struct asp_session* s, const void* args) {
+   const long* range = (const long*) args;
+   asp_sum_range_run(s, range[0], range[1]);
+}
+
+/* Sum of first..last with 64-bit bounds (add_numbersMPI kernel) */
+unsigned long asp_sum_range(struct asp_session* s, long first, long last) {
+
+   const long range[2] = { first, last };
+
+   if(s->cpu) {
+      double start = wall_time_ms();
+      unsigned long res = cpu_sum(first, last);
+      asp_cpu_done(s, "add_numbersMPI", start);
+      return res;
+   }
+
+   if(asp_should_tune(s, ASP_TUNE_SUM_RANGE))
+      asp_autotune(s, ASP_TUNE_SUM_RANGE, asp_sum_range_tune_run, range);
+
+   return asp_sum_range_run(s, first, last);
+}
+
+
+/* Samplers of pi_opencl.cl (-DSAMPLER): the Philox stream, or Sobol 
+   quasi-random points with a digital shift drawn from the seed, which 
+   converge faster but only go up to ASP_SOBOL_MAX_POINTS */
+enum { ASP_SAMPLER_PHILOX, ASP_SAMPLER_SOBOL, ASP_NUM_SAMPLERS };
+const char* asp_sampler_names[ASP_NUM_SAMPLERS] = { "philox", "sobol" };
+#define ASP_SOBOL_MAX_POINTS (1ul << 32)
+
+/* Points first .. first+M-1 of the stream `seed` that fall inside the
+   circle. The samples depend only on (seed, point), not on the grid, so the
+   count is reproducible on any device and disjoint ranges can be split 
+   between devices. The 64-bit group counts are folded on the device */
+unsigned long asp_pi_run(struct asp_session* s, unsigned long first, unsigned long M, unsigned long seed,
+      int sampler) {
+
+   struct asp_launch launch;
+   size_t local_size, global_size;
+   cl_mem part_dentros_buffer;
+   unsigned long total_dentros;
+   cl_kernel kernel;
+   int err;
+
+   if(M == 0)
+      return 0;
+
+   /* Work items go over point pairs (Philox) or blocks of 8 points (Sobol) */
+   const struct build_define defines[] = { { "REDUCE_VARIANT", asp_config(s, ASP_TUNE_PI)->variant },
+         { "SAMPLER", sampler } };
+   launch = asp_plan_launch(s, ASP_TUNE_PI, sampler == ASP_SAMPLER_SOBOL ? (M + 7) / 8 + 1 : (M + 1) / 2 + 1,
+         sizeof(cl_ulong));
+   kernel = asp_get_planned_kernel(s, ASP_PI_FILE, "pi_opencl", defines, 2, &launch);
+   local_size = launch.local_size;
+   global_size = launch.global_size;
+
+   part_dentros_buffer = asp_acquire(s, launch.num_groups * sizeof(cl_ulong));
+
+   err = clSetKernelArg(kernel, 0, local_size * sizeof(cl_ulong), NULL);
+   err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &part_dentros_buffer);
+   err |= clSetKernelArg(kernel, 2, sizeof(cl_ulong), &first);
+   err |= clSetKernelArg(kernel, 3, sizeof(cl_ulong), &M);
+   err |= clSetKernelArg(kernel, 4, sizeof(cl_ulong), &seed);
+   if(err < 0) {
+      perror("Couldn't create a kernel argument");
+      exit(1);
+   }
+
+   asp_run(s, kernel, 1, &global_size, &local_size);
+   total_dentros = asp_reduce_partials(s, part_dentros_buffer, launch.num_groups);
+
+   asp_release(s, part_dentros_buffer);
+   return total_dentros;
+}
+
+struct asp_pi_args {
+   unsigned long first, M, seed;
+   int sampler;
+};
+
+void asp_pi_tune_run(struct asp_session* s, const void* args) {
+   const struct asp_pi_args* a = (const struct asp_pi_args*) args;
+   asp_pi_run(s, a->first, a->M, a->seed, a->sampler);
+}
+
+/* Points of first .. first+M-1 inside the circle, on the device or the CPU
+   backend (the same count). Tuning uses at most 2^24 points */
+unsigned long asp_pi_hits(struct asp_session* s, unsigned long first, unsigned long M, unsigned long seed,
+      int sampler) {
+
+   const struct asp_pi_args tune = { first, M < (1ul << 24) ? M : (1ul << 24), seed, sampler };
+
+   if(sampler == ASP_SAMPLER_SOBOL && (first > ASP_SOBOL_MAX_POINTS || M > ASP_SOBOL_MAX_POINTS - first)) {
+      fprintf(stderr, "The Sobol sampler has at most 2^32 points\n");
+      exit(1);
+   }
+
+   if(s->cpu) {
+      double start = wall_time_ms();
+      unsigned long hits = sampler == ASP_SAMPLER_SOBOL ? cpu_pi_hits_sobol(first, M, seed) 
+            : cpu_pi_hits(first, M, seed);
+      asp_cpu_done(s, "pi_opencl", start);
+      return hits;
+   }
+
+   if(asp_should_tune(s, ASP_TUNE_PI))
+      asp_autotune(s, ASP_TUNE_PI, asp_pi_tune_run, &tune);
+
+   return asp_pi_run(s, first, M, seed, sampler);
+}
+
+/* Monte Carlo estimate of pi with the first M points of the stream `seed` */
+double asp_pi(struct asp_session* s, unsigned long M, unsigned long seed) {
+   return M > 0 ? 4.0 * asp_pi_hits(s, 0, M, seed, ASP_SAMPLER_PHILOX) / M : 0.0;
+}
+
+
+/* Adaptive pi
+
+   asp_pi_adaptive() runs batches over consecutive ranges of the stream
+   until the standard error of the estimate reaches the absolute or relative
+   target, the time budget is spent or max_points are used (whichever comes
+   first; zero disables a limit). A hit is a Bernoulli variable, so its
+   variance p(1-p) follows from the count and only the count of each batch
+   comes back. The next batch is sized from the points the current error
+   says are still missing (at most 4x the points so far) and the measured
+   rate, so the run does not go much past the target. The points used are
+   the first `points` of the Philox stream: asp_pi_hits() over 0 .. points-1
+   gives the same count. The error estimate needs independent samples, so 
+   there is no Sobol version.
+*/
+#define ASP_PI_BATCH (1ul << 24)
+
+struct asp_pi_target {
+   double abs_error, rel_error;  // standard error of pi
+   double time_ms;
+   unsigned long max_points;
+   unsigned long batch;          // first batch, ASP_PI_BATCH with 0
+};
+
+struct asp_pi_estimate {
+   double pi, error;
+   unsigned long points, hits;
+   int batches;
+};
+
+struct asp_pi_estimate asp_pi_adaptive(struct asp_session* s, const struct asp_pi_target* target,
+      unsigned long seed) {
+
+   struct asp_pi_estimate e = { 0, 0, 0, 0, 0 };
+   const unsigned long first_batch = target->batch ? target->batch : ASP_PI_BATCH;
+   unsigned long batch = first_batch;
+   double start = wall_time_ms(), elapsed, p, goal, needed;
+   bool done;
+
+   if(target->max_points > 0 && batch > target->max_points)
+      batch = target->max_points;
+
+   do {
+      e.hits += asp_pi_hits(s, e.points, batch, seed, ASP_SAMPLER_PHILOX);
+      e.points += batch;
+      e.batches++;
+      elapsed = wall_time_ms() - start;
+
+      p = (double) e.hits / e.points;
+      e.pi = 4.0 * p;
+      e.error = 4.0 * sqrt(fmax(p * (1 - p), 1.0 / e.points) / e.points);
+
+      if(s->verbose)
+         printf("Batch %d: %lu points, pi = %.12f +- %.3e (%.1f ms)\n", e.batches, e.points,
+               e.pi, e.error, elapsed);
+
+      /* Smallest error asked for */
+      goal = target->abs_error;
+      if(target->rel_error > 0 && (goal <= 0 || target->rel_error * e.pi < goal))
+         goal = target->rel_error * e.pi;
+
+      done = (goal > 0 && e.error <= goal) ||
+            (target->time_ms > 0 && elapsed >= target->time_ms) ||
+            (target->max_points > 0 && e.points >= target->max_points) ||
+            (goal <= 0 && target->time_ms <= 0 && target->max_points == 0);
+
+      /* The error falls as 1/sqrt(points) */
+      needed = goal > 0 ? e.points * (e.error / goal) * (e.error / goal) : 2.0 * e.points;
+      needed = fmin(needed, 5.0 * e.points) - e.points;
+      if(target->time_ms > 0)
+         needed = fmin(needed, (target->time_ms - elapsed) * e.points / elapsed);
+      batch = needed > first_batch ? (unsigned long) needed : first_batch;
+      if(target->max_points > 0 && e.points + batch > target->max_points)
+         batch = target->max_points - e.points;
+   } while(!done);
+
+   /* The call is timed as a whole, not by its last kernel */
+   if(!s->cpu)
+      asp_set_event(s, NULL);
+   s->call_ms = wall_time_ms() - start;
+   return e;
+}
+
+
+/* Monte Carlo integration of an expression
+
+   asp_integrate() averages `integrand`, an OpenCL C expression of x[0] ..
+   x[dim-1] (1 <= dim <= ASP_MC_MAX_DIM), over M points of the box 
+   lower .. upper. The expression goes into the source of montecarlo.cl as
+   "#define INTEGRAND (expr)", untouched but for newlines turned into
+   spaces, so each integrand is a program variant like any other and a
+   syntax error shows up as a build log. Expressions longer than
+   ASP_MC_MAX_INTEGRAND characters are rejected. The per-group sums of f and f*f are
+   folded on the device; the result is volume * mean(f) with standard error
+   volume * sqrt(var(f) / (M-1)). It computes in double when the device has
+   it, else in float, and needs an OpenCL device.
+*/
+#define ASP_MC_MAX_DIM 16
+#define ASP_MC_MAX_INTEGRAND 4096
+
+struct asp_integral {
+   double value, error;
+   unsigned long points;
+};
+
+struct asp_integral asp_integrate(struct asp_session* s, const char* integrand, int dim,
+      const double* lower, const double* upper, unsigned long M, unsigned long seed) {
+
+   struct asp_integral res = { 0, 0, M };
+   struct asp_launch launch;
+   cl_mem bounds_buffer[2], sum_buffer[2];
+   double volume = 1, sum_f, sum_f2, mean, var;
+   char expr[ASP_MC_MAX_INTEGRAND + 1];
+   size_t real_size;
+   cl_kernel kernel;
+   int err;
+
+   if(dim < 1 || dim > ASP_MC_MAX_DIM) {
+      fprintf(stderr, "The dimension must be between 1 and %d\n", ASP_MC_MAX_DIM);
+      exit(1);
+   }
+   if(s->cpu) {
+      fprintf(stderr, "Integrating an expression needs an OpenCL device\n");
+      exit(1);
+   }
+   if(strlen(integrand) > ASP_MC_MAX_INTEGRAND) {
+      fprintf(stderr, "The integrand is longer than %d characters\n", ASP_MC_MAX_INTEGRAND);
+      exit(1);
+   }
+   if(M == 0)
+      return res;
+
+   /* One line of #define: the newlines become spaces, which keeps the tokens */
+   strcpy(expr, integrand);
+   for(char* c = expr; *c; c++)
+      if(*c == '\n' || *c == '\r')
+         *c = ' ';
+
+   const bool use_double = asp_has_extension(s, "cl_khr_fp64");
+   const int type = use_double ? ASP_DOUBLE : ASP_FLOAT;
+   real_size = use_double ? sizeof(cl_double) : sizeof(cl_float);
+
+   union { cl_float f[ASP_MC_MAX_DIM]; cl_double d[ASP_MC_MAX_DIM]; } low, width;
+   for(int i = 0; i < dim; i++) {
+      volume *= upper[i] - lower[i];
+      if(use_double) {
+         low.d[i] = lower[i];
+         width.d[i] = upper[i] - lower[i];
+      }
+      else {
+         low.f[i] = lower[i];
+         width.f[i] = upper[i] - lower[i];
+      }
+   }
+
+   const struct build_define defines[] = { { "INTEGRAND", 0, expr }, { "DIM", dim }, 
+         { "USE_DOUBLE", use_double }, { "REDUCE_VARIANT", asp_config(s, ASP_TUNE_PI)->variant } };
+   launch = asp_plan_launch(s, ASP_TUNE_PI, M, real_size);
+   kernel = asp_get_planned_kernel(s, ASP_MC_FILE, "mc_integrate", defines, 4, &launch);
+
+   bounds_buffer[0] = asp_upload(s, dim * real_size, &low);
+   bounds_buffer[1] = asp_upload(s, dim * real_size, &width);
+   sum_buffer[0] = asp_acquire(s, launch.num_groups * real_size);
+   sum_buffer[1] = asp_acquire(s, launch.num_groups * real_size);
+
+   cl_ulong zero = 0;
+   err = clSetKernelArg(kernel, 0, launch.local_size * real_size, NULL);
+   err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &sum_buffer[0]);
+   err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &sum_buffer[1]);
+   err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &bounds_buffer[0]);
+   err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &bounds_buffer[1]);
+   err |= clSetKernelArg(kernel, 5, sizeof(cl_ulong), &zero);
+   err |= clSetKernelArg(kernel, 6, sizeof(cl_ulong), &M);
+   err |= clSetKernelArg(kernel, 7, sizeof(cl_ulong), &seed);
+   if(err < 0) {
+      perror("Couldn't create a kernel argument");
+      exit(1);
+   }
+
+   asp_run(s, kernel, 1, &launch.global_size, &launch.local_size);
+   sum_f = asp_reduce_buffer(s, sum_buffer[0], NULL, launch.num_groups, type, ASP_REDUCE_SUM, NULL, true).fvalue;
+   sum_f2 = asp_reduce_buffer(s, sum_buffer[1], NULL, launch.num_groups, type, ASP_REDUCE_SUM, NULL, true).fvalue;
+
+   mean = sum_f / M;
+   var = M > 1 ? fmax(sum_f2 / M - mean * mean, 0) * M / (M - 1) : 0;
+   res.value = volume * mean;
+   res.error = fabs(volume) * sqrt(var / M);
+
+   for(int i = 0; i < 2; i++) {
+      asp_release(s, bounds_buffer[i]);
+      asp_release(s, sum_buffer[i]);
+   }
+   return res;
+}
+
+
+/* C = A * B for n x n row-major matrices.
+
+   The kernel works on a square multiple of TILE_SIZE (the tuned tile) and
+   computes C[col*M + row] = sum_k A'[k*M + row] * B'[k*M + col]; passing B
+   as A' and the transpose of A as B' leaves C row-major. The padding with
+   zeros is done here, up to the block of C one work-group computes. The
+   tuned variant picks the kernel; the blocked one also gets the work per
+   work-item (-DWPT, tune `items`) and the vector width (-DVW, tune `width`)
+   as build options */
+void asp_gemm_run(struct asp_session* s, const cl_uint* A, const cl_uint* B, cl_uint* C, int n) {
+
+   cl_uint *matrixes, *pad_a, *pad_b, *pad_c;
+   cl_mem matrix_a_buffer, matrix_b_buffer, matrix_c_buffer;
+   cl_kernel kernel;
+   int M, i, j, err;
+   size_t area;
+
+   const struct tune_config* config = asp_config(s, ASP_TUNE_GEMM);
+   const cl_int TILE_SIZE = config->tile;
+   const bool blocked = config->variant == ASP_GEMM_BLOCKED;
+   const cl_int WPT = blocked && config->items > 1 ? config->items : 1;
+   const cl_int VW = blocked && config->width > 1 && config->width <= TILE_SIZE * WPT ? config->width : 1;
+   const cl_int PANEL = TILE_SIZE * WPT;
+
+   M = n;
+   if (M < PANEL)
+      M = PANEL;
+   else if (M % PANEL > 0)
+      M += PANEL - (M % PANEL);
+   area = (size_t) M * M;
+
+   if(s->verbose) {
+      printf("New padded M: %d (kernel %s)\n", M, asp_gemm_kernel_names[config->variant]);
+      printf("Num groups: %d GlobalSize: %d LocalSize: %d\n", M / PANEL, (M / WPT) * (M / WPT), 
+            TILE_SIZE*TILE_SIZE);
+   }
+
+   // reserva de las 3 matrices en un solo bloque (principio de localidad)
+   matrixes = (cl_uint*) asp_acquire_host(s, area * 3 * sizeof(cl_uint));
+   memset(matrixes, 0, area * 3 * sizeof(cl_uint));
+   pad_a = &matrixes[0 * area];
+   pad_b = &matrixes[1 * area];
+   pad_c = &matrixes[2 * area];
+
+   for(i = 0; i < n; i++)
+      for(j = 0; j < n; j++) {
+         pad_a[(size_t) i*M + j] = B[(size_t) i*n + j];
+         pad_b[(size_t) j*M + i] = A[(size_t) i*n + j];
+      }
+
+   const size_t local_size[2] = { TILE_SIZE, TILE_SIZE };
+   const size_t global_size[2] = { M / WPT, M / WPT };
+   const struct build_define defines[] = { { "M", M }, { "TILE_SIZE", TILE_SIZE }, { "WPT", WPT }, 
+         { "VW", VW } };
+   kernel = asp_get_kernel(s, ASP_GEMM_FILE, asp_gemm_kernel_functions[config->variant], defines, 
+         blocked ? 4 : 2);
+
+   matrix_a_buffer = asp_upload(s, area * sizeof(cl_uint), pad_a);
+   matrix_b_buffer = asp_upload(s, area * sizeof(cl_uint), pad_b);
+   matrix_c_buffer = asp_acquire(s, area * sizeof(cl_uint));
+
+   err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &matrix_a_buffer);
+   err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &matrix_b_buffer);
+   err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &matrix_c_buffer);
+   err |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &M);
+   if(err < 0) {
+      perror("Couldn't create a kernel argument");
+      exit(1);
+   }
+
+   asp_run(s, kernel, 2, global_size, local_size);
+   asp_read(s, matrix_c_buffer, area * sizeof(cl_uint), pad_c);
+
+   for(i = 0; i < n; i++)
+      memcpy(&C[(size_t) i*n], &pad_c[(size_t) i*M], n * sizeof(cl_uint));
+
+   asp_release_host(s, matrixes);
+   asp_release(s, matrix_a_buffer);
+   asp_release(s, matrix_b_buffer);
+   asp_release(s, matrix_c_buffer);
+}
+
+
+/* asp_gemm() in row blocks: B is uploaded once, then the rows of A go up, 
+   the rows of C are computed and come back block by block */
+void asp_gemm_pipelined(struct asp_session* s, const cl_uint* A, const cl_uint* B, cl_uint* C, int n) {
+
+   cl_event events[3 * ASP_PIPELINE_MAX_CHUNKS + 1];
+   cl_event writes[ASP_PIPELINE_MAX_CHUNKS], kernels[ASP_PIPELINE_MAX_CHUNKS];
+   cl_event reads[ASP_PIPELINE_MAX_CHUNKS], write_b;
+   cl_mem a_buffers[ASP_PIPELINE_SLOTS], c_buffers[ASP_PIPELINE_SLOTS], b_buffer;
+   int chunks, rows, num_events = 0, num_slots, err;
+   size_t tile;
+   cl_kernel kernel;
+
+   asp_pipeline_init(s);
+   chunks = asp_pipeline_plan(n);
+   rows = (n + chunks - 1) / chunks;
+   chunks = (n + rows - 1) / rows;
+   num_slots = chunks < ASP_PIPELINE_SLOTS ? chunks : ASP_PIPELINE_SLOTS;
+
+   tile = asp_config(s, ASP_TUNE_GEMM)->tile;
+   const size_t local_size[2] = { tile, tile };
+   kernel = asp_get_kernel(s, ASP_GEMM_FILE, "mtrx_rows", NULL, 0);
+
+   b_buffer = asp_acquire(s, (size_t) n*n * sizeof(cl_uint));
+   for(int i = 0; i < num_slots; i++) {
+      a_buffers[i] = asp_acquire(s, (size_t) rows*n * sizeof(cl_uint));
+      c_buffers[i] = asp_acquire(s, (size_t) rows*n * sizeof(cl_uint));
+   }
+
+   write_b = asp_pipeline_write(s, b_buffer, (size_t) n*n * sizeof(cl_uint), B, 0, NULL);
+   events[num_events++] = write_b;
+
+   for(int i = 0; i < chunks; i++) {
+      const int slot = i % ASP_PIPELINE_SLOTS, first = i * rows;
+      const int count = first + rows <= n ? rows : n - first;
+      const size_t bytes = (size_t) count*n * sizeof(cl_uint);
+      const size_t global_size[2] = { ((n + tile - 1) / tile) * tile, ((count + tile - 1) / tile) * tile };
+      cl_event deps[3];
+      int num_deps = 0;
+
+      /* The slot is free again once the kernel of block i-SLOTS has read A 
+         and the read of block i-SLOTS has taken C */
+      if(i >= ASP_PIPELINE_SLOTS)
+         deps[num_deps++] = kernels[i - ASP_PIPELINE_SLOTS];
+      writes[i] = asp_pipeline_write(s, a_buffers[slot], bytes, &A[(size_t) first*n], num_deps, deps);
+
+      num_deps = 0;
+      deps[num_deps++] = writes[i];
+      deps[num_deps++] = write_b;
+      if(i >= ASP_PIPELINE_SLOTS)
+         deps[num_deps++] = reads[i - ASP_PIPELINE_SLOTS];
+
+      err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &a_buffers[slot]);
+      err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &b_buffer);
+      err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &c_buffers[slot]);
+      err |= clSetKernelArg(kernel, 3, sizeof(int), &n);
+      err |= clSetKernelArg(kernel, 4, sizeof(int), &count);
+      if(err < 0) {
+         perror("Couldn't create a kernel argument");
+         exit(1);
+      }
+      kernels[i] = asp_pipeline_run(s, kernel, 2, global_size, local_size, num_deps, deps);
+      reads[i] = asp_pipeline_read(s, c_buffers[slot], bytes, &C[(size_t) first*n], 1, &kernels[i]);
+      asp_pipeline_flush(s);
+
+      events[num_events++] = writes[i];
+      events[num_events++] = kernels[i];
+      events[num_events++] = reads[i];
+   }
+
+   asp_pipeline_finish(s, "gemm", events, num_events, chunks);
+
+   asp_release(s, b_buffer);
+   for(int i = 0; i < num_slots; i++) {
+      asp_release(s, a_buffers[i]);
+      asp_release(s, c_buffers[i]);
+   }
+}
+
+struct asp_gemm_args {
+   const cl_uint *A, *B;
+   cl_uint* C;
+   int n;
+};
+
+void asp_gemm_tune_run(struct asp_session* s, const void* args) {
+   const struct asp_gemm_args* a = (const struct asp_gemm_args*) args;
+   asp_gemm_run(s, a->A, a->B, a->C, a->n);
+}
+
+/* Fix the GEMM kernel (ASP_GEMM_NAIVE / _TILED / _BLOCKED) for the session; 
+   the autotuner leaves it alone from then on. The blocked kernel gets the 
+   default blocking unless it is the tuned one */
+void asp_gemm_select(struct asp_session* s, int kernel) {
+
+   struct tune_config* config = asp_config(s, ASP_TUNE_GEMM);
+
+   if(kernel == ASP_GEMM_BLOCKED && config->variant != ASP_GEMM_BLOCKED) {
+      if(config->tile > ASP_GEMM_MAX_TILE)
+         config->tile = ASP_GEMM_MAX_TILE;
+      config->local_size = config->tile * config->tile;
+      config->items = 4;
+      config->width = 4;
+   }
+   config->variant = kernel;
+   s->tuned[ASP_TUNE_GEMM] = true;
+}
+
+void asp_gemm(struct asp_session* s, const cl_uint* A, const cl_uint* B, cl_uint* C, int n) {
+
+   const struct asp_gemm_args args = { A, B, C, n };
+
+   if(s->cpu) {
+      double start = wall_time_ms();
+      cpu_gemm(A, B, C, n);
+      asp_cpu_done(s, "mtrx_opencl", start);
+      return;
+   }
+
+   if(pipeline_chunks() > 1 && n >= ASP_PIPELINE_MIN_GEMM) {
+      asp_gemm_pipelined(s, A, B, C, n);
+      return;
+   }
+
+   if(asp_should_tune(s, ASP_TUNE_GEMM))
+      asp_autotune(s, ASP_TUNE_GEMM, asp_gemm_tune_run, &args);
+
+   asp_gemm_run(s, A, B, C, n);
+}
+
+/* Bytes a stored matrix of `rows` x `cols` with leading dimension `ld` spans */
+size_t asp_matrix_span(long rows, long cols, long ld, int type) {
+   return rows > 0 && cols > 0 ? ((size_t) (rows - 1) * ld + cols) * asp_type_sizes[type] : 0;
+}
+
+/* Bytes `batch` matrices `stride` elements apart span */
+size_t asp_batch_span(long rows, long cols, long ld, long stride, long batch, int type) {
+   const size_t span = asp_matrix_span(rows, cols, ld, type);
+   return span > 0 && batch > 0 ? (size_t) (batch - 1) * stride * asp_type_sizes[type] + span : 0;
+}
+
+/* Arguments of the general and batched GEMM, row-major */
+void asp_gemm_check(int type, int trans_a, int trans_b, long m, long n, long k, long lda, long ldb, 
+      long ldc) {
+
+   const long a_cols = trans_a ? m : k, b_cols = trans_b ? k : n;
+
+   if(type != ASP_INT && type != ASP_FLOAT && type != ASP_DOUBLE) {
+      fprintf(stderr, "GEMM is available for int, float and double\n");
+      exit(1);
+   }
+   if(m < 0 || n < 0 || k < 0 || m > INT_MAX || n > INT_MAX || k > INT_MAX || 
+         lda < (a_cols > 1 ? a_cols : 1) || ldb < (b_cols > 1 ? b_cols : 1) || ldc < (n > 1 ? n : 1)) {
+      fprintf(stderr, "Wrong GEMM dimensions (m %ld n %ld k %ld lda %ld ldb %ld ldc %ld)\n", 
+            m, n, k, lda, ldb, ldc);
+      exit(1);
+   }
+}
+
+#define ASP_GEMM_MAX_PANEL 128       // deepest K panel of mtrx_batched
+
+/* Device part of asp_gemm_general() (mtrx_general, batch 1) and 
+   asp_gemm_batched() (mtrx_batched), row-major and checked */
+void asp_gemm_device(struct asp_session* s, bool batched, int type, int trans_a, int trans_b, 
+      long m, long n, long k, double alpha, const void* A, long lda, long stride_a, const void* B, 
+      long ldb, long stride_b, double beta, void* C, long ldc, long stride_c, long batch) {
+
+   const size_t elem = asp_type_sizes[type];
+   size_t a_size, b_size, c_size;
+   cl_mem a_buffer, b_buffer, c_buffer;
+   cl_kernel kernel;
+   cl_int tile, panel = 0, M = m, N = n, K = k, LDA = lda, LDB = ldb, LDC = ldc;
+   cl_ulong strides[3] = { stride_a, stride_b, stride_c };
+   bool c_covered;
+   int arg = 0, err;
+
+   union { int i; float f; double d; } alpha_arg, beta_arg;
+
+   /* The batched kernel takes the smallest tile that covers a product, and
+      all of k when its panels fit in half the local memory */
+   tile = asp_config(s, ASP_TUNE_GEMM)->tile;
+   if(batched) {
+      while(tile > 2 && tile / 2 >= (m > n ? m : n))
+         tile /= 2;
+      for(panel = k < ASP_GEMM_MAX_PANEL ? (k > 0 ? k : 1) : ASP_GEMM_MAX_PANEL; 
+            panel > 1 && (size_t) (2 * tile * (panel + 1)) * elem > s->local_mem / 2; panel /= 2);
+   }
+
+   const size_t local_size[3] = { tile, tile, 1 };
+   const size_t global_size[3] = { (n + tile - 1) / tile * tile, (m + tile - 1) / tile * tile, batch };
+   const struct build_define defines[] = { { "GEMM_TYPE", type }, { "TRANS_A", trans_a != ASP_NO_TRANS }, 
+         { "TRANS_B", trans_b != ASP_NO_TRANS }, { "TILE_SIZE", tile }, { "PANEL_K", panel } };
+   kernel = asp_get_kernel(s, ASP_GEMM_FILE, batched ? "mtrx_batched" : "mtrx_general", defines, 
+         batched ? 5 : 4);
+
+   if(s->verbose)
+      printf("GEMM %s %ldx%ldx%ld x %ld, GlobalSize: %zux%zux%zu LocalSize: %dx%d\n", 
+            asp_type_names[type], m, k, n, batch, global_size[0], global_size[1], global_size[2], 
+            tile, tile);
+
+   /* With k == 0 there is nothing to read from A and B, but the kernel
+      still needs buffers to bind. C is only uploaded when beta != 0, or 
+      when the read back covers elements (gaps of ldc or of the stride) 
+      that must stay as they were */
+   a_size = asp_batch_span(trans_a ? k : m, trans_a ? m : k, lda, stride_a, batch, type);
+   b_size = asp_batch_span(trans_b ? n : k, trans_b ? k : n, ldb, stride_b, batch, type);
+   c_size = asp_batch_span(m, n, ldc, stride_c, batch, type);
+   c_covered = ldc == n && (batch == 1 || stride_c == m * n);
+   a_buffer = a_size > 0 ? asp_upload(s, a_size, A) : asp_acquire(s, elem);
+   b_buffer = b_size > 0 ? asp_upload(s, b_size, B) : asp_acquire(s, elem);
+   c_buffer = beta != 0 || !c_covered ? asp_upload(s, c_size, C) : asp_acquire(s, c_size);
+
+   switch(type) {
+      case ASP_INT: alpha_arg.i = (int) alpha; beta_arg.i = (int) beta; break;
+      case ASP_FLOAT: alpha_arg.f = alpha; beta_arg.f = beta; break;
+      default: alpha_arg.d = alpha; beta_arg.d = beta; break;
+   }
+
+   err = clSetKernelArg(kernel, arg++, sizeof(cl_int), &M);
+   err |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &N);
+   err |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &K);
+   err |= clSetKernelArg(kernel, arg++, elem, &alpha_arg);
+   err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &a_buffer);
+   err |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &LDA);
+   if(batched)
+      err |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), &strides[0]);
+   err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &b_buffer);
+   err |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &LDB);
+   if(batched)
+      err |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), &strides[1]);
+   err |= clSetKernelArg(kernel, arg++, elem, &beta_arg);
+   err |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &c_buffer);
+   err |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &LDC);
+   if(batched)
+      err |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), &strides[2]);
+   if(err < 0) {
+      perror("Couldn't create a kernel argument");
+      exit(1);
+   }
+
+   asp_run(s, kernel, batched ? 3 : 2, global_size, local_size);
+   asp_read(s, c_buffer, c_size, C);
+
+   asp_release(s, a_buffer);
+   asp_release(s, b_buffer);
+   asp_release(s, c_buffer);
+}
+
+/* General GEMM: C = alpha * op(A) * op(B) + beta * C (see cpu_gemm_general())
+   for ASP_INT, ASP_FLOAT or ASP_DOUBLE, any m x k x n, row- or column-major
+   storage, transposed operands and leading dimensions. Only the spans of 
+   the matrices are copied and the kernel handles the edges, so nothing is 
+   padded */
+void asp_gemm_general(struct asp_session* s, int type, int layout, int trans_a, int trans_b,
+      long m, long n, long k, double alpha, const void* A, long lda, const void* B, long ldb,
+      double beta, void* C, long ldc) {
+
+   bool host = s->cpu;
+
+   if(layout == ASP_COL_MAJOR) {
+      asp_gemm_general(s, type, ASP_ROW_MAJOR, trans_b, trans_a, n, m, k, alpha, B, ldb, A, lda, 
+            beta, C, ldc);
+      return;
+   }
+
+   asp_gemm_check(type, trans_a, trans_b, m, n, k, lda, ldb, ldc);
+   if(m == 0 || n == 0)
+      return;
+
+   if(!host && type == ASP_DOUBLE && !asp_has_extension(s, "cl_khr_fp64")) {
+      fprintf(stderr, "The device has no double precision, multiplying on the CPU backend\n");
+      asp_set_event(s, NULL);
+      host = true;
+   }
+
+   if(host) {
+      double start = wall_time_ms();
+      cpu_gemm_general(type, layout, trans_a, trans_b, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+      asp_cpu_done(s, "mtrx_general", start);
+      return;
+   }
+
+   asp_gemm_device(s, false, type, trans_a, trans_b, m, n, k, alpha, A, lda, 0, B, ldb, 0, beta, 
+         C, ldc, 0, 1);
+}
+
+/* `batch` independent products of the same shape in a single launch, 
+   matrix i of each operand `stride_*` elements after matrix i-1 (a stride 
+   of 0 reuses one A or B for the whole batch). One or more work-groups 
+   compute each C, from operands held in local memory */
+void asp_gemm_batched(struct asp_session* s, int type, int layout, int trans_a, int trans_b,
+      long m, long n, long k, double alpha, const void* A, long lda, long stride_a, 
+      const void* B, long ldb, long stride_b, double beta, void* C, long ldc, long stride_c, 
+      long batch) {
+
+   bool host = s->cpu;
+
+   if(layout == ASP_COL_MAJOR) {
+      asp_gemm_batched(s, type, ASP_ROW_MAJOR, trans_b, trans_a, n, m, k, alpha, B, ldb, stride_b, 
+            A, lda, stride_a, beta, C, ldc, stride_c, batch);
+      return;
+   }
+
+   asp_gemm_check(type, trans_a, trans_b, m, n, k, lda, ldb, ldc);
+   if(stride_a < 0 || stride_b < 0 || (batch > 1 && stride_c * asp_type_sizes[type] < 
+         asp_matrix_span(m, n, ldc, type))) {
+      fprintf(stderr, "Wrong GEMM batch strides (%ld %ld %ld)\n", stride_a, stride_b, stride_c);
+      exit(1);
+   }
+   if(m == 0 || n == 0 || batch <= 0)
+      return;
+
+   if(!host && type == ASP_DOUBLE && !asp_has_extension(s, "cl_khr_fp64")) {
+      fprintf(stderr, "The device has no double precision, multiplying on the CPU backend\n");
+      asp_set_event(s, NULL);
+      host = true;
+   }
+
+   if(host) {
+      double start = wall_time_ms();
+      cpu_gemm_batched(type, layout, trans_a, trans_b, m, n, k, alpha, A, lda, stride_a, B, ldb, 
+            stride_b, beta, C, ldc, stride_c, batch);
+      asp_cpu_done(s, "mtrx_batched", start);
+      return;
+   }
+
+   asp_gemm_device(s, true, type, trans_a, trans_b, m, n, k, alpha, A, lda, stride_a, B, ldb, 
+         stride_b, beta, C, ldc, stride_c, batch);
+}
+
+/* asp_gemm_batched() over arrays of pointers to the matrices: they are 
+   packed into pinned staging buffers, multiplied as a strided batch and
+   the products copied back */
+void asp_gemm_batched_ptr(struct asp_session* s, int type, int layout, int trans_a, int trans_b,
+      long m, long n, long k, double alpha, const void* const* A, long lda, const void* const* B, 
+      long ldb, double beta, void* const* C, long ldc, long batch) {
+
+   const bool col = layout == ASP_COL_MAJOR;
+   const size_t elem = asp_type_sizes[type];
+   /* rows of each stored matrix, row-major or not */
+   const long a_rows = (trans_a == ASP_TRANS) != col ? k : m, a_cols = m * k / (a_rows > 0 ? a_rows : 1);
+   const long b_rows = (trans_b == ASP_TRANS) != col ? n : k, b_cols = k * n / (b_rows > 0 ? b_rows : 1);
+   const long c_rows = col ? n : m, c_cols = col ? m : n;
+   const size_t a_span = asp_matrix_span(a_rows, a_cols, lda, type);
+   const size_t b_span = asp_matrix_span(b_rows, b_cols, ldb, type);
+   const size_t c_span = asp_matrix_span(c_rows, c_cols, ldc, type);
+   char *a_pack, *b_pack, *c_pack;
+
+   if(batch <= 0 || m == 0 || n == 0)
+      return;
+
+   a_pack = (char*) asp_acquire_host(s, batch * a_span + elem);
+   b_pack = (char*) asp_acquire_host(s, batch * b_span + elem);
+   c_pack = (char*) asp_acquire_host(s, batch * c_span);
+   for(long i = 0; i < batch; i++) {
+      memcpy(a_pack + i * a_span, A[i], a_span);
+      memcpy(b_pack + i * b_span, B[i], b_span);
+      memcpy(c_pack + i * c_span, C[i], c_span);
+   }
+
+   asp_gemm_batched(s, type, layout, trans_a, trans_b, m, n, k, alpha, a_pack, lda, a_span / elem, 
+         b_pack, ldb, b_span / elem, beta, c_pack, ldc, c_span / elem, batch);
+
+   for(long i = 0; i < batch; i++)
+      memcpy(C[i], c_pack + i * c_span, c_span);
+
+   asp_release_host(s, a_pack);
+   asp_release_host(s, b_pack);
+   asp_release_host(s, c_pack);
+}
+
+/* Out-of-core GEMM
+
+   asp_gemm_streamed() multiplies row-major matrices that need not fit in 
+   any device (host memory, or files mapped with map_file()): C is cut into
+   block x block tiles and each tile is accumulated over block-deep panels
+   of A and B with mtrx_general, keeping the tile on the device between 
+   panels. Every session gets a tile as soon as it is free, so faster 
+   devices take more of them, and all the queues run at the same time; 
+   each device has two sets of pinned staging and device buffers, so 
+   packing the next panel on the host overlaps the current one */
+#define ASP_GEMM_STREAM_BLOCK 4096
+
+struct asp_gemm_worker {
+   struct asp_session* s;
+   cl_kernel kernel;
+   size_t local_size[2];
+   char *a_stage[2], *b_stage[2], *c_stage;
+   cl_mem a_buffer[2], b_buffer[2], c_buffer;
+   cl_event kernels[2];          // last kernel of each slot, NULL when free
+   cl_event read;                // read back of the tile
+   long tile, panel;             // tile being computed (-1 idle), next panel
+   long tiles;                   // tiles done
+};
+
+/* Copy the rows x cols block at `src` (leading dimension `ld`) into `dst`,
+   or the other way with `unpack` */
+void asp_copy_block(char* dst, const char* src, long rows, long cols, long ld, size_t elem, bool unpack) {
+   for(long i = 0; i < rows; i++)
+      if(unpack)
+         memcpy(dst + i * ld * elem, src + i * cols * elem, cols * elem);
+      else
+         memcpy(dst + i * cols * elem, src + i * ld * elem, cols * elem);
+}
+
+/* Non-blocking write into an existing buffer, traced like asp_upload() */
+void asp_write(struct asp_session* s, cl_mem buffer, size_t size, const void* host) {
+
+   cl_event event;
+
+   if(clEnqueueWriteBuffer(s->queue, buffer, CL_FALSE, 0, size, host, 0, NULL, &event) < 0) {
+      perror("Couldn't write the buffer");
+      exit(1);
+   }
+   trace_event(event, "write", "write");
+   asp_track_transfer(s, event);
+   clReleaseEvent(event);
+}
+
+/* Largest block whose five buffers (two slots of A and B panels and the C 
+   tile) take at most half of every device's memory */
+long asp_gemm_stream_block(struct asp_session** sessions, int num_sessions, size_t elem) {
+
+   long block = ASP_GEMM_STREAM_BLOCK;
+   cl_ulong global_mem, max_alloc;
+
+   for(int d = 0; d < num_sessions; d++) {
+      clGetDeviceInfo(sessions[d]->device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+      clGetDeviceInfo(sessions[d]->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+      while(block > 64 && (5 * block * block * elem > global_mem / 2 || block * block * elem > max_alloc))
+         block /= 2;
+   }
+   return block;
+}
+
+void asp_gemm_streamed(struct asp_session** sessions, int num_sessions, int type, long m, long n, 
+      long k, double alpha, const void* A, long lda, const void* B, long ldb, double beta, void* C, 
+      long ldc, long block) {
+
+   struct asp_gemm_worker workers[MAX_DEVICES], *w;
+   const size_t elem = asp_type_sizes[type];
+   long tiles_m, tiles_n, num_tiles, num_panels, next = 0, done = 0;
+   double start = wall_time_ms();
+   int err;
+
+   union { int i; float f; double d; } alpha_arg, beta_arg, one_arg;
+
+   asp_gemm_check(type, ASP_NO_TRANS, ASP_NO_TRANS, m, n, k, lda, ldb, ldc);
+   if(m == 0 || n == 0)
+      return;
+
+   if(num_sessions > MAX_DEVICES)
+      num_sessions = MAX_DEVICES;
+   for(int d = 0; d < num_sessions; d++)
+      if(sessions[d]->cpu || (type == ASP_DOUBLE && !asp_has_extension(sessions[d], "cl_khr_fp64"))) {
+         if(!sessions[d]->cpu)
+            fprintf(stderr, "The device has no double precision, multiplying on the CPU backend\n");
+         cpu_gemm_general(type, ASP_ROW_MAJOR, ASP_NO_TRANS, ASP_NO_TRANS, m, n, k, alpha, A, lda, 
+               B, ldb, beta, C, ldc);
+         asp_set_event(sessions[0], NULL);
+         asp_cpu_done(sessions[0], "mtrx_general", start);
+         return;
+      }
+
+   if(block <= 0)
+      block = asp_gemm_stream_block(sessions, num_sessions, elem);
+   tiles_m = (m + block - 1) / block;
+   tiles_n = (n + block - 1) / block;
+   num_tiles = tiles_m * tiles_n;
+   num_panels = k > 0 ? (k + block - 1) / block : 1;
+
+   switch(type) {
+      case ASP_INT: alpha_arg.i = (int) alpha; beta_arg.i = (int) beta; one_arg.i = 1; break;
+      case ASP_FLOAT: alpha_arg.f = alpha; beta_arg.f = beta; one_arg.f = 1; break;
+      default: alpha_arg.d = alpha; beta_arg.d = beta; one_arg.d = 1; break;
+   }
+
+   for(int d = 0; d < num_sessions; d++) {
+      w = &workers[d];
+      memset(w, 0, sizeof(*w));
+      w->s = sessions[d];
+      w->tile = -1;
+
+      const cl_int tile = asp_config(w->s, ASP_TUNE_GEMM)->tile;
+      const struct build_define defines[] = { { "GEMM_TYPE", type }, { "TRANS_A", 0 }, { "TRANS_B", 0 },
+            { "TILE_SIZE", tile } };
+      w->kernel = asp_get_kernel(w->s, ASP_GEMM_FILE, "mtrx_general", defines, 4);
+      w->local_size[0] = w->local_size[1] = tile;
+
+      for(int slot = 0; slot < 2; slot++) {
+         w->a_stage[slot] = (char*) asp_acquire_host(w->s, block * block * elem);
+         w->b_stage[slot] = (char*) asp_acquire_host(w->s, block * block * elem);
+         w->a_buffer[slot] = asp_acquire(w->s, block * block * elem);
+         w->b_buffer[slot] = asp_acquire(w->s, block * block * elem);
+      }
+      w->c_stage = (char*) asp_acquire_host(w->s, block * block * elem);
+      w->c_buffer = asp_acquire(w->s, block * block * elem);
+   }
+
+   if(sessions[0]->verbose)
+      printf("Streamed GEMM %s %ldx%ldx%ld: %ld tiles of %ld, %ld panels each, %d devices\n",
+            asp_type_names[type], m, k, n, num_tiles, block, num_panels, num_sessions);
+
+   while(done < num_tiles) {
+      bool progress = false;
+
+      for(int d = 0; d < num_sessions; d++) {
+         w = &workers[d];
+         const long i0 = w->tile / tiles_n * block, j0 = w->tile % tiles_n * block;
+         const cl_int bm = i0 + block <= m ? block : m - i0, bn = j0 + block <= n ? block : n - j0;
+
+         /* Tile read back: copy it out and take the next one */
+         if(w->tile >= 0 && w->panel == num_panels) {
+            cl_int status;
+            clGetEventInfo(w->read, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+            if(status != CL_COMPLETE)
+               continue;
+            clReleaseEvent(w->read);
+            asp_copy_block((char*) C + (i0 * ldc + j0) * elem, w->c_stage, bm, bn, ldc, elem, true);
+            w->tile = -1;
+            w->tiles++;
+            done++;
+            progress = true;
+         }
+
+         if(w->tile < 0) {
+            if(next == num_tiles)
+               continue;
+            w->tile = next++;
+            w->panel = 0;
+            progress = true;
+            continue;
+         }
+
+         /* Next panel: C_tile += alpha * A(i0, p0) * B(p0, j0), the first 
+            one scaled by beta (C only goes up when beta != 0) */
+         const int slot = w->panel % 2;
+         const long p0 = w->panel * block;
+         const cl_int bk = p0 + block <= k ? block : k - p0;
+         const size_t global_size[2] = { (bn + w->local_size[0] - 1) / w->local_size[0] * w->local_size[0],
+               (bm + w->local_size[1] - 1) / w->local_size[1] * w->local_size[1] };
+
+         if(w->kernels[slot] != NULL) {
+            clWaitForEvents(1, &w->kernels[slot]);
+            clReleaseEvent(w->kernels[slot]);
+            w->kernels[slot] = NULL;
+         }
+         if(w->panel == 0 && beta != 0) {
+            asp_copy_block(w->c_stage, (const char*) C + (i0 * ldc + j0) * elem, bm, bn, ldc, elem, false);
+            asp_write(w->s, w->c_buffer, bm * bn * elem, w->c_stage);
+         }
+         if(bk > 0) {
+            asp_copy_block(w->a_stage[slot], (const char*) A + (i0 * lda + p0) * elem, bm, bk, lda, elem, false);
+            asp_copy_block(w->b_stage[slot], (const char*) B + (p0 * ldb + j0) * elem, bk, bn, ldb, elem, false);
+            asp_write(w->s, w->a_buffer[slot], bm * bk * elem, w->a_stage[slot]);
+            asp_write(w->s, w->b_buffer[slot], bk * bn * elem, w->b_stage[slot]);
+         }
+
+         err = clSetKernelArg(w->kernel, 0, sizeof(cl_int), &bm);
+         err |= clSetKernelArg(w->kernel, 1, sizeof(cl_int), &bn);
+         err |= clSetKernelArg(w->kernel, 2, sizeof(cl_int), &bk);
+         err |= clSetKernelArg(w->kernel, 3, elem, &alpha_arg);
+         err |= clSetKernelArg(w->kernel, 4, sizeof(cl_mem), &w->a_buffer[slot]);
+         err |= clSetKernelArg(w->kernel, 5, sizeof(cl_int), &bk);
+         err |= clSetKernelArg(w->kernel, 6, sizeof(cl_mem), &w->b_buffer[slot]);
+         err |= clSetKernelArg(w->kernel, 7, sizeof(cl_int), &bn);
+         err |= clSetKernelArg(w->kernel, 8, elem, w->panel == 0 ? &beta_arg : &one_arg);
+         err |= clSetKernelArg(w->kernel, 9, sizeof(cl_mem), &w->c_buffer);
+         err |= clSetKernelArg(w->kernel, 10, sizeof(cl_int), &bn);
+         if(err < 0) {
+            perror("Couldn't create a kernel argument");
+            exit(1);
+         }
+         asp_run(w->s, w->kernel, 2, global_size, w->local_size);
+         clRetainEvent(w->s->last_event);
+         w->kernels[slot] = w->s->last_event;
+         w->panel++;
+
+         if(w->panel == num_panels) {
+            if(clEnqueueReadBuffer(w->s->queue, w->c_buffer, CL_FALSE, 0, bm * bn * elem, w->c_stage, 
+                  0, NULL, &w->read) < 0) {
+               perror("Couldn't read the buffer");
+               exit(1);
+            }
+            trace_event(w->read, "read", "read");
+            asp_track_transfer(w->s, w->read);
+         }
+         clFlush(w->s->queue);
+         progress = true;
+      }
+
+      /* Every device busy reading back: wait for the first one */
+      if(!progress)
+         for(int d = 0; d < num_sessions; d++)
+            if(workers[d].tile >= 0) {
+               clWaitForEvents(1, &workers[d].read);
+               break;
+            }
+   }
+
+   for(int d = 0; d < num_sessions; d++) {
+      w = &workers[d];
+      clFinish(w->s->queue);
+      for(int slot = 0; slot < 2; slot++) {
+         if(w->kernels[slot] != NULL)
+            clReleaseEvent(w->kernels[slot]);
+         asp_release_host(w->s, w->a_stage[slot]);
+         asp_release_host(w->s, w->b_stage[slot]);
+         asp_release(w->s, w->a_buffer[slot]);
+         asp_release(w->s, w->b_buffer[slot]);
+      }
+      asp_release_host(w->s, w->c_stage);
+      asp_release(w->s, w->c_buffer);
+
+      /* The call is timed by its wall time */
+      asp_set_event(w->s, NULL);
+      w->s->call_ms = wall_time_ms() - start;
+      if(w->s->verbose && num_sessions > 1) {
+         char name[256];
+         asp_device_name(w->s, name, sizeof(name));
+         printf("Device %d (%s): %ld tiles\n", d, name, w->tiles);
+      }
+   }
+}
+
+/* Convolution
+
+   asp_convolve() convolves N values of `type` (int, float or double) with 
+   any filter of 2*radius+1 taps, with the semantics of cpu_convolve(): the
+   ends are computed too, reading zeros or the nearest input past them. 
+   The filter goes to __constant memory and conv_opencl is built for the 
+   radius, type and edge mode, staging each tile plus halo in local memory.
+   A filter too large for the device's constant or local memory, or doubles
+   without cl_khr_fp64, run on the CPU backend. asp_conv1d() is the same 
+   call with the int filter -radius .. radius and zero edges */
+
+/* Largest work-group <= local_size whose tile plus halo fits in local 
+   memory, 0 if not even one work-item does */
+size_t asp_conv_local(struct asp_session* s, size_t local_size, int radius, size_t elem) {
+   while(local_size > 1 && (local_size + 2*radius) * elem > s->local_mem)
+      local_size /= 2;
+   return (local_size + 2*radius) * elem <= s->local_mem ? local_size : 0;
+}
+
+cl_kernel asp_conv_kernel(struct asp_session* s, int type, int radius, int edge, struct asp_launch* launch) {
+
+   const struct build_define defines[] = { { "CONV_TYPE", type }, { "RADIUS", radius }, { "EDGE", edge } };
+
+   launch->local_size = asp_conv_local(s, launch->local_size, radius, asp_type_sizes[type]);
+   return asp_get_planned_kernel(s, ASP_CONV_FILE, "conv_opencl", defines, 3, launch);
+}
+
+void asp_conv_args(cl_kernel kernel, cl_mem in, cl_mem out, cl_mem filter, int N, int first, int count, 
+      int in_first) {
+
+   int err;
+
+   err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &in);
+   err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &out);
+   err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &filter);
+   err |= clSetKernelArg(kernel, 3, sizeof(int), &N);
+   err |= clSetKernelArg(kernel, 4, sizeof(int), &first);
+   err |= clSetKernelArg(kernel, 5, sizeof(int), &count);
+   err |= clSetKernelArg(kernel, 6, sizeof(int), &in_first);
+   if(err < 0) {
+      perror("Couldn't create a kernel argument");
+      exit(1);
+   }
+}
+
+void asp_convolve_run(struct asp_session* s, int type, const void* in, void* out, int N, cl_mem filter, 
+      int radius, int edge) {
+
+   const size_t size = N * asp_type_sizes[type];
+   struct asp_launch launch;
+   cl_mem in_buffer, out_buffer;
+   cl_kernel kernel;
+
+   /* Persistent grid, the kernel strides over the tiles */
+   launch = asp_plan_launch(s, ASP_TUNE_CONV, N, 0);
+   kernel = asp_conv_kernel(s, type, radius, edge, &launch);
+   in_buffer = asp_upload(s, size, in);
+   out_buffer = asp_acquire(s, size);
+
+   asp_conv_args(kernel, in_buffer, out_buffer, filter, N, 0, N, 0);
+   asp_run(s, kernel, 1, &launch.global_size, &launch.local_size);
+   asp_read(s, out_buffer, size, out);
+
+   asp_release(s, in_buffer);
+   asp_release(s, out_buffer);
+}
+
+/* asp_convolve() in blocks: each block goes up with its halo of `radius` 
+   inputs on both sides, is convolved and comes back */
+void asp_convolve_pipelined(struct asp_session* s, int type, const void* in, void* out, int N, cl_mem filter,
+      int radius, int edge) {
+
+   cl_event events[3 * ASP_PIPELINE_MAX_CHUNKS];
+   cl_event writes[ASP_PIPELINE_MAX_CHUNKS], kernels[ASP_PIPELINE_MAX_CHUNKS];
+   cl_event reads[ASP_PIPELINE_MAX_CHUNKS];
+   cl_mem in_buffers[ASP_PIPELINE_SLOTS], out_buffers[ASP_PIPELINE_SLOTS];
+   const size_t elem = asp_type_sizes[type];
+   int chunks, block, num_events = 0, num_slots;
+   struct asp_launch launch;
+   cl_kernel kernel;
+
+   asp_pipeline_init(s);
+   chunks = asp_pipeline_plan(N);
+   block = (N + chunks - 1) / chunks;
+   chunks = (N + block - 1) / block;
+   num_slots = chunks < ASP_PIPELINE_SLOTS ? chunks : ASP_PIPELINE_SLOTS;
+
+   launch = asp_plan_launch(s, ASP_TUNE_CONV, block, 0);
+   kernel = asp_conv_kernel(s, type, radius, edge, &launch);
+
+   for(int i = 0; i < num_slots; i++) {
+      in_buffers[i] = asp_acquire(s, (size_t) (block + 2*radius) * elem);
+      out_buffers[i] = asp_acquire(s, (size_t) block * elem);
+   }
+
+   for(int i = 0; i < chunks; i++) {
+      const int slot = i % ASP_PIPELINE_SLOTS, first = i * block;
+      const int count = first + block <= N ? block : N - first;
+      const int in_first = first - radius > 0 ? first - radius : 0;
+      const int in_last = first + count + radius < N ? first + count + radius : N;
+      cl_event deps[2];
+      int num_deps = 0;
+
+      if(i >= ASP_PIPELINE_SLOTS)
+         deps[num_deps++] = kernels[i - ASP_PIPELINE_SLOTS];
+      writes[i] = asp_pipeline_write(s, in_buffers[slot], (size_t) (in_last - in_first) * elem, 
+            (const char*) in + in_first * elem, num_deps, deps);
+
+      num_deps = 0;
+      deps[num_deps++] = writes[i];
+      if(i >= ASP_PIPELINE_SLOTS)
+         deps[num_deps++] = reads[i - ASP_PIPELINE_SLOTS];
+
+      asp_conv_args(kernel, in_buffers[slot], out_buffers[slot], filter, N, first, count, in_first);
+      kernels[i] = asp_pipeline_run(s, kernel, 1, &launch.global_size, &launch.local_size, num_deps, deps);
+      reads[i] = asp_pipeline_read(s, out_buffers[slot], (size_t) count * elem, (char*) out + first * elem, 
+            1, &kernels[i]);
+      asp_pipeline_flush(s);
+
+      events[num_events++] = writes[i];
+      events[num_events++] = kernels[i];
+      events[num_events++] = reads[i];
+   }
+
+   asp_pipeline_finish(s, "conv", events, num_events, chunks);
+
+   for(int i = 0; i < num_slots; i++) {
+      asp_release(s, in_buffers[i]);
+      asp_release(s, out_buffers[i]);
+   }
+}
+
+struct asp_conv_args {
+   int type;
+   const void* in;
+   void* out;
+   int N;
+   cl_mem filter;
+   int radius, edge;
+};
+
+void asp_convolve_tune_run(struct asp_session* s, const void* args) {
+   const struct asp_conv_args* a = (const struct asp_conv_args*) args;
+   asp_convolve_run(s, a->type, a->in, a->out, a->N, a->filter, a->radius, a->edge);
+}
+
+void asp_convolve(struct asp_session* s, int type, const void* in, void* out, int N, const void* filter, 
+      int radius, int edge) {
+
+   const size_t elem = asp_type_sizes[type];
+   const size_t filter_size = (2*radius + 1) * elem;
+   bool host = s->cpu;
+
+   if(type == ASP_LONG || radius < 0 || edge < 0 || edge >= ASP_NUM_EDGES) {
+      fprintf(stderr, "Convolution of %s with radius %d and edge %d is not supported\n", asp_type_names[type], 
+            radius, edge);
+      exit(1);
+   }
+   if(N <= 0)
+      return;
+
+   if(!host && type == ASP_DOUBLE && !asp_has_extension(s, "cl_khr_fp64")) {
+      fprintf(stderr, "The device has no double precision, convolving on the CPU backend\n");
+      asp_set_event(s, NULL);
+      host = true;
+   }
+   if(!host && (filter_size > s->max_constant || asp_conv_local(s, 1, radius, elem) == 0)) {
+      fprintf(stderr, "A filter of radius %d does not fit in the device, convolving on the CPU backend\n", radius);
+      asp_set_event(s, NULL);
+      host = true;
+   }
+
+   if(host) {
+      double start = wall_time_ms();
+      cpu_convolve(type, in, out, N, filter, radius, edge);
+      asp_cpu_done(s, "conv_opencl", start);
+      return;
+   }
+
+   const struct asp_conv_args args = { type, in, out, N, asp_upload(s, filter_size, filter), radius, edge };
+
+   if(pipeline_chunks() > 1 && N >= ASP_PIPELINE_MIN_CONV)
+      asp_convolve_pipelined(s, type, in, out, N, args.filter, radius, edge);
+   else {
+      if(asp_should_tune(s, ASP_TUNE_CONV))
+         asp_autotune(s, ASP_TUNE_CONV, asp_convolve_tune_run, &args);
+      asp_convolve_run(s, type, in, out, N, args.filter, radius, edge);
+   }
+
+   asp_release(s, args.filter);
+}
+
+/* 1D convolution of N ints with the default filter */
+void asp_conv1d(struct asp_session* s, const cl_uint* in, cl_uint* out, int N, int radius) {
+
+   int* filter = (int*) malloc((2*radius + 1) * sizeof(int));
+
+   conv_default_filter(filter, radius);
+   asp_convolve(s, ASP_INT, in, out, N, filter, radius, ASP_EDGE_ZERO);
+   free(filter);
+}
+
+/* 2D convolution
+
+   asp_convolve2d() filters a band of rows of a float image with any 
+   (2*radius+1)^2 filter, with the semantics of cpu_convolve2d(). A 
+   separable filter (conv_separable(): Gaussian, Sobel, box...) runs as 
+   conv2d_rows and conv2d_cols, 2*(2r+1) taps per pixel instead of 
+   (2r+1)^2. Any other filter runs as conv2d_image when the device has 
+   float images (s->images), reading the band through the texture cache 
+   from one image kept in the session, and as conv2d_tiled with local-memory halos otherwise. The 16x16 tile shrinks
+   until the halo fits in local memory; filters too large for that or for 
+   the constant memory run on the CPU backend. The passes and transfers 
+   are timed together by their wall time */
+#define ASP_CONV2D_TILE 16
+
+/* Largest square tile <= ASP_CONV2D_TILE whose halo fits in local memory,
+   0 if not even one pixel does */
+size_t asp_conv2d_tile(struct asp_session* s, int radius, bool separable) {
+
+   size_t tile = ASP_CONV2D_TILE;
+   const size_t halo = 2*radius;
+
+   while(tile * tile > s->max_workgroup)
+      tile /= 2;
+   while(tile > 1 && (tile + halo) * (separable ? tile : tile + halo) * sizeof(float) > s->local_mem)
+      tile /= 2;
+   return (tile + halo) * (separable ? tile : tile + halo) * sizeof(float) <= s->local_mem ? tile : 0;
+}
+
+void asp_conv2d_args(cl_kernel kernel, cl_mem in, cl_mem out, cl_mem filter, int width, int height, int first, 
+      int rows, int in_first, int in_rows) {
+
+   int err;
+
+   err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &in);
+   err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &out);
+   err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &filter);
+   err |= clSetKernelArg(kernel, 3, sizeof(int), &width);
+   err |= clSetKernelArg(kernel, 4, sizeof(int), &height);
+   err |= clSetKernelArg(kernel, 5, sizeof(int), &first);
+   err |= clSetKernelArg(kernel, 6, sizeof(int), &rows);
+   err |= clSetKernelArg(kernel, 7, sizeof(int), &in_first);
+   err |= clSetKernelArg(kernel, 8, sizeof(int), &in_rows);
+   if(err < 0) {
+      perror("Couldn't create a kernel argument");
+      exit(1);
+   }
+}
+
+/* The session's band image, at least width x height. It only grows, so
+   the bands of a video (or of many images) reuse one allocation */
+cl_mem asp_band_image(struct asp_session* s, size_t width, size_t height) {
+
+   const cl_image_format format = { CL_R, CL_FLOAT };
+   cl_image_desc desc;
+   int err;
+
+   if(s->band_image != NULL && s->band_image_width >= width && s->band_image_height >= height)
+      return s->band_image;
+
+   if(s->band_image != NULL) {
+      clReleaseMemObject(s->band_image);
+      width = width > s->band_image_width ? width : s->band_image_width;
+      height = height > s->band_image_height ? height : s->band_image_height;
+   }
+
+   memset(&desc, 0, sizeof(desc));
+   desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+   desc.image_width = width;
+   desc.image_height = height;
+   s->band_image = clCreateImage(s->context, CL_MEM_READ_ONLY, &format, &desc, NULL, &err);
+   if(err < 0) {
+      perror("Couldn't create an image");
+      exit(1);
+   }
+   s->band_image_width = width;
+   s->band_image_height = height;
+   return s->band_image;
+}
+
+/* Every plane of the band through conv2d_image. The planes take turns in
+   the session's band image: the queue is in order, so the write of a plane
+   waits for the kernel of the one before */
+void asp_conv2d_images(struct asp_session* s, cl_kernel kernel, const float* in, cl_mem out, cl_mem filter, 
+      int width, int height, int planes, int first, int rows, int in_first, int in_rows, 
+      const size_t* local_size) {
+
+   const size_t origin[3] = { 0, 0, 0 }, region[3] = { width, in_rows, 1 };
+   const size_t global_size[3] = { (width + local_size[0] - 1) / local_size[0] * local_size[0], 
+         (rows + local_size[1] - 1) / local_size[1] * local_size[1], 1 };
+   cl_mem image = asp_band_image(s, width, in_rows);
+   cl_event event;
+   int err;
+
+   for(int p = 0; p < planes; p++) {
+      if(clEnqueueWriteImage(s->queue, image, CL_FALSE, origin, region, 0, 0, in + (size_t) p * in_rows * width,
+            0, NULL, &event) < 0) {
+         perror("Couldn't write the image");
+         exit(1);
+      }
+      trace_event(event, "write", "write");
+      asp_track_transfer(s, event);
+      clReleaseEvent(event);
+
+      err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &image);
+      err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &out);
+      err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &filter);
+      err |= clSetKernelArg(kernel, 3, sizeof(int), &width);
+      err |= clSetKernelArg(kernel, 4, sizeof(int), &height);
+      err |= clSetKernelArg(kernel, 5, sizeof(int), &first);
+      err |= clSetKernelArg(kernel, 6, sizeof(int), &rows);
+      err |= clSetKernelArg(kernel, 7, sizeof(int), &in_first);
+      err |= clSetKernelArg(kernel, 8, sizeof(int), &p);
+      if(err < 0) {
+         perror("Couldn't create a kernel argument");
+         exit(1);
+      }
+      asp_run(s, kernel, 3, global_size, local_size);
+   }
+}
+
+/* `in` holds rows in_first .. in_first+in_rows-1 of a width x height 
+   image with `planes` channels, which must include the radius rows 
+   around first .. first+rows-1 that exist; those rows go to `out` */
+void asp_convolve2d(struct asp_session* s, const float* in, float* out, int width, int height, int planes, 
+      int first, int rows, int in_first, int in_rows, const float* filter, int radius, int edge) {
+
+   const int taps = 2*radius + 1;
+   const size_t in_size = (size_t) planes * in_rows * width * sizeof(float);
+   const size_t out_size = (size_t) planes * rows * width * sizeof(float);
+   float* col = (float*) malloc(taps * sizeof(float));
+   float* row = (float*) malloc(taps * sizeof(float));
+   size_t tile, image_width = 0, image_height = 0;
+   double start = wall_time_ms();
+   bool host = s->cpu, separable;
+
+   if(radius < 0 || edge < 0 || edge >= ASP_NUM_EDGES || first < 0 || rows < 0 || first + rows > height ||
+         in_first < 0 || in_first > (first > radius ? first - radius : 0) || 
+         in_first + in_rows < (first + rows + radius < height ? first + rows + radius : height)) {
+      fprintf(stderr, "Bad band for the 2D convolution: rows %d..%d from %d..%d of %d, radius %d\n", first, 
+            first + rows - 1, in_first, in_first + in_rows - 1, height, radius);
+      exit(1);
+   }
+
+   separable = conv_separable(filter, radius, col, row);
+   if(rows == 0 || width <= 0 || planes <= 0) {
+      free(col);
+      free(row);
+      return;
+   }
+
+   tile = host ? 0 : asp_conv2d_tile(s, radius, separable);
+   if(!host && ((size_t) taps * taps * sizeof(float) > s->max_constant || tile == 0)) {
+      fprintf(stderr, "A filter of radius %d does not fit in the device, convolving on the CPU backend\n", radius);
+      asp_set_event(s, NULL);
+      host = true;
+   }
+
+   if(host) {
+      if(separable)
+         cpu_convolve2d_separable(in, out, width, height, planes, first, rows, in_first, in_rows, col, row, 
+               radius, edge);
+      else
+         cpu_convolve2d(in, out, width, height, planes, first, rows, in_first, in_rows, filter, radius, edge);
+      asp_cpu_done(s, separable ? "conv2d_separable" : "conv2d", start);
+      free(col);
+      free(row);
+      return;
+   }
+
+   if(!separable && s->images) {
+      clGetDeviceInfo(s->device, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(size_t), &image_width, NULL);
+      clGetDeviceInfo(s->device, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(size_t), &image_height, NULL);
+   }
+   const bool images = (size_t) width <= image_width && (size_t) in_rows <= image_height;
+
+   const struct build_define defines[] = { { "RADIUS", radius }, { "EDGE", edge }, { "TILE_X", tile }, 
+         { "TILE_Y", tile } };
+   const size_t local_size[3] = { tile, tile, 1 };
+   const size_t global_size[3] = { (width + tile - 1) / tile * tile, (rows + tile - 1) / tile * tile, planes };
+   cl_mem out_buffer = asp_acquire(s, out_size);
+
+   if(s->verbose)
+      printf("conv2d %s %dx%d x %d rows %d..%d, radius %d, GlobalSize: %zux%zux%zu LocalSize: %zux%zu\n", 
+            separable ? "separable" : images ? "image" : "tiled", width, height, planes, first, 
+            first + rows - 1, radius, global_size[0], global_size[1], global_size[2], tile, tile);
+
+   if(separable) {
+      const size_t rows_size[3] = { global_size[0], (in_rows + tile - 1) / tile * tile, planes };
+      cl_kernel rows_kernel = asp_get_kernel(s, ASP_CONV2D_FILE, "conv2d_rows", defines, 4);
+      cl_kernel cols_kernel = asp_get_kernel(s, ASP_CONV2D_FILE, "conv2d_cols", defines, 4);
+      cl_mem in_buffer = asp_upload(s, in_size, in);
+      cl_mem mid_buffer = asp_acquire(s, in_size);
+      cl_mem row_buffer = asp_upload(s, taps * sizeof(float), row);
+      cl_mem col_buffer = asp_upload(s, taps * sizeof(float), col);
+      int err;
+
+      err = clSetKernelArg(rows_kernel, 0, sizeof(cl_mem), &in_buffer);
+      err |= clSetKernelArg(rows_kernel, 1, sizeof(cl_mem), &mid_buffer);
+      err |= clSetKernelArg(rows_kernel, 2, sizeof(cl_mem), &row_buffer);
+      err |= clSetKernelArg(rows_kernel, 3, sizeof(int), &width);
+      err |= clSetKernelArg(rows_kernel, 4, sizeof(int), &in_rows);
+      if(err < 0) {
+         perror("Couldn't create a kernel argument");
+         exit(1);
+      }
+      asp_run(s, rows_kernel, 3, rows_size, local_size);
+
+      asp_conv2d_args(cols_kernel, mid_buffer, out_buffer, col_buffer, width, height, first, rows, in_first, 
+            in_rows);
+      asp_run(s, cols_kernel, 3, global_size, local_size);
+      asp_read(s, out_buffer, out_size, out);
+
+      asp_release(s, in_buffer);
+      asp_release(s, mid_buffer);
+      asp_release(s, row_buffer);
+      asp_release(s, col_buffer);
+   }
+   else {
+      cl_mem filter_buffer = asp_upload(s, (size_t) taps * taps * sizeof(float), filter);
+      cl_mem in_buffer = NULL;
+
+      if(images) {
+         cl_kernel kernel = asp_get_kernel(s, ASP_CONV2D_FILE, "conv2d_image", defines, 4);
+         asp_conv2d_images(s, kernel, in, out_buffer, filter_buffer, width, height, planes, first, rows, 
+               in_first, in_rows, local_size);
+      }
+      else {
+         cl_kernel kernel = asp_get_kernel(s, ASP_CONV2D_FILE, "conv2d_tiled", defines, 4);
+         in_buffer = asp_upload(s, in_size, in);
+         asp_conv2d_args(kernel, in_buffer, out_buffer, filter_buffer, width, height, first, rows, in_first, 
+               in_rows);
+         asp_run(s, kernel, 3, global_size, local_size);
+      }
+      asp_read(s, out_buffer, out_size, out);
+
+      if(in_buffer != NULL)
+         asp_release(s, in_buffer);
+      asp_release(s, filter_buffer);
+   }
+
+   asp_release(s, out_buffer);
+   free(col);
+   free(row);
+
+   asp_set_event(s, NULL);
+   s->call_ms = wall_time_ms() - start;
+}
+
+#endif
@@ -0,0 +1,614 @@
+#ifndef ASP_CPU_H
+#define ASP_CPU_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+
+#ifdef _OPENMP
+   #include <omp.h>
+#endif
+
+/* Native CPU backend
+
+   Cache-blocked, vectorized (omp simd) and OpenMP-parallel versions of the
+   sum reduction, the generic reductions, Monte Carlo pi, GEMM and the 1D 
+   and 2D convolutions, with the same semantics as the kernels. They are used as
+      - fallback when there is no OpenCL platform (or with --device host),
+      - reference for --verify,
+      - baseline in the benchmark output.
+   Without -fopenmp everything still compiles and runs on one thread.
+*/
+
+#ifdef _OPENMP
+   #define CPU_OMP(directive) _Pragma(#directive)
+#else
+   #define CPU_OMP(directive)
+#endif
+
+#define CPU_LANES 16             // point pairs generated side by side in cpu_pi_hits()
+#define CPU_BLOCK 64             // GEMM cache block (rows, depth)
+#define CPU_BLOCK_J 256          // GEMM cache block (columns)
+
+int cpu_thread_id() {
+#ifdef _OPENMP
+   return omp_get_thread_num();
+#else
+   return 0;
+#endif
+}
+
+int cpu_num_threads() {
+#ifdef _OPENMP
+   return omp_get_num_threads();
+#else
+   return 1;
+#endif
+}
+
+/* Sum of first..last */
+long cpu_sum(long first, long last) {
+
+   long res = 0;
+
+#ifdef _OPENMP
+   #pragma omp parallel for simd reduction(+: res)
+#endif
+   for(long i = first; i <= last; i++)
+      res += i;
+
+   return res;
+}
+
+/* Same generator as pi_opencl.cl: Philox4x32-10, the 4 words r[0..3] of 
+   the point pairs ctr .. ctr+CPU_LANES-1 of the stream `seed`. The lanes go
+   side by side so the rounds vectorize */
+void cpu_philox(uint64_t ctr, uint64_t seed, uint32_t r[4][CPU_LANES]) {
+
+   uint32_t k0 = (uint32_t) seed, k1 = (uint32_t) (seed >> 32);
+
+   for(int l = 0; l < CPU_LANES; l++) {
+      r[0][l] = (uint32_t) (ctr + l);
+      r[1][l] = (uint32_t) ((ctr + l) >> 32);
+      r[2][l] = r[3][l] = 0;
+   }
+
+   for(int i = 0; i < 10; i++) {
+      CPU_OMP(omp simd)
+      for(int l = 0; l < CPU_LANES; l++) {
+         uint64_t p0 = (uint64_t) 0xD2511F53u * r[0][l], p1 = (uint64_t) 0xCD9E8D57u * r[2][l];
+         uint32_t t1 = r[1][l], t3 = r[3][l];
+         r[0][l] = (uint32_t) (p1 >> 32) ^ t1 ^ k0;
+         r[1][l] = (uint32_t) p1;
+         r[2][l] = (uint32_t) (p0 >> 32) ^ t3 ^ k1;
+         r[3][l] = (uint32_t) p0;
+      }
+      k0 += 0x9E3779B9u;
+      k1 += 0xBB67AE85u;
+   }
+}
+
+#define CPU_DENTRO(x, y) ((uint64_t) ((x) >> 1) * ((x) >> 1) + (uint64_t) ((y) >> 1) * ((y) >> 1) \
+      <= ((uint64_t) 1 << 62))
+
+/* Points first .. first+M-1 of the stream `seed` inside the circle, exactly 
+   the count of pi_opencl.cl */
+uint64_t cpu_pi_hits(uint64_t first, uint64_t M, uint64_t seed) {
+
+   const uint64_t end = first + M, last = (end - 1) / 2;
+   uint64_t hits = 0;
+
+   if(M == 0)
+      return 0;
+
+   CPU_OMP(omp parallel for reduction(+: hits))
+   for(uint64_t ctr = first / 2; ctr <= last; ctr += CPU_LANES) {
+      uint32_t r[4][CPU_LANES];
+      cpu_philox(ctr, seed, r);
+      for(int l = 0; l < CPU_LANES; l++) {
+         const uint64_t p = ctr + l;
+         hits += p <= last && 2*p >= first && CPU_DENTRO(r[0][l], r[1][l]);
+         hits += p <= last && 2*p + 1 < end && CPU_DENTRO(r[2][l], r[3][l]);
+      }
+   }
+   return hits;
+}
+
+/* Sobol points of pi_opencl.cl with -DSAMPLER=1 (first + M <= 2^32): the
+   bit-reversed index and the x+1 dimension, XOR a shift from the stream */
+uint32_t cpu_sobol_x(uint32_t i) {
+   i = ((i >> 1) & 0x55555555u) | ((i & 0x55555555u) << 1);
+   i = ((i >> 2) & 0x33333333u) | ((i & 0x33333333u) << 2);
+   i = ((i >> 4) & 0x0F0F0F0Fu) | ((i & 0x0F0F0F0Fu) << 4);
+   i = ((i >> 8) & 0x00FF00FFu) | ((i & 0x00FF00FFu) << 8);
+   return (i >> 16) | (i << 16);
+}
+
+uint32_t cpu_sobol_y(uint32_t i) {
+   uint32_t y = 0, v = 0x80000000u;
+   for(; i; i >>= 1, v ^= v >> 1)
+      if(i & 1)
+         y ^= v;
+   return y;
+}
+
+uint64_t cpu_pi_hits_sobol(uint64_t first, uint64_t M, uint64_t seed) {
+
+   uint32_t shift[4][CPU_LANES];
+   uint64_t hits = 0;
+
+   cpu_philox(0, seed, shift);
+
+   CPU_OMP(omp parallel for reduction(+: hits))
+   for(uint64_t i = first; i < first + M; i++) {
+      uint32_t x = cpu_sobol_x(i) ^ shift[0][0], y = cpu_sobol_y(i) ^ shift[1][0];
+      hits += CPU_DENTRO(x, y);
+   }
+   return hits;
+}
+
+/* Monte Carlo pi with the first M points of the stream `seed` */
+double cpu_pi(uint64_t M, uint64_t seed) {
+   return M > 0 ? 4.0 * cpu_pi_hits(0, M, seed) / M : 0.0;
+}
+
+/* C = A * B, n x n row-major, 32-bit wrap-around like the kernel */
+void cpu_gemm(const uint32_t* A, const uint32_t* B, uint32_t* C, int n) {
+
+   memset(C, 0, (size_t) n * n * sizeof(uint32_t));
+
+#ifdef _OPENMP
+   #pragma omp parallel for schedule(static)
+#endif
+   for(int ii = 0; ii < n; ii += CPU_BLOCK)
+      for(int kk = 0; kk < n; kk += CPU_BLOCK)
+         for(int jj = 0; jj < n; jj += CPU_BLOCK_J) {
+            const int i_end = ii + CPU_BLOCK < n ? ii + CPU_BLOCK : n;
+            const int k_end = kk + CPU_BLOCK < n ? kk + CPU_BLOCK : n;
+            const int j_end = jj + CPU_BLOCK_J < n ? jj + CPU_BLOCK_J : n;
+            for(int i = ii; i < i_end; i++)
+               for(int k = kk; k < k_end; k++) {
+                  const uint32_t a = A[(size_t) i*n + k];
+                  uint32_t* c = &C[(size_t) i*n];
+                  const uint32_t* b = &B[(size_t) k*n];
+#ifdef _OPENMP
+                  #pragma omp simd
+#endif
+                  for(int j = jj; j < j_end; j++)
+                     c[j] += a * b[j];
+               }
+         }
+}
+
+/* Reductions (asp_reduce() and its CPU version) */
+enum { ASP_INT, ASP_LONG, ASP_FLOAT, ASP_DOUBLE, ASP_NUM_TYPES };
+enum { ASP_REDUCE_SUM, ASP_REDUCE_MIN, ASP_REDUCE_MAX, ASP_REDUCE_ARGMIN, ASP_REDUCE_ARGMAX, 
+      ASP_REDUCE_COUNT_IF, ASP_NUM_REDUCE_OPS };
+enum { ASP_LT, ASP_LE, ASP_EQ, ASP_NE, ASP_GE, ASP_GT, ASP_NUM_COMPARES };
+
+const char* asp_type_names[ASP_NUM_TYPES] = { "int", "long", "float", "double" };
+const size_t asp_type_sizes[ASP_NUM_TYPES] = { sizeof(int), sizeof(long), sizeof(float), sizeof(double) };
+const char* asp_reduce_names[ASP_NUM_REDUCE_OPS] = { "sum", "min", "max", "argmin", "argmax", "count_if" };
+const char* asp_compare_names[ASP_NUM_COMPARES] = { "lt", "le", "eq", "ne", "ge", "gt" };
+
+/* count-if keeps the elements with `x compare threshold` */
+struct asp_predicate {
+   int compare;
+   double threshold;
+};
+
+/* Result of a reduction: the value as integer (int and long inputs, counts) 
+   and as double, plus the position for argmin/argmax (-1 otherwise) */
+struct asp_reduction {
+   long ivalue;
+   double fvalue;
+   long index;
+};
+
+#define CPU_COMPARE(x, c, t) ((c) == ASP_LT ? (x) < (t) : (c) == ASP_LE ? (x) <= (t) : \
+      (c) == ASP_EQ ? (x) == (t) : (c) == ASP_NE ? (x) != (t) : (c) == ASP_GE ? (x) >= (t) : (x) > (t))
+
+/* One function per input type. Sums accumulate in long or double, the 
+   extremes keep the first position on ties like the kernel */
+#define CPU_REDUCE_FN(NAME, T, ACC)                                                    \
+struct asp_reduction NAME(const T* x, long n, int op, const struct asp_predicate* pred) { \
+   struct asp_reduction r = { 0, 0, -1 };                                               \
+   ACC acc = 0;                                                                         \
+   long count = 0;                                                                      \
+   if(op == ASP_REDUCE_SUM) {                                                           \
+      CPU_OMP(omp parallel for simd reduction(+: acc))                                  \
+      for(long i = 0; i < n; i++)                                                       \
+         acc += x[i];                                                                   \
+   }                                                                                    \
+   else if(op == ASP_REDUCE_COUNT_IF) {                                                 \
+      const T t = (T) pred->threshold;                                                  \
+      const int c = pred->compare;                                                      \
+      CPU_OMP(omp parallel for simd reduction(+: count))                                \
+      for(long i = 0; i < n; i++)                                                       \
+         count += CPU_COMPARE(x[i], c, t);                                              \
+      r.ivalue = count;                                                                 \
+      r.fvalue = count;                                                                 \
+      return r;                                                                         \
+   }                                                                                    \
+   else if(n > 0) {                                                                     \
+      const bool lower = op == ASP_REDUCE_MIN || op == ASP_REDUCE_ARGMIN;               \
+      long at = 0;                                                                      \
+      acc = x[0];                                                                       \
+      CPU_OMP(omp parallel)                                                             \
+      {                                                                                 \
+         ACC best = x[0];                                                               \
+         long best_at = 0;                                                              \
+         CPU_OMP(omp for nowait)                                                        \
+         for(long i = 0; i < n; i++)                                                    \
+            if(lower ? x[i] < best : x[i] > best) {                                     \
+               best = x[i];                                                             \
+               best_at = i;                                                             \
+            }                                                                           \
+         CPU_OMP(omp critical)                                                          \
+         if((lower ? best < acc : best > acc) || (best == acc && best_at < at)) {       \
+            acc = best;                                                                 \
+            at = best_at;                                                               \
+         }                                                                              \
+      }                                                                                 \
+      if(op == ASP_REDUCE_ARGMIN || op == ASP_REDUCE_ARGMAX)                            \
+         r.index = at;                                                                  \
+   }                                                                                    \
+   r.ivalue = (long) acc;                                                               \
+   r.fvalue = (double) acc;                                                             \
+   return r;                                                                            \
+}
+
+CPU_REDUCE_FN(cpu_reduce_int, int, long)
+CPU_REDUCE_FN(cpu_reduce_long, long, long)
+CPU_REDUCE_FN(cpu_reduce_float, float, double)
+CPU_REDUCE_FN(cpu_reduce_double, double, double)
+
+struct asp_reduction cpu_reduce(const void* data, long n, int type, int op, const struct asp_predicate* pred) {
+   switch(type) {
+      case ASP_INT: return cpu_reduce_int((const int*) data, n, op, pred);
+      case ASP_LONG: return cpu_reduce_long((const long*) data, n, op, pred);
+      case ASP_FLOAT: return cpu_reduce_float((const float*) data, n, op, pred);
+      default: return cpu_reduce_double((const double*) data, n, op, pred);
+   }
+}
+
+/* Fold the result of the block that starts at element `offset` into `acc`,
+   the result of the blocks before it (offset 0 starts a new one). On ties
+   the earlier block keeps the position */
+void cpu_reduce_combine(struct asp_reduction* acc, struct asp_reduction part, long offset,
+      int type, int op) {
+
+   const bool integer = type <= ASP_LONG || op == ASP_REDUCE_COUNT_IF;
+   const bool lower = op == ASP_REDUCE_MIN || op == ASP_REDUCE_ARGMIN;
+
+   if(part.index >= 0)
+      part.index += offset;
+   if(offset == 0) {
+      *acc = part;
+      return;
+   }
+
+   if(op == ASP_REDUCE_SUM || op == ASP_REDUCE_COUNT_IF) {
+      if(integer) {
+         acc->ivalue += part.ivalue;
+         acc->fvalue = acc->ivalue;
+      }
+      else {
+         acc->fvalue += part.fvalue;
+         acc->ivalue = (long) acc->fvalue;
+      }
+   }
+   else if(integer ? (lower ? part.ivalue < acc->ivalue : part.ivalue > acc->ivalue)
+         : (lower ? part.fvalue < acc->fvalue : part.fvalue > acc->fvalue))
+      *acc = part;
+}
+
+
+/* General GEMM (asp_gemm_general() and its CPU version)
+
+   C = alpha * op(A) * op(B) + beta * C with op(A) m x k, op(B) k x n and C 
+   m x n, each stored row- or column-major with its leading dimension, as 
+   in BLAS. With beta == 0 C is only written. Integers wrap around like 
+   the device's 32-bit arithmetic */
+enum { ASP_ROW_MAJOR, ASP_COL_MAJOR };
+enum { ASP_NO_TRANS, ASP_TRANS };
+
+#define CPU_GEMM_GENERAL(T, S) do { \
+      const T* a_ = (const T*) A; \
+      const T* b_ = (const T*) B; \
+      const T alpha_ = (T) (S) alpha, beta_ = (T) (S) beta; \
+      CPU_OMP(omp parallel for schedule(static)) \
+      for(long i = 0; i < m; i++) { \
+         T* c = (T*) C + i*ldc; \
+         for(long j = 0; j < n; j++) \
+            c[j] = beta == 0 ? 0 : beta_ * c[j]; \
+         for(long p = 0; p < k; p++) { \
+            const T a = alpha_ * (trans_a ? a_[p*lda + i] : a_[i*lda + p]); \
+            if(trans_b) \
+               for(long j = 0; j < n; j++) \
+                  c[j] += a * b_[j*ldb + p]; \
+            else { \
+               const T* b = b_ + p*ldb; \
+               CPU_OMP(omp simd) \
+               for(long j = 0; j < n; j++) \
+                  c[j] += a * b[j]; \
+            } \
+         } \
+      } \
+   } while(0)
+
+void cpu_gemm_general(int type, int layout, int trans_a, int trans_b, long m, long n, long k, 
+      double alpha, const void* A, long lda, const void* B, long ldb, double beta, void* C, long ldc) {
+
+   /* Column-major C = op(A) op(B) is row-major C' = op(B)' op(A)' */
+   if(layout == ASP_COL_MAJOR) {
+      cpu_gemm_general(type, ASP_ROW_MAJOR, trans_b, trans_a, n, m, k, alpha, B, ldb, A, lda, beta, C, ldc);
+      return;
+   }
+
+   switch(type) {
+      case ASP_INT: CPU_GEMM_GENERAL(uint32_t, int32_t); break;
+      case ASP_FLOAT: CPU_GEMM_GENERAL(float, float); break;
+      case ASP_DOUBLE: CPU_GEMM_GENERAL(double, double); break;
+   }
+}
+
+/* `batch` products, matrix i of each operand `stride_*` elements after 
+   matrix i-1. The threads split the batch (the products are small) */
+void cpu_gemm_batched(int type, int layout, int trans_a, int trans_b, long m, long n, long k, 
+      double alpha, const void* A, long lda, long stride_a, const void* B, long ldb, long stride_b,
+      double beta, void* C, long ldc, long stride_c, long batch) {
+
+   const size_t elem = asp_type_sizes[type];
+
+   CPU_OMP(omp parallel for schedule(dynamic, 16))
+   for(long i = 0; i < batch; i++)
+      cpu_gemm_general(type, layout, trans_a, trans_b, m, n, k, alpha, (const char*) A + i*stride_a*elem,
+            lda, (const char*) B + i*stride_b*elem, ldb, beta, (char*) C + i*stride_c*elem, ldc);
+}
+
+
+/* Convolution (asp_convolve() and its CPU version)
+
+   out[i] = sum of filter[t] * in[i + t - radius] for t = 0 .. 2*radius, 
+   with the inputs past either end read as zeros (ASP_EDGE_ZERO) or as the
+   nearest end (ASP_EDGE_CLAMP). Integers wrap around like the device */
+enum { ASP_EDGE_ZERO, ASP_EDGE_CLAMP, ASP_NUM_EDGES };
+
+const char* asp_edge_names[ASP_NUM_EDGES] = { "zero", "clamp" };
+
+#define CPU_CONVOLVE(T) do { \
+      const T* in_ = (const T*) in; \
+      const T* f_ = (const T*) filter; \
+      T* out_ = (T*) out; \
+      CPU_OMP(omp parallel for schedule(static)) \
+      for(long i = 0; i < N; i++) { \
+         T res = 0; \
+         for(long t = 0; t < 2*radius+1; t++) { \
+            long j = i + t - radius; \
+            if(j < 0 || j >= N) { \
+               if(edge == ASP_EDGE_ZERO) \
+                  continue; \
+               j = j < 0 ? 0 : N - 1; \
+            } \
+            res += f_[t] * in_[j]; \
+         } \
+         out_[i] = res; \
+      } \
+   } while(0)
+
+void cpu_convolve(int type, const void* in, void* out, long N, const void* filter, int radius, int edge) {
+   switch(type) {
+      case ASP_INT: CPU_CONVOLVE(uint32_t); break;
+      case ASP_FLOAT: CPU_CONVOLVE(float); break;
+      case ASP_DOUBLE: CPU_CONVOLVE(double); break;
+   }
+}
+
+/* Filter of asp_conv1d(): weights -radius .. radius */
+void conv_default_filter(int* filter, int radius) {
+   for(int t = 0; t < 2*radius+1; t++)
+      filter[t] = t - radius;
+}
+
+/* asp_conv1d() on the CPU: the default int filter, zeros past the ends */
+void cpu_conv1d(const uint32_t* in, uint32_t* out, int N, int radius) {
+
+   int* filter = (int*) malloc((2*radius+1) * sizeof(int));
+
+   conv_default_filter(filter, radius);
+   cpu_convolve(ASP_INT, in, out, N, filter, radius, ASP_EDGE_ZERO);
+   free(filter);
+}
+
+/* 2D convolution of float images (asp_convolve2d() and its CPU version)
+
+   out(x, y) = sum of filter[dy][dx] * in(x + dx - radius, y + dy - radius)
+   over each of the `planes` channels, with the same edges as above. The 
+   images go by bands of rows: `in` holds rows in_first .. in_first+in_rows-1
+   of a width x height image (plane p at in + p * in_rows * width) and the 
+   outputs are rows first .. first+rows-1 (plane p at out + p * rows * width);
+   a whole image is first = in_first = 0, rows = in_rows = height */
+float cpu_image_at(const float* in, int x, int y, int width, int height, int in_first, int in_rows, int edge) {
+   if(edge == ASP_EDGE_CLAMP) {
+      x = x < 0 ? 0 : x >= width ? width - 1 : x;
+      y = y < 0 ? 0 : y >= height ? height - 1 : y;
+   }
+   if(x < 0 || x >= width || y < 0 || y >= height || y < in_first || y >= in_first + in_rows)
+      return 0;
+   return in[(long) (y - in_first) * width + x];
+}
+
+void cpu_convolve2d(const float* in, float* out, int width, int height, int planes, int first, int rows, 
+      int in_first, int in_rows, const float* filter, int radius, int edge) {
+
+   const int taps = 2*radius + 1;
+
+   CPU_OMP(omp parallel for collapse(2) schedule(static))
+   for(int p = 0; p < planes; p++)
+      for(int y = first; y < first + rows; y++) {
+         const float* src = in + (long) p * in_rows * width;
+         float* dst = out + ((long) p * rows + y - first) * width;
+         for(int x = 0; x < width; x++) {
+            float res = 0;
+            for(int dy = 0; dy < taps; dy++)
+               for(int dx = 0; dx < taps; dx++)
+                  res += filter[dy*taps + dx] * cpu_image_at(src, x + dx - radius, y + dy - radius, width, 
+                        height, in_first, in_rows, edge);
+            dst[x] = res;
+         }
+      }
+}
+
+/* A filter that is the outer product col * row (Gaussian, Sobel, box...)
+   runs as a pass of `row` along the rows and one of `col` down the 
+   columns, 2*(2r+1) taps per output instead of (2r+1)^2. Returns the 
+   factors when every weight matches col[dy] * row[dx] within 1e-6 of the 
+   largest one */
+bool conv_separable(const float* filter, int radius, float* col, float* row) {
+
+   const int taps = 2*radius + 1;
+   int pivot = 0;
+
+   for(int i = 1; i < taps * taps; i++)
+      if(fabsf(filter[i]) > fabsf(filter[pivot]))
+         pivot = i;
+
+   const float max = fabsf(filter[pivot]);
+   for(int t = 0; t < taps; t++) {
+      col[t] = filter[t*taps + pivot % taps];
+      row[t] = max > 0 ? filter[pivot / taps * taps + t] / filter[pivot] : 0;
+   }
+   for(int i = 0; i < taps * taps; i++)
+      if(fabsf(filter[i] - col[i / taps] * row[i % taps]) > 1e-6f * max)
+         return false;
+   return true;
+}
+
+/* Normalized (2r+1)^2 Gaussian with sigma r/2 (r = 0 is the identity) */
+void conv_gaussian(float* filter, int radius) {
+
+   const int taps = 2*radius + 1;
+   const float sigma = radius > 0 ? radius / 2.0f : 1;
+   float sum = 0;
+
+   for(int i = 0; i < taps * taps; i++) {
+      const float dy = i / taps - radius, dx = i % taps - radius;
+      filter[i] = expf(-(dx*dx + dy*dy) / (2 * sigma * sigma));
+      sum += filter[i];
+   }
+   for(int i = 0; i < taps * taps; i++)
+      filter[i] /= sum;
+}
+
+/* The two passes of a separable filter; the row pass covers all the rows
+   in `in`, which the column pass needs for its halo */
+void cpu_convolve2d_separable(const float* in, float* out, int width, int height, int planes, int first, 
+      int rows, int in_first, int in_rows, const float* col, const float* row, int radius, int edge) {
+
+   float* mid = (float*) malloc((size_t) planes * in_rows * width * sizeof(float) + 1);
+
+   CPU_OMP(omp parallel for collapse(2) schedule(static))
+   for(int p = 0; p < planes; p++)
+      for(int y = 0; y < in_rows; y++) {
+         const float* src = in + ((long) p * in_rows + y) * width;
+         float* dst = mid + ((long) p * in_rows + y) * width;
+         for(int x = 0; x < width; x++) {
+            float res = 0;
+            for(int t = 0; t < 2*radius + 1; t++)
+               res += row[t] * cpu_image_at(src, x + t - radius, 0, width, 1, 0, 1, edge);
+            dst[x] = res;
+         }
+      }
+
+   CPU_OMP(omp parallel for collapse(2) schedule(static))
+   for(int p = 0; p < planes; p++)
+      for(int y = first; y < first + rows; y++) {
+         const float* src = mid + (long) p * in_rows * width;
+         float* dst = out + ((long) p * rows + y - first) * width;
+         for(int x = 0; x < width; x++) {
+            float res = 0;
+            for(int t = 0; t < 2*radius + 1; t++)
+               res += col[t] * cpu_image_at(src, x, y + t - radius, width, height, in_first, in_rows, edge);
+            dst[x] = res;
+         }
+      }
+
+   free(mid);
+}
+
+/* Verification helpers for --verify */
+
+bool verify_exact(const char* what, const uint32_t* got, const uint32_t* ref, long n) {
+
+   for(long i = 0; i < n; i++)
+      if(got[i] != ref[i]) {
+         printf("Verify %s: FAILED at %ld (got %u, expected %u)\n", what, i, got[i], ref[i]);
+         return false;
+      }
+   printf("Verify %s: OK (%ld values)\n", what, n);
+   return true;
+}
+
+bool verify_long(const char* what, long got, long ref) {
+   printf("Verify %s: %s (got %ld, expected %ld)\n", what, got == ref ? "OK" : "FAILED", got, ref);
+   return got == ref;
+}
+
+/* Matrices of `type`: exact for integers, relative tolerance for floating
+   point (the order of the additions differs) */
+bool verify_matrix(const char* what, int type, const void* got, const void* ref, long n) {
+
+   const double tol = type == ASP_FLOAT ? 1e-4 : 1e-10;
+
+   if(type == ASP_INT)
+      return verify_exact(what, (const uint32_t*) got, (const uint32_t*) ref, n);
+
+   for(long i = 0; i < n; i++) {
+      double g = type == ASP_FLOAT ? ((const float*) got)[i] : ((const double*) got)[i];
+      double r = type == ASP_FLOAT ? ((const float*) ref)[i] : ((const double*) ref)[i];
+      if(!(fabs(g - r) <= tol * fmax(1.0, fabs(r)))) {
+         printf("Verify %s: FAILED at %ld (got %.17g, expected %.17g)\n", what, i, g, r);
+         return false;
+      }
+   }
+   printf("Verify %s: OK (%ld values)\n", what, n);
+   return true;
+}
+
+/* Reductions: exact for integers and positions, relative tolerance for sums 
+   of floating point numbers (the order of the additions differs) */
+bool verify_reduction(const char* what, struct asp_reduction got, struct asp_reduction ref, 
+      int type, int op) {
+
+   bool ok;
+
+   if(type <= ASP_LONG || op == ASP_REDUCE_COUNT_IF)
+      ok = got.ivalue == ref.ivalue;
+   else if(op == ASP_REDUCE_SUM)
+      ok = fabs(got.fvalue - ref.fvalue) <= (type == ASP_FLOAT ? 1e-4 : 1e-10) * fmax(1.0, fabs(ref.fvalue));
+   else
+      ok = got.fvalue == ref.fvalue;
+   ok = ok && got.index == ref.index;
+
+   printf("Verify %s: %s (got %.17g at %ld, expected %.17g at %ld)\n", what, ok ? "OK" : "FAILED",
+         got.fvalue, got.index, ref.fvalue, ref.index);
+   return ok;
+}
+
+/* A Monte Carlo estimate of pi must be within `sigmas` standard errors */
+bool verify_pi(double got, unsigned long M, double sigmas) {
+
+   const double pi = 3.14159265358979323846;
+   double stderr_pi = 4.0 * sqrt((pi / 4) * (1 - pi / 4) / M);
+   bool ok = fabs(got - pi) <= sigmas * stderr_pi;
+
+   printf("Verify pi: %s (error %.3e, tolerance %.3e)\n", ok ? "OK" : "FAILED",
+         fabs(got - pi), sigmas * stderr_pi);
+   return ok;
+}
+
+#endif
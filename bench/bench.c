@@ -0,0 +1,403 @@
+#include "../asp.h"
+
+/* Benchmark driver for every exercise
+
+   Runs the session functions over a sweep of problem sizes, with warmup
+   iterations and N timed repetitions, and reports min, median, p95 and
+   standard deviation of the kernel, transfer and end-to-end wall times
+   together with a derived rate. Output is CSV (default) or JSON, so runs
+   of different versions can be compared; it works on any device,
+   including CPU-only PoCL. Unless --no-baseline is given, the same calls
+   on the native CPU backend (asp_cpu.h) are reported as the "cpu" timer.
+   With --pipeline the wall time the chunked GEMM and convolution saved by 
+   overlapping copies and kernels is reported as "overlap_saved".
+
+   bench [--bench B,B,...] [--sizes N,N,...] [--warmup W] [--reps R] [--format csv|json] [--out FILE]
+         [--no-baseline]
+
+   B is one of sum, sum_range, pi, gemm, conv, reduce, gemm_naive, gemm_tiled,
+   gemm_blocked, gemm_batch, conv2d and conv2d_full (all by default).
+
+   sum_range is the kernel of add_numbersMPI on a single rank, reduce is 
+   asp_reduce() summing N floats. gemm runs the session's GEMM kernel (the 
+   tuned one with --autotune), gemm_naive, gemm_tiled and gemm_blocked each
+   kernel alone, without the pipeline, so their GFLOP/s can be compared.
+   gemm_batch multiplies N independent pairs of 32x32 floats in one launch.
+   conv2d filters an N x N float image with a 9x9 Gaussian (the separable
+   path) and conv2d_full with a 9x9 filter that is not separable.
+*/
+
+#define MAX_SIZES 32
+#define MAX_REPS 1000
+
+enum { TIMER_KERNEL, TIMER_TRANSFER, TIMER_WALL, TIMER_CPU, TIMER_SAVED, NUM_TIMERS };
+const char* timer_names[NUM_TIMERS] = { "kernel", "transfer", "wall", "cpu", "overlap_saved" };
+
+enum { BENCH_SUM, BENCH_SUM_RANGE, BENCH_PI, BENCH_GEMM, BENCH_CONV, BENCH_REDUCE,
+      BENCH_GEMM_NAIVE, BENCH_GEMM_TILED, BENCH_GEMM_BLOCKED, BENCH_GEMM_BATCH, BENCH_CONV2D, 
+      BENCH_CONV2D_FULL };
+#define BATCH_DIM 32                 // edge of the gemm_batch matrices
+#define CONV2D_RADIUS 4              // 9x9 filters in conv2d and conv2d_full
+
+struct bench_def {
+   const char* name;
+   long default_sizes[4];
+   const char* rate_unit;
+};
+
+const struct bench_def benches[] = {
+   { "sum",       { 1L << 20, 1L << 24, 1L << 28, 0 }, "Gelem/s" },
+   { "sum_range", { 1L << 24, 1L << 28, 1L << 31, 0 }, "Gelem/s" },
+   { "pi",        { 1L << 22, 1L << 26, 1L << 30, 0 }, "Msamples/s" },
+   { "gemm",      { 128, 256, 512, 1024 },            "GFLOP/s" },
+   { "conv",      { 1L << 16, 1L << 20, 1L << 24, 0 }, "GB/s" },
+   { "reduce",    { 1L << 20, 1L << 24, 1L << 26, 0 }, "GB/s" },
+   { "gemm_naive", { 128, 256, 512, 1024 },           "GFLOP/s" },
+   { "gemm_tiled", { 128, 256, 512, 1024 },           "GFLOP/s" },
+   { "gemm_blocked", { 128, 256, 512, 1024 },         "GFLOP/s" },
+   { "gemm_batch", { 1L << 8, 1L << 12, 1L << 14, 0 },  "GFLOP/s" },
+   { "conv2d",    { 512, 1024, 2048, 4096 },          "Mpixel/s" },
+   { "conv2d_full", { 512, 1024, 2048, 4096 },        "Mpixel/s" },
+};
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+struct stats {
+   double min, median, p95, stddev;
+};
+
+int compare_doubles(const void* a, const void* b) {
+   double x = *(const double*) a, y = *(const double*) b;
+   return (x > y) - (x < y);
+}
+
+struct stats compute_stats(double* samples, int n) {
+
+   struct stats st;
+   double mean = 0, var = 0;
+
+   qsort(samples, n, sizeof(double), compare_doubles);
+   for(int i = 0; i < n; i++)
+      mean += samples[i] / n;
+   for(int i = 0; i < n; i++)
+      var += (samples[i] - mean) * (samples[i] - mean);
+
+   st.min = samples[0];
+   st.median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+   st.p95 = samples[(int) ceil(0.95 * n) - 1];       // nearest rank
+   st.stddev = n > 1 ? sqrt(var / (n - 1)) : 0;
+   return st;
+}
+
+bool bench_is_gemm(int b) {
+   return b == BENCH_GEMM || b == BENCH_GEMM_NAIVE || b == BENCH_GEMM_TILED || b == BENCH_GEMM_BLOCKED;
+}
+
+/* Work done by one call, in the unit of the bench's rate per ms */
+double bench_work(int b, long size) {
+   if(bench_is_gemm(b))
+      return 2.0 * size * size * size / 1e9 * 1e3;                      // GFLOP/s
+   if(b == BENCH_GEMM_BATCH)
+      return 2.0 * BATCH_DIM * BATCH_DIM * BATCH_DIM * size / 1e9 * 1e3;
+   switch(b) {
+      case BENCH_SUM: case BENCH_SUM_RANGE: return size / 1e9 * 1e3;    // Gelem/s
+      case BENCH_PI: return size / 1e6 * 1e3;                           // Msamples/s
+      case BENCH_CONV2D: case BENCH_CONV2D_FULL: return size * size / 1e6 * 1e3;  // Mpixel/s
+      case BENCH_REDUCE: return size * sizeof(float) / 1e9 * 1e3;       // GB/s (in)
+      default: return 2.0 * size * sizeof(cl_uint) / 1e9 * 1e3;         // GB/s (in + out)
+   }
+}
+
+/* Inputs of the current size, reused by every repetition */
+struct bench_data {
+   cl_uint *a, *b, *c;
+};
+
+void bench_prepare(struct asp_session* s, int b, long size, struct bench_data* data) {
+
+   memset(data, 0, sizeof(*data));
+   if(bench_is_gemm(b)) {
+      data->a = (cl_uint*) asp_acquire_host(s, size * size * sizeof(cl_uint));
+      data->b = (cl_uint*) asp_acquire_host(s, size * size * sizeof(cl_uint));
+      data->c = (cl_uint*) asp_acquire_host(s, size * size * sizeof(cl_uint));
+      for(long i = 0; i < size * size; i++) {
+         data->a[i] = i % 7;
+         data->b[i] = i % 5;
+      }
+   }
+   else if(b == BENCH_CONV) {
+      data->a = (cl_uint*) asp_acquire_host(s, size * sizeof(cl_uint));
+      data->c = (cl_uint*) asp_acquire_host(s, size * sizeof(cl_uint));
+      srand(1);
+      for(long i = 0; i < size; i++)
+         data->a[i] = rand() % 10;
+   }
+   else if(b == BENCH_GEMM_BATCH) {
+      const long n = size * BATCH_DIM * BATCH_DIM;
+      data->a = (cl_uint*) asp_acquire_host(s, n * sizeof(float));
+      data->b = (cl_uint*) asp_acquire_host(s, n * sizeof(float));
+      data->c = (cl_uint*) asp_acquire_host(s, n * sizeof(float));
+      for(long i = 0; i < n; i++) {
+         ((float*) data->a)[i] = i % 7;
+         ((float*) data->b)[i] = i % 5;
+      }
+   }
+   else if(b == BENCH_CONV2D || b == BENCH_CONV2D_FULL) {
+      const int taps = 2*CONV2D_RADIUS + 1;
+      data->a = (cl_uint*) asp_acquire_host(s, size * size * sizeof(float));
+      data->b = (cl_uint*) asp_acquire_host(s, taps * taps * sizeof(float));
+      data->c = (cl_uint*) asp_acquire_host(s, size * size * sizeof(float));
+      srand(1);
+      for(long i = 0; i < size * size; i++)
+         ((float*) data->a)[i] = rand() % 256;
+      conv_gaussian((float*) data->b, CONV2D_RADIUS);
+      if(b == BENCH_CONV2D_FULL)
+         ((float*) data->b)[0] += 0.01f;
+   }
+   else if(b == BENCH_REDUCE) {
+      data->a = (cl_uint*) asp_acquire_host(s, size * sizeof(float));
+      srand(1);
+      for(long i = 0; i < size; i++)
+         ((float*) data->a)[i] = rand() % 1000 / 1000.0f;
+   }
+}
+
+void bench_release(struct asp_session* s, struct bench_data* data) {
+   if(data->a) asp_release_host(s, data->a);
+   if(data->b) asp_release_host(s, data->b);
+   if(data->c) asp_release_host(s, data->c);
+}
+
+/* One GEMM kernel, with the tuned (or default) configuration */
+void bench_gemm_kernel(struct asp_session* s, int kernel, long size, struct bench_data* data) {
+
+   struct tune_config* config, saved;
+   bool tuned;
+
+   if(s->cpu) {
+      asp_gemm(s, data->a, data->b, data->c, size);
+      return;
+   }
+   config = asp_config(s, ASP_TUNE_GEMM);
+   saved = *config;
+   tuned = s->tuned[ASP_TUNE_GEMM];
+   asp_gemm_select(s, kernel);
+   asp_gemm_run(s, data->a, data->b, data->c, size);
+   *config = saved;
+   s->tuned[ASP_TUNE_GEMM] = tuned;
+}
+
+void bench_call(struct asp_session* s, int b, long size, struct bench_data* data) {
+   switch(b) {
+      case BENCH_SUM: asp_sum(s, size); break;
+      case BENCH_SUM_RANGE: asp_sum_range(s, 1, size); break;
+      case BENCH_PI: asp_pi(s, size, 0); break;
+      case BENCH_GEMM: asp_gemm(s, data->a, data->b, data->c, size); break;
+      case BENCH_CONV: asp_conv1d(s, data->a, data->c, size, 4); break;
+      case BENCH_REDUCE: asp_reduce(s, data->a, size, ASP_FLOAT, ASP_REDUCE_SUM, NULL); break;
+      case BENCH_GEMM_NAIVE: bench_gemm_kernel(s, ASP_GEMM_NAIVE, size, data); break;
+      case BENCH_GEMM_TILED: bench_gemm_kernel(s, ASP_GEMM_TILED, size, data); break;
+      case BENCH_GEMM_BLOCKED: bench_gemm_kernel(s, ASP_GEMM_BLOCKED, size, data); break;
+      case BENCH_GEMM_BATCH:
+         asp_gemm_batched(s, ASP_FLOAT, ASP_ROW_MAJOR, ASP_NO_TRANS, ASP_NO_TRANS, BATCH_DIM, BATCH_DIM, 
+               BATCH_DIM, 1, data->a, BATCH_DIM, BATCH_DIM * BATCH_DIM, data->b, BATCH_DIM, 
+               BATCH_DIM * BATCH_DIM, 0, data->c, BATCH_DIM, BATCH_DIM * BATCH_DIM, size);
+         break;
+      case BENCH_CONV2D:
+      case BENCH_CONV2D_FULL:
+         asp_convolve2d(s, (float*) data->a, (float*) data->c, size, size, 1, 0, size, 0, size, (float*) data->b, 
+               CONV2D_RADIUS, ASP_EDGE_CLAMP);
+         break;
+   }
+}
+
+int parse_list(char* list, long* values, int max) {
+   int n = 0;
+   for(char* tok = strtok(list, ","); tok != NULL && n < max; tok = strtok(NULL, ","))
+      values[n++] = strtol(tok, NULL, 10);
+   return n;
+}
+
+/* Every name of a comma separated --bench list is one of benches[] */
+bool known_benches(const char* selected) {
+   char list[256];
+   snprintf(list, sizeof(list), "%s", selected);
+   for(char* tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+      int b = 0;
+      while(b < NUM_BENCHES && strcmp(tok, benches[b].name) != 0)
+         b++;
+      if(b == NUM_BENCHES)
+         return false;
+   }
+   return true;
+}
+
+/* A string as a JSON literal: quotes, backslashes and control characters
+   escaped */
+void print_json_string(FILE* out, const char* text) {
+   fputc('"', out);
+   for(const unsigned char* c = (const unsigned char*) text; *c; c++)
+      if(*c == '"' || *c == '\\')
+         fprintf(out, "\\%c", *c);
+      else if(*c < 0x20)
+         fprintf(out, "\\u%04x", *c);
+      else
+         fputc(*c, out);
+   fputc('"', out);
+}
+
+/* A CSV field in quotes, with its quotes doubled (RFC 4180) */
+void print_csv_field(FILE* out, const char* text) {
+   fputc('"', out);
+   for(const char* c = text; *c; c++) {
+      if(*c == '"')
+         fputc('"', out);
+      fputc(*c, out);
+   }
+   fputc('"', out);
+}
+
+int main(int argc, char *argv[]) {
+
+   struct asp_session *session, *baseline = NULL;
+   struct bench_data data;
+   char selected[256] = "sum,sum_range,pi,gemm,conv,reduce,gemm_naive,gemm_tiled,gemm_blocked,gemm_batch,"
+         "conv2d,conv2d_full";
+   long sizes[MAX_SIZES];
+   int num_sizes = 0, warmup = 2, reps = 10;
+   bool json = false, first = true, use_baseline = true, ok = true;
+   const char* out_path = NULL;
+   char device_name[256];
+   FILE* out = stdout;
+
+   parse_common_args(&argc, argv);
+   for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+         snprintf(selected, sizeof(selected), "%s", argv[++i]);
+         ok = ok && known_benches(selected);
+      }
+      else if(strcmp(argv[i], "--sizes") == 0 && i + 1 < argc)
+         num_sizes = parse_list(argv[++i], sizes, MAX_SIZES);
+      else if(strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+         warmup = atoi(argv[++i]);
+      else if(strcmp(argv[i], "--reps") == 0 && i + 1 < argc)
+         reps = atoi(argv[++i]);
+      else if(strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+         i++;
+         json = strcmp(argv[i], "json") == 0;
+         ok = ok && (json || strcmp(argv[i], "csv") == 0);
+      }
+      else if(strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+         out_path = argv[++i];
+      else if(strcmp(argv[i], "--no-baseline") == 0)
+         use_baseline = false;
+      else
+         ok = false;
+   }
+   if(!ok) {
+      fprintf(stderr, "Usage: %s [--bench B,B,...] [--sizes N,...] [--warmup W] [--reps R] [--format csv|json] "
+            "[--out FILE] [--no-baseline]\n"
+            "       B: sum, sum_range, pi, gemm, conv, reduce, gemm_naive, gemm_tiled, gemm_blocked,\n"
+            "          gemm_batch, conv2d, conv2d_full\n", argv[0]);
+      return 1;
+   }
+   if(reps < 1) reps = 1;
+   if(reps > MAX_REPS) reps = MAX_REPS;
+
+   if(out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+      perror("Couldn't open the output file");
+      return 1;
+   }
+
+   session = asp_session_open();
+   asp_device_name(session, device_name, sizeof(device_name));
+
+   /* On the CPU backend itself the baseline would only repeat the run */
+   if(use_baseline && !session->cpu)
+      baseline = asp_session_create_cpu();
+
+   if(json) {
+      fprintf(out, "{\"device\":");
+      print_json_string(out, device_name);
+      fprintf(out, ",\"warmup\":%d,\"reps\":%d,\"results\":[\n", warmup, reps);
+   }
+   else
+      fprintf(out, "device,bench,size,timer,min_ms,median_ms,p95_ms,stddev_ms,rate,rate_unit\n");
+
+   static double samples[NUM_TIMERS][MAX_REPS];
+
+   for(int b = 0; b < NUM_BENCHES; b++) {
+      char list[sizeof(selected) + 2];
+      snprintf(list, sizeof(list), ",%s,", selected);
+      char needle[64];
+      snprintf(needle, sizeof(needle), ",%s,", benches[b].name);
+      if(strstr(list, needle) == NULL)
+         continue;
+
+      const long* bench_sizes = num_sizes > 0 ? sizes : benches[b].default_sizes;
+      int n_sizes = num_sizes > 0 ? num_sizes : 4;
+
+      for(int z = 0; z < n_sizes && bench_sizes[z] > 0; z++) {
+         long size = bench_sizes[z];
+
+         bench_prepare(session, b, size, &data);
+         for(int w = 0; w < warmup; w++)
+            bench_call(session, b, size, &data);
+         asp_transfer_ms(session);
+
+         for(int r = 0; r < reps; r++) {
+            double start = wall_time_ms();
+            session->pipeline_saved_ms = 0;
+            bench_call(session, b, size, &data);
+            samples[TIMER_WALL][r] = wall_time_ms() - start;
+            samples[TIMER_KERNEL][r] = asp_kernel_ms(session);
+            samples[TIMER_TRANSFER][r] = asp_transfer_ms(session);
+            samples[TIMER_SAVED][r] = session->pipeline_saved_ms;
+         }
+
+         /* Same inputs on the CPU backend (the pinned buffers are plain host memory) */
+         if(baseline != NULL) {
+            bench_call(baseline, b, size, &data);
+            for(int r = 0; r < reps; r++) {
+               bench_call(baseline, b, size, &data);
+               samples[TIMER_CPU][r] = asp_kernel_ms(baseline);
+            }
+         }
+         bench_release(session, &data);
+
+         for(int t = 0; t < NUM_TIMERS; t++) {
+            if(t == TIMER_CPU && baseline == NULL)
+               continue;
+            if(t == TIMER_SAVED && (session->cpu || pipeline_chunks() <= 1 || (b != BENCH_GEMM && b != BENCH_CONV)))
+               continue;
+            struct stats st = compute_stats(samples[t], reps);
+            /* Rates only make sense for the compute timers */
+            double rate = t != TIMER_TRANSFER && t != TIMER_SAVED && st.median > 0 ? 
+                  bench_work(b, size) / st.median : 0;
+
+            if(json) {
+               fprintf(out, "%s{\"bench\":\"%s\",\"size\":%ld,\"timer\":\"%s\",\"min_ms\":%.6f,"
+                     "\"median_ms\":%.6f,\"p95_ms\":%.6f,\"stddev_ms\":%.6f,\"rate\":%.6f,\"rate_unit\":\"%s\"}",
+                     first ? "" : ",\n", benches[b].name, size, timer_names[t], st.min, st.median,
+                     st.p95, st.stddev, rate, benches[b].rate_unit);
+               first = false;
+            }
+            else {
+               print_csv_field(out, device_name);
+               fprintf(out, ",%s,%ld,%s,%.6f,%.6f,%.6f,%.6f,%.6f,%s\n", benches[b].name, size,
+                     timer_names[t], st.min, st.median, st.p95, st.stddev, rate, benches[b].rate_unit);
+            }
+         }
+         fflush(out);
+      }
+   }
+
+   if(json)
+      fprintf(out, "\n]}\n");
+   if(out != stdout)
+      fclose(out);
+
+   if(baseline != NULL)
+      asp_session_release(baseline);
+   asp_session_release(session);
+   return 0;
+}
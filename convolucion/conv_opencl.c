@@ -1,133 +1,128 @@
-#define PROGRAM_FILE "conv_opencl.cl"
-#define KERNEL_FUNC "conv_opencl"
+#include "../asp.h"
 
-#include "../utils.h"
+/* 1D convolution of N random values with asp_convolve()
 
-void random_ints(cl_uint *v, int N) {
+   conv_opencl [N] [--radius R] [--filter W,W,...] [--type int|float|double] [--edge zero|clamp]
+
+   Without --filter the taps are -R .. R (asp_conv1d()); a filter gives its
+   2*R+1 weights in order, so it needs an odd number of them */
+void random_values(void *v, int type, int N) {
 	int i;
 
 	srand(time(NULL));
 	for(i = 0; i < N; i++)
-		v[i] = rand()%10;
+		switch(type) {
+			case ASP_INT: ((cl_uint*) v)[i] = rand()%10; break;
+			case ASP_FLOAT: ((float*) v)[i] = rand()%10; break;
+			default: ((double*) v)[i] = rand()%10; break;
+		}
 	return;
 }
 
+void print_values(const void *v, int type, int N) {
+	for(int i = 0; i < 100 && i < N; i++)
+		switch(type) {
+			case ASP_INT: printf("%d, ", ((const int*) v)[i]); break;
+			case ASP_FLOAT: printf("%g, ", ((const float*) v)[i]); break;
+			default: printf("%g, ", ((const double*) v)[i]); break;
+		}
+	printf("\n");
+}
+
 int main(int argc, char *argv[]) {
 
-   /* OpenCL structures */
-   cl_device_id device;
-   cl_context context;
-   cl_program program;
-   cl_kernel kernel;
-   cl_command_queue queue;
-   cl_uint i, j;
-   cl_int err;
+   struct asp_session* session;
+   bool ok = true;
 
-   /* Data and buffers*/
-   cl_uint *in, *out;
-   cl_mem in_buffer, out_buffer;
-   cl_int num_groups;
-   size_t max_workgroup;
+   /* Data */
+   void *in, *out, *filter;
 
-   const int RADIUS = 4;
+   int RADIUS = 4, type = ASP_INT, edge = ASP_EDGE_ZERO, num_taps = 0;
+   const char* weights = NULL;
 
    int N = 256;
-   if (argc == 2)
-      N = atoi(argv[1]);
-
-   device = create_device();
-   context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-   if(err < 0) {
-      perror("Couldn't create a context");
-      exit(1);   
+   parse_common_args(&argc, argv);
+   for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--radius") == 0 && i + 1 < argc)
+         RADIUS = atoi(argv[++i]);
+      else if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+         weights = argv[++i];
+      else if(strcmp(argv[i], "--type") == 0 && i + 1 < argc) {
+         i++;
+         type = strcmp(argv[i], "float") == 0 ? ASP_FLOAT : strcmp(argv[i], "double") == 0 ? ASP_DOUBLE :
+               ASP_INT;
+         ok = ok && (type != ASP_INT || strcmp(argv[i], "int") == 0);
+      }
+      else if(strcmp(argv[i], "--edge") == 0 && i + 1 < argc) {
+         i++;
+         edge = strcmp(argv[i], "clamp") == 0 ? ASP_EDGE_CLAMP : ASP_EDGE_ZERO;
+         ok = ok && (edge != ASP_EDGE_ZERO || strcmp(argv[i], "zero") == 0);
+      }
+      else
+         N = atoi(argv[i]);
    }
 
-   clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &max_workgroup, NULL);
-
-   const size_t size = N * sizeof(cl_uint);
-   const size_t local_size = max_workgroup;
-   const size_t global_size = N;
-
-   // Alloc space for device copies of a, b, c
-	in = (cl_uint*) malloc(size); random_ints(in, N);
-	out = (cl_uint*)malloc(size);
-   
-   program = build_program(context, device, PROGRAM_FILE);
-
-   num_groups = N / local_size;
-
-   printf("Num groups: %d GlobalSize: %ld LocalSize: %ld\n", num_groups, global_size, local_size);
-   
-   in_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY |
-         CL_MEM_COPY_HOST_PTR, size, in, &err);
-   out_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, size, NULL, &err);
-   if(err < 0) {
-      perror("Couldn't create a buffer");
-      exit(1);   
-   };
-
-
-   queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
-   if(err < 0) {
-      perror("Couldn't create a command queue");
-      exit(1);   
-   };
-
-   kernel = clCreateKernel(program, KERNEL_FUNC, &err);
-   if(err < 0) {
-      perror("Couldn't create a kernel");
-      exit(1);
-   };
-
-   err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &in_buffer);
-   err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &out_buffer); // <=====OUTPUT
-   err |= clSetKernelArg(kernel, 2, sizeof(cl_uint), &N);
-   err |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &RADIUS);
-   if(err < 0) {
-      perror("Couldn't create a kernel argument");
-      exit(1);
+   // los pesos del filtro, separados por comas
+   if(weights != NULL) {
+      num_taps = 1;
+      for(const char* c = weights; *c; c++)
+         num_taps += *c == ',';
+      RADIUS = (num_taps - 1) / 2;
+   }
+   if(!ok || N < 1 || RADIUS < 0 || (weights != NULL && num_taps % 2 == 0)) {
+      fprintf(stderr, "Usage: %s [N] [--radius R] [--filter W,W,...] [--type int|float|double] "
+            "[--edge zero|clamp]\n", argv[0]);
+      return 1;
    }
 
-   cl_event event;
-   err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_size, 
-         &local_size, 0, NULL, &event); 
-   if(err < 0) {
-      perror("Couldn't enqueue the kernel");
-      printf("%d\n", err);
-      exit(1);
+   const size_t elem = asp_type_sizes[type];
+   filter = malloc((2*RADIUS + 1) * elem);
+   if(weights != NULL) {
+      const char* c = weights;
+      for(int t = 0; t < num_taps; t++, c = strchr(c, ',') + 1)
+         switch(type) {
+            case ASP_INT: ((int*) filter)[t] = atoi(c); break;
+            case ASP_FLOAT: ((float*) filter)[t] = atof(c); break;
+            default: ((double*) filter)[t] = atof(c); break;
+         }
    }
-   
+   else
+      for(int t = 0; t < 2*RADIUS + 1; t++)
+         switch(type) {
+            case ASP_INT: ((int*) filter)[t] = t - RADIUS; break;
+            case ASP_FLOAT: ((float*) filter)[t] = t - RADIUS; break;
+            default: ((double*) filter)[t] = t - RADIUS; break;
+         }
 
-   clWaitForEvents(1, &event);
-   clFinish(queue);
+   session = asp_session_open();
+   session->verbose = true;
 
-   print_time_exec(event);
+   const size_t size = N * elem;
 
+   // memoria de host fijada (pinned) del pool de la sesion
+	in = asp_acquire_host(session, size); random_values(in, type, N);
+	out = asp_acquire_host(session, size);
 
-   err = clEnqueueReadBuffer(queue, out_buffer, CL_TRUE, 0, 
-                  size, out, 0, NULL, NULL); // <=====GET OUTPUT
-   if(err < 0) {
-      perror("Couldn't read the buffer");
-      exit(1);
+   asp_convolve(session, type, in, out, N, filter, RADIUS, edge);
+   asp_print_time(session);
+
+   print_values(in, type, N);
+   printf("\n");
+   print_values(out, type, N);
+
+   // comprobacion contra el backend de CPU (exacta con enteros)
+   if(asp_verify_against_cpu(session, "conv")) {
+      void* ref = malloc(size);
+      cpu_convolve(type, in, ref, N, filter, RADIUS, edge);
+      ok = verify_matrix("conv", type, out, ref, N);
+      free(ref);
    }
 
-	for(i=0; i<100; i++) 
-      printf("%d, ", in[i]);
+   asp_release_host(session, in);
+   asp_release_host(session, out);
+   free(filter);
 
-   printf("\n\n");
-   for(j=0; j<100; j++)
-         printf("%d, ", out[j]);
-   printf("\n");
+   asp_session_release(session);
 
-   free(in);
-   free(out);
-   
-   clReleaseKernel(kernel);
-   clReleaseMemObject(in_buffer);
-   clReleaseMemObject(out_buffer);
-   clReleaseCommandQueue(queue);
-   clReleaseProgram(program);
-   clReleaseContext(context);
-
-   return 0;
+   return ok ? 0 : 1;
 }
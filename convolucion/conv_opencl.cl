@@ -1,20 +1,62 @@
 
+/* 1D convolution: out[i] = sum of filter[t] * in[i + t - RADIUS], t = 0 .. 2*RADIUS
 
-__kernel void conv_opencl(const __global int* in,
-                      __global int* out,
-                      const int N, const int RADIUS) {
-    
-    const int gid = get_global_id(0);
-
-    const int k[5] = { -2, -1, 0, 1, 2 };
- 
-    int res = 0;
-    if(gid >= RADIUS && gid < N - RADIUS) {
-      for (int offset = 0; offset < 2*RADIUS+1; offset++){
-        int j = gid+offset-RADIUS;
-		    res += in[j] * k[(N-j) % 5];
+   Built with -DCONV_TYPE (0 int, 2 float, 3 double, as in asp_cpu.h),
+   -DRADIUS, -DEDGE (0 zeros past the ends, 1 the nearest end) and
+   -DWG_SIZE. Each work-group stages its WG_SIZE inputs plus RADIUS on each
+   side in local memory once, so every input comes from global memory about
+   once instead of 2*RADIUS+1 times, and the taps are read from __constant
+   memory, where the whole group reads the same weight at each step */
+#if CONV_TYPE == 3
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+#elif CONV_TYPE == 2
+typedef float real;
+#else
+typedef int real;
+#endif
+
+#define TAPS (2*RADIUS + 1)
+#define SPAN (WG_SIZE + 2*RADIUS)
+
+/* Outputs first .. first+count-1 of a convolution of N inputs, with `in`
+   holding the inputs from index in_first on: all of them, or one block of
+   the pipeline plus its halo. Grid-stride loop over the tiles, so any grid
+   covers any count */
+__attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+__kernel void conv_opencl(const __global real* in,
+                      __global real* out,
+                      __constant real* filter,
+                      const int N, const int first, const int count, const int in_first) {
+
+    __local real tile[SPAN];
+
+    const int lid = get_local_id(0);
+
+    for(int base = get_group_id(0) * WG_SIZE; base < count; base += get_num_groups(0) * WG_SIZE) {
+      const int start = first + base - RADIUS;
+      const int end = first + count + RADIUS;
+
+      // tile plus halo; the edges are resolved here, once per input
+      for(int i = lid; i < SPAN; i += WG_SIZE) {
+        int j = start + i;
+        real v = 0;
+#if EDGE == 1
+        j = clamp(j, 0, N - 1);
+#endif
+        if(j >= 0 && j < N && start + i < end)
+          v = in[j - in_first];
+        tile[i] = v;
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      if(base + lid < count) {
+        real res = 0;
+        #pragma unroll
+        for(int t = 0; t < TAPS; t++)
+          res += filter[t] * tile[lid + t];
+        out[base + lid] = res;
       }
+      barrier(CLK_LOCAL_MEM_FENCE);
     }
-    
-    out[gid] = res;
 }
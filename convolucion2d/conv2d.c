@@ -0,0 +1,226 @@
+#include "../asp.h"
+
+/* 2D convolution of images with asp_convolve2d()
+
+   conv2d [IMAGE] [--raw WxH[xC]] [--size WxH[xC]] [--filter F] [--edge zero|clamp]
+          [--band ROWS] [--no-images] [-o OUT]
+
+   IMAGE is a binary PGM/PPM (or raw frames with --raw), "-" for stdin,
+   and may hold several images in a row; without it a random WxHxC image
+   is filtered. The rows go through memory and the device ROWS at a time
+   (plus the halo of the filter), and OUT gets the same format as the
+   input (raw if it ends in .raw). F is gaussian[:R], box[:R], sobel-x,
+   sobel-y, sharpen, laplacian or the (2R+1)^2 weights row by row,
+   separated by commas. */
+#define DEFAULT_BAND 256
+
+/* Named filters or explicit weights; NULL if F is not valid */
+float* make_filter(const char* name, int* radius) {
+
+   const float sobel[9] = { -1, 0, 1, -2, 0, 2, -1, 0, 1 };
+   const float sharpen[9] = { 0, -1, 0, -1, 5, -1, 0, -1, 0 };
+   const float laplacian[9] = { 0, 1, 0, 1, -4, 1, 0, 1, 0 };
+   float* filter;
+   char* end;
+   int n = 1, r = 2;
+   const int named = strncmp(name, "gaussian", 8) == 0 ? 8 : strncmp(name, "box", 3) == 0 ? 3 : 0;
+
+   if(named > 0 && (name[named] == '\0' || name[named] == ':')) {
+      if(name[named] == ':') {
+         r = strtol(name + named + 1, &end, 10);
+         if(end == name + named + 1 || *end != '\0')
+            return NULL;
+      }
+      if(r < 0)
+         return NULL;
+      *radius = r;
+      filter = (float*) malloc((2*r + 1) * (2*r + 1) * sizeof(float));
+      if(name[0] == 'g')
+         conv_gaussian(filter, r);
+      else
+         for(int i = 0; i < (2*r + 1) * (2*r + 1); i++)
+            filter[i] = 1.0f / ((2*r + 1) * (2*r + 1));
+      return filter;
+   }
+
+   if(strcmp(name, "sobel-x") == 0 || strcmp(name, "sobel-y") == 0 || strcmp(name, "sharpen") == 0 ||
+         strcmp(name, "laplacian") == 0) {
+      *radius = 1;
+      filter = (float*) malloc(9 * sizeof(float));
+      for(int i = 0; i < 9; i++)
+         filter[i] = name[0] == 'l' ? laplacian[i] : name[1] == 'h' ? sharpen[i] :
+               name[6] == 'x' ? sobel[i] : sobel[i % 3 * 3 + i / 3];
+      return filter;
+   }
+
+   // pesos explicitos: (2R+1)^2 numeros separados por comas
+   for(const char* c = name; *c; c++)
+      n += *c == ',';
+   for(r = 0; (2*r + 1) * (2*r + 1) < n; r++);
+   if((2*r + 1) * (2*r + 1) != n)
+      return NULL;
+   filter = (float*) malloc(n * sizeof(float));
+   for(int i = 0; i < n; i++, name = end + 1) {
+      filter[i] = strtof(name, &end);
+      if(end == name || *end != (i + 1 < n ? ',' : '\0')) {
+         free(filter);
+         return NULL;
+      }
+   }
+   *radius = r;
+   return filter;
+}
+
+/* The next `rows` rows of the random image */
+void random_rows(float* dst, int width, int channels, int rows, size_t plane) {
+   for(int c = 0; c < channels; c++)
+      for(long i = 0; i < (long) rows * width; i++)
+         dst[c * plane + i] = rand() % 256;
+}
+
+int main(int argc, char *argv[]) {
+
+   struct asp_session* session;
+   struct image_file input, output;
+   const char *path = NULL, *raw = NULL, *out_path = NULL, *filter_name = "gaussian";
+   int width = 1920, height = 1080, channels = 1, maxval = 255, radius, edge = ASP_EDGE_CLAMP;
+   int band = DEFAULT_BAND, frames = 0;
+   long checked = 0, wrong = 0;
+   double ms = 0, scale = 0;
+   bool ok = true, images = true;
+   float *filter, *window, *packed, *out;
+
+   double t = wall_time_ms();
+
+   parse_common_args(&argc, argv);
+   for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--raw") == 0 && i + 1 < argc)
+         raw = argv[++i];
+      else if(strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+         ok = ok && sscanf(argv[++i], "%dx%dx%d", &width, &height, &channels) >= 2;
+      else if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+         filter_name = argv[++i];
+      else if(strcmp(argv[i], "--edge") == 0 && i + 1 < argc) {
+         i++;
+         edge = strcmp(argv[i], "zero") == 0 ? ASP_EDGE_ZERO : ASP_EDGE_CLAMP;
+         ok = ok && (edge != ASP_EDGE_CLAMP || strcmp(argv[i], "clamp") == 0);
+      }
+      else if(strcmp(argv[i], "--band") == 0 && i + 1 < argc)
+         band = atoi(argv[++i]);
+      else if(strcmp(argv[i], "--no-images") == 0)
+         images = false;
+      else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+         out_path = argv[++i];
+      else
+         path = argv[i];
+   }
+
+   filter = make_filter(filter_name, &radius);
+   if(!ok || filter == NULL || band < 1 || width < 1 || height < 1 || channels < 1 || (raw != NULL && !path)) {
+      fprintf(stderr, "Usage: %s [IMAGE] [--raw WxH[xC]] [--size WxH[xC]] [--filter F] [--edge zero|clamp] "
+            "[--band ROWS] [--no-images] [-o OUT]\n"
+            "       F: gaussian[:R], box[:R], sobel-x, sobel-y, sharpen, laplacian or W,W,...\n", argv[0]);
+      return 1;
+   }
+   for(int i = 0; i < (2*radius + 1) * (2*radius + 1); i++)
+      scale += fabsf(filter[i]);
+
+   session = asp_session_open();
+   session->verbose = true;
+   session->images = session->images && images;
+   const bool verify = asp_verify_against_cpu(session, "conv2d");
+
+   if(path != NULL)
+      image_open(&input, path, raw);
+
+   /* One image after another: the window holds the rows of the current band
+      and its halo, each plane `cap` rows apart */
+   while(path == NULL ? frames == 0 : image_next(&input)) {
+      if(path != NULL) {
+         width = input.width;
+         height = input.height;
+         channels = input.channels;
+         maxval = input.maxval;
+      }
+      if(out_path != NULL && frames == 0) {
+         const size_t len = strlen(out_path);
+         image_create(&output, out_path, len > 4 && strcmp(out_path + len - 4, ".raw") == 0, width, height,
+               channels, maxval);
+      }
+      if(out_path != NULL && (output.width != width || output.height != height || output.channels != channels)) {
+         fprintf(stderr, "Every image of the file must have the same size\n");
+         return 1;
+      }
+
+      const int rows_max = band < height ? band : height;
+      const size_t cap = (size_t) (rows_max + 2*radius) * width;
+      window = (float*) malloc(channels * cap * sizeof(float));
+      packed = (float*) malloc(channels * cap * sizeof(float));
+      out = (float*) malloc((size_t) channels * rows_max * width * sizeof(float));
+      int in_first = 0, loaded = 0;
+
+      for(int first = 0; first < height; first += rows_max) {
+         const int rows = first + rows_max <= height ? rows_max : height - first;
+         const int need_first = first > radius ? first - radius : 0;
+         const int need_last = first + rows + radius < height ? first + rows + radius : height;
+
+         // fuera las filas que ya no hacen falta y dentro las nuevas
+         const int drop = need_first - in_first;
+         if(drop > 0) {
+            for(int c = 0; c < channels; c++)
+               memmove(window + c * cap, window + c * cap + (size_t) drop * width,
+                     (size_t) (loaded - drop) * width * sizeof(float));
+            loaded -= drop;
+            in_first = need_first;
+         }
+         if(path != NULL)
+            image_read_rows(&input, window + (size_t) loaded * width, need_last - in_first - loaded, cap);
+         else
+            random_rows(window + (size_t) loaded * width, width, channels, need_last - in_first - loaded, cap);
+         loaded = need_last - in_first;
+
+         // los planos seguidos, como los espera asp_convolve2d()
+         for(int c = 0; c < channels; c++)
+            memcpy(packed + (size_t) c * loaded * width, window + c * cap, (size_t) loaded * width * sizeof(float));
+
+         asp_convolve2d(session, packed, out, width, height, channels, first, rows, in_first, loaded, filter,
+               radius, edge);
+         ms += asp_kernel_ms(session);
+         session->verbose = false;
+
+         if(verify) {
+            float* ref = (float*) malloc((size_t) channels * rows * width * sizeof(float));
+            cpu_convolve2d(packed, ref, width, height, channels, first, rows, in_first, loaded, filter, radius,
+                  edge);
+            for(long i = 0; i < (long) channels * rows * width; i++, checked++)
+               if(!(fabs(out[i] - ref[i]) <= 1e-5 * maxval * scale) && wrong++ == 0)
+                  printf("Verify conv2d: FAILED at row %ld (got %.9g, expected %.9g)\n",
+                        first + i % ((long) rows * width) / width, out[i], ref[i]);
+            free(ref);
+         }
+
+         if(out_path != NULL)
+            image_write_rows(&output, out, rows, (size_t) rows * width);
+      }
+
+      free(window);
+      free(packed);
+      free(out);
+      frames++;
+   }
+
+   printf("%d imagenes de %dx%dx%d, radio %d: %.3f ms (%.1f Mpixel/s)\n", frames, width, height, channels, radius,
+         ms, (double) frames * width * height * channels / (ms * 1e3));
+   printf("Total tiempo: %f s\n", (wall_time_ms() - t) / 1000.0);
+   if(verify && wrong == 0)
+      printf("Verify conv2d: OK (%ld values)\n", checked);
+
+   if(path != NULL)
+      image_close(&input);
+   if(out_path != NULL)
+      image_close(&output);
+   free(filter);
+   asp_session_release(session);
+
+   return wrong == 0 ? 0 : 1;
+}
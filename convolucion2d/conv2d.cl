@@ -0,0 +1,165 @@
+/* 2D convolution of float images, as cpu_convolve2d() in asp_cpu.h
+
+   Built with -DRADIUS, -DEDGE (0 zeros past the borders, 1 the nearest
+   pixel) and -DTILE_X / -DTILE_Y, the work-group. The image comes in
+   bands of rows: `in` holds rows in_first .. in_first+in_rows-1 of a
+   width x height image, one plane after the other, and each kernel writes
+   rows first .. first+rows-1. The third dimension of the grid is the
+   plane (the channel). The filters are in __constant memory */
+#define TAPS (2*RADIUS + 1)
+
+/* Pixel (x, y) of the band, with the borders resolved */
+float pixel(const __global float* in, int x, int y, const int width, const int height,
+            const int in_first, const int in_rows) {
+#if EDGE == 1
+    x = clamp(x, 0, width - 1);
+    y = clamp(y, 0, height - 1);
+#endif
+    if(x < 0 || x >= width || y < in_first || y >= in_first + in_rows)
+      return 0;
+    return in[(y - in_first) * width + x];
+}
+
+/* Any (2*RADIUS+1)^2 filter: the group stages its tile plus a RADIUS halo
+   on every side in local memory once, and every output reads TAPS^2
+   pixels from there */
+__attribute__((reqd_work_group_size(TILE_X, TILE_Y, 1)))
+__kernel void conv2d_tiled(const __global float* in,
+                      __global float* out,
+                      __constant float* filter,
+                      const int width, const int height, const int first, const int rows,
+                      const int in_first, const int in_rows) {
+
+    __local float tile[TILE_Y + 2*RADIUS][TILE_X + 2*RADIUS];
+
+    const int lx = get_local_id(0), ly = get_local_id(1);
+    const int x0 = get_group_id(0) * TILE_X, y0 = first + get_group_id(1) * TILE_Y;
+    const int x = x0 + lx, y = y0 + ly;
+
+    in += (size_t) get_global_id(2) * in_rows * width;
+    out += (size_t) get_global_id(2) * rows * width;
+
+    for(int i = ly; i < TILE_Y + 2*RADIUS; i += TILE_Y)
+      for(int j = lx; j < TILE_X + 2*RADIUS; j += TILE_X)
+        tile[i][j] = pixel(in, x0 + j - RADIUS, y0 + i - RADIUS, width, height, in_first, in_rows);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if(x >= width || y >= first + rows)
+      return;
+
+    float res = 0;
+    #pragma unroll
+    for(int dy = 0; dy < TAPS; dy++)
+      #pragma unroll
+      for(int dx = 0; dx < TAPS; dx++)
+        res += filter[dy*TAPS + dx] * tile[ly + dy][lx + dx];
+    out[(y - first) * width + x] = res;
+}
+
+/* The same filter reading an image object through a sampler, so the
+   neighbourhood comes through the texture cache. The image is the
+   session's, reused from band to band and possibly larger than this band,
+   so the borders are resolved here as in pixel() rather than by the
+   sampler. It holds the band of plane `plane` */
+__constant sampler_t band_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP | CLK_FILTER_NEAREST;
+
+__attribute__((reqd_work_group_size(TILE_X, TILE_Y, 1)))
+__kernel void conv2d_image(__read_only image2d_t in,
+                      __global float* out,
+                      __constant float* filter,
+                      const int width, const int height, const int first, const int rows,
+                      const int in_first, const int plane) {
+
+    const int x = get_global_id(0), y = get_global_id(1);
+    if(x >= width || y >= rows)
+      return;
+
+    out += (size_t) plane * rows * width;
+
+    float res = 0;
+    #pragma unroll
+    for(int dy = 0; dy < TAPS; dy++) {
+      int sy = first + y + dy - RADIUS;
+#if EDGE == 1
+      sy = clamp(sy, 0, height - 1);
+#else
+      if(sy < 0 || sy >= height)
+        continue;
+#endif
+      #pragma unroll
+      for(int dx = 0; dx < TAPS; dx++) {
+        int sx = x + dx - RADIUS;
+#if EDGE == 1
+        sx = clamp(sx, 0, width - 1);
+#else
+        if(sx < 0 || sx >= width)
+          continue;
+#endif
+        res += filter[dy*TAPS + dx] * read_imagef(in, band_sampler, (int2)(sx, sy - in_first)).x;
+      }
+    }
+    out[y * width + x] = res;
+}
+
+/* Separable filters, first pass: `row` along every row of the band (the
+   column pass needs all of them), staging TILE_X + 2*RADIUS pixels per row */
+__attribute__((reqd_work_group_size(TILE_X, TILE_Y, 1)))
+__kernel void conv2d_rows(const __global float* in,
+                      __global float* out,
+                      __constant float* row,
+                      const int width, const int in_rows) {
+
+    __local float tile[TILE_Y][TILE_X + 2*RADIUS];
+
+    const int lx = get_local_id(0), ly = get_local_id(1);
+    const int x0 = get_group_id(0) * TILE_X;
+    const int x = x0 + lx, y = get_global_id(1);
+
+    in += (size_t) get_global_id(2) * in_rows * width;
+    out += (size_t) get_global_id(2) * in_rows * width;
+
+    for(int j = lx; j < TILE_X + 2*RADIUS; j += TILE_X)
+      tile[ly][j] = y < in_rows ? pixel(in + y * width, x0 + j - RADIUS, 0, width, 1, 0, 1) : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if(x >= width || y >= in_rows)
+      return;
+
+    float res = 0;
+    #pragma unroll
+    for(int t = 0; t < TAPS; t++)
+      res += row[t] * tile[ly][lx + t];
+    out[y * width + x] = res;
+}
+
+/* Second pass: `col` down the columns of the row pass, staging
+   TILE_Y + 2*RADIUS rows per column */
+__attribute__((reqd_work_group_size(TILE_X, TILE_Y, 1)))
+__kernel void conv2d_cols(const __global float* in,
+                      __global float* out,
+                      __constant float* col,
+                      const int width, const int height, const int first, const int rows,
+                      const int in_first, const int in_rows) {
+
+    __local float tile[TILE_Y + 2*RADIUS][TILE_X];
+
+    const int lx = get_local_id(0), ly = get_local_id(1);
+    const int y0 = first + get_group_id(1) * TILE_Y;
+    const int x = get_global_id(0), y = y0 + ly;
+
+    in += (size_t) get_global_id(2) * in_rows * width;
+    out += (size_t) get_global_id(2) * rows * width;
+
+    for(int i = ly; i < TILE_Y + 2*RADIUS; i += TILE_Y)
+      tile[i][lx] = x < width ? pixel(in, x, y0 + i - RADIUS, width, height, in_first, in_rows) : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if(x >= width || y >= first + rows)
+      return;
+
+    float res = 0;
+    #pragma unroll
+    for(int t = 0; t < TAPS; t++)
+      res += col[t] * tile[ly + t][lx];
+    out[(y - first) * width + x] = res;
+}
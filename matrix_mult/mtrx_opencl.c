@@ -1,13 +1,10 @@
-#define PROGRAM_FILE "mtrx_opencl.cl"
-#define KERNEL_FUNC "mtrx_opencl"
+#include "../asp.h"
 
-#include "../utils.h"
 
-
-void print_mtrx(cl_uint* matrix, int M, int oldM){
+void print_mtrx(cl_uint* matrix, int M){
    #ifdef DEBUG
-      for(int i = 0; i < oldM; i++){
-         for(int j = 0; j < oldM; j++)
+      for(int i = 0; i < M; i++){
+         for(int j = 0; j < M; j++)
             printf("%d\t", matrix[i*M + j]);
          printf("\n");
       }
@@ -15,55 +12,231 @@ void print_mtrx(cl_uint* matrix, int M, int oldM){
    #endif
 }
 
+/* C = alpha * op(A) * op(B) + beta * C with asp_gemm_general() on random
+   matrices of any shape and type, or `batch` of them with asp_gemm_batched() */
+bool run_general(struct asp_session* session, int type, int layout, int trans_a, int trans_b,
+      long m, long n, long k, double alpha, double beta, long batch) {
+
+   const size_t elem = asp_type_sizes[type];
+   const long a_rows = (trans_a == ASP_TRANS) != (layout == ASP_COL_MAJOR) ? k : m;
+   const long b_rows = (trans_b == ASP_TRANS) != (layout == ASP_COL_MAJOR) ? n : k;
+   const long c_rows = layout == ASP_COL_MAJOR ? n : m;
+   // dimensiones principales ajustadas: filas del almacenamiento de cada matriz
+   const long lda = a_rows > 0 && m*k / a_rows > 0 ? m*k / a_rows : 1;
+   const long ldb = b_rows > 0 && k*n / b_rows > 0 ? k*n / b_rows : 1;
+   const long ldc = c_rows > 0 && m*n / c_rows > 0 ? m*n / c_rows : 1;
+   // las matrices de cada lote van seguidas
+   const long size_a = m*k, size_b = k*n, size_c = m*n, total = (size_a + size_b + size_c) * batch;
+   char *data, *A, *B, *C, *ref = NULL;
+   bool ok = true;
+
+   data = (char*) malloc(total * elem + 1);
+   A = data;
+   B = A + size_a * batch * elem;
+   C = B + size_b * batch * elem;
+   srand(1);
+   for(long i = 0; i < total; i++)
+      switch(type) {
+         case ASP_INT: ((int*) data)[i] = rand() % 10; break;
+         case ASP_FLOAT: ((float*) data)[i] = rand() % 1000 / 1000.0f; break;
+         default: ((double*) data)[i] = rand() % 1000 / 1000.0; break;
+      }
+   if(asp_verify_against_cpu(session, "gemm")) {
+      ref = (char*) malloc(size_c * batch * elem + 1);
+      memcpy(ref, C, size_c * batch * elem);
+   }
+
+   if(batch > 1)
+      asp_gemm_batched(session, type, layout, trans_a, trans_b, m, n, k, alpha, A, lda, size_a, 
+            B, ldb, size_b, beta, C, ldc, size_c, batch);
+   else
+      asp_gemm_general(session, type, layout, trans_a, trans_b, m, n, k, alpha, A, lda, B, ldb, 
+            beta, C, ldc);
+   asp_print_time(session);
+
+   // comprobacion contra el backend de CPU
+   if(ref != NULL) {
+      cpu_gemm_batched(type, layout, trans_a, trans_b, m, n, k, alpha, A, lda, size_a, B, ldb, size_b,
+            beta, ref, ldc, size_c, batch);
+      ok = verify_matrix("gemm", type, C, ref, size_c * batch);
+      free(ref);
+   }
+
+   free(data);
+   return ok;
+}
+
+/* C = alpha * A * B + beta * C, row-major, streamed in tiles through every
+   selected device (--device all). The matrices are random in host memory,
+   or come from raw files: A and B are mapped read-only and C is mapped 
+   (and created if needed) so the result goes straight to disk */
+bool run_streamed(int type, long m, long n, long k, double alpha, double beta, long block, 
+      char* files) {
+
+   struct asp_session* sessions[MAX_DEVICES];
+   cl_device_id devices[MAX_DEVICES];
+   const size_t elem = asp_type_sizes[type];
+   const char *path_a = NULL, *path_b = NULL, *path_c = NULL;
+   size_t size_a = m*k * elem, size_b = k*n * elem, size_c = m*n * elem;
+   char *A, *B, *C, *ref = NULL;
+   int num_sessions;
+   bool ok = true;
+
+   num_sessions = select_devices(devices, MAX_DEVICES);
+   for(int d = 0; d < num_sessions; d++) {
+      sessions[d] = asp_session_create(devices[d]);
+      sessions[d]->verbose = true;
+   }
+   if(num_sessions == 0) {
+      sessions[num_sessions++] = asp_session_open();
+      sessions[0]->verbose = true;
+   }
+
+   if(files != NULL) {
+      path_a = strtok(files, ",");
+      path_b = strtok(NULL, ",");
+      path_c = strtok(NULL, ",");
+   }
+   if(path_c != NULL) {
+      A = (char*) map_file(path_a, &size_a);
+      B = (char*) map_file(path_b, &size_b);
+      if(size_a != m*k * elem || size_b != k*n * elem) {
+         fprintf(stderr, "%s and %s must hold %ldx%ld and %ldx%ld %s values\n", path_a, path_b, m, k, k, n,
+               asp_type_names[type]);
+         exit(1);
+      }
+      C = (char*) map_file_rw(path_c, size_c);
+   }
+   else {
+      A = (char*) malloc(size_a + size_b + size_c + 1);
+      B = A + size_a;
+      C = B + size_b;
+      srand(1);
+      for(long i = 0; i < m*k + k*n + m*n; i++)
+         switch(type) {
+            case ASP_INT: ((int*) A)[i] = rand() % 10; break;
+            case ASP_FLOAT: ((float*) A)[i] = rand() % 1000 / 1000.0f; break;
+            default: ((double*) A)[i] = rand() % 1000 / 1000.0; break;
+         }
+   }
+   if(asp_verify_against_cpu(sessions[0], "gemm")) {
+      ref = (char*) malloc(size_c + 1);
+      memcpy(ref, C, size_c);
+   }
+
+   asp_gemm_streamed(sessions, num_sessions, type, m, n, k, alpha, A, k > 0 ? k : 1, B, n, beta, C, n, block);
+   asp_print_time(sessions[0]);
+   printf("%.3f GFLOP/s\n", 2.0 * m * n * k / (sessions[0]->call_ms * 1e6));
+
+   // comprobacion contra el backend de CPU
+   if(ref != NULL) {
+      cpu_gemm_general(type, ASP_ROW_MAJOR, ASP_NO_TRANS, ASP_NO_TRANS, m, n, k, alpha, A, k > 0 ? k : 1, 
+            B, n, beta, ref, n);
+      ok = verify_matrix("gemm", type, C, ref, m*n);
+      free(ref);
+   }
+
+   if(path_c != NULL) {
+      unmap_file(A, size_a);
+      unmap_file(B, size_b);
+      unmap_file(C, size_c);
+   }
+   else
+      free(A);
+   for(int d = 0; d < num_sessions; d++)
+      asp_session_release(sessions[d]);
+   return ok;
+}
+
 int main(int argc, char *argv[]) {
 
-   /* OpenCL structures */
-   cl_device_id device;
-   cl_context context;
-   cl_program program;
-   cl_kernel kernel;
-   cl_command_queue queue;
+   struct asp_session* session;
    cl_uint i, j;
-   cl_int err;
+   bool ok = true;
 
-   /* Data and buffers*/
+   /* Data */
    cl_uint *matrixes, *matrix_a, *matrix_b, *matrix_c;
-   cl_mem matrix_a_buffer, matrix_b_buffer, matrix_c_buffer;
-   cl_int num_groups;
-   size_t max_workgroup;
-
-   int M = 5;
-   if (argc == 2)
-      M = atoi(argv[1]);
-
-
-   // creamos el device de OpenCL, es una instancia del device externo donde
-   // vamos a ejecutar las instrucciones
-   device = create_device();
-   context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-   if(err < 0) {
-      perror("Couldn't create a context");
-      exit(1);   
+
+   int M = 5, kernel = -1;
+   /* general GEMM (--shape) */
+   long shape[3] = { 0, 0, 0 };
+   int type = ASP_INT, layout = ASP_ROW_MAJOR, trans_a = ASP_NO_TRANS, trans_b = ASP_NO_TRANS;
+   double alpha = 1, beta = 0;
+   long batch = 1, block = 0;
+   bool streamed = false;
+   char* files = NULL;
+
+   parse_common_args(&argc, argv);
+   for(i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) {
+         i++;
+         for(j = 0; j < ASP_GEMM_NUM_KERNELS; j++)
+            if(strcmp(argv[i], asp_gemm_kernel_names[j]) == 0)
+               kernel = j;
+         ok = ok && kernel >= 0;
+      }
+      else if(strcmp(argv[i], "--shape") == 0 && i + 1 < argc)
+         ok = ok && sscanf(argv[++i], "%ldx%ldx%ld", &shape[0], &shape[1], &shape[2]) == 3;
+      else if(strcmp(argv[i], "--type") == 0 && i + 1 < argc) {
+         i++;
+         type = strcmp(argv[i], "float") == 0 ? ASP_FLOAT : strcmp(argv[i], "double") == 0 ? ASP_DOUBLE : 
+               ASP_INT;
+         ok = ok && (type != ASP_INT || strcmp(argv[i], "int") == 0);
+      }
+      else if(strcmp(argv[i], "--alpha") == 0 && i + 1 < argc)
+         alpha = atof(argv[++i]);
+      else if(strcmp(argv[i], "--beta") == 0 && i + 1 < argc)
+         beta = atof(argv[++i]);
+      else if(strcmp(argv[i], "--trans-a") == 0)
+         trans_a = ASP_TRANS;
+      else if(strcmp(argv[i], "--trans-b") == 0)
+         trans_b = ASP_TRANS;
+      else if(strcmp(argv[i], "--col-major") == 0)
+         layout = ASP_COL_MAJOR;
+      else if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+         batch = atol(argv[++i]);
+      else if(strcmp(argv[i], "--stream") == 0)
+         streamed = true;
+      else if(strcmp(argv[i], "--block") == 0 && i + 1 < argc)
+         block = atol(argv[++i]);
+      else if(strcmp(argv[i], "--files") == 0 && i + 1 < argc)
+         files = argv[++i];
+      else
+         M = atoi(argv[i]);
+   }
+   if(!ok || M < 1 || shape[0] < 0 || shape[1] < 0 || shape[2] < 0 || batch < 1) {
+      fprintf(stderr, "Usage: %s [M] [--kernel naive|tiled|blocked]\n"
+            "       %s --shape MxKxN [--type int|float|double] [--alpha A] [--beta B] [--trans-a] "
+            "[--trans-b] [--col-major] [--batch B]\n"
+            "       %s --shape MxKxN --stream [--type T] [--alpha A] [--beta B] [--block B] "
+            "[--files A.bin,B.bin,C.bin]\n", argv[0], argv[0], argv[0]);
+      return 1;
    }
 
-   // obtenemos la información del device, la cual es necesaria para saber el maximo del workgroup
-   // y así hacer √(SIZE_WORKGROUP) y poder saber el máximo de valores que podemos almacenar en tamaño 
-   // todo el trabajo
-   clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &max_workgroup, NULL);
-   const cl_int TILE_SIZE = sqrt(max_workgroup);
-
-   // en caso de que el tamaño haga que no se pueda repartir de manera equivalente entre los bloques,
-   // rellenaremos con todo 0 hasta que lleguemos a un valor que nos sea favorable.
-   int oldM = M;
-   if (M < TILE_SIZE)
-      M = TILE_SIZE;
-   else if (M % TILE_SIZE > 0)
-      M += TILE_SIZE - (M % TILE_SIZE);
-   
-   printf("New padded M: %d\n", M);
+   // producto por bloques en todos los dispositivos elegidos (--device all),
+   // para matrices que no caben en uno solo
+   if(shape[0] > 0 && streamed)
+      return run_streamed(type, shape[0], shape[2], shape[1], alpha, beta, block, files) ? 0 : 1;
+
+   // creamos la sesion de OpenCL sobre el device externo donde vamos a 
+   // ejecutar las instrucciones (contexto, cola y kernels)
+   session = asp_session_open();
+   session->verbose = true;
+   if(kernel >= 0)
+      asp_gemm_select(session, kernel);
+
+   // producto general: C (MxN) = alpha * op(A) (MxK) * op(B) (KxN) + beta * C,
+   // o un lote de B productos independientes en un solo lanzamiento
+   if(shape[0] > 0) {
+      ok = run_general(session, type, layout, trans_a, trans_b, shape[0], shape[2], shape[1], alpha, beta,
+            batch);
+      asp_session_release(session);
+      return ok ? 0 : 1;
+   }
 
    // reserva de las 3 matrices aprovechando el principio de localidad.
-   matrixes = (cl_uint*) calloc(M*M*3, sizeof(cl_uint));
+   // (memoria de host fijada del pool de la sesion)
+   matrixes = (cl_uint*) asp_acquire_host(session, M*M*3 * sizeof(cl_uint));
 
    // asignación de los punteros dentro del bloque para saber donde comienza 
    // cada una de las matrices en el bloque.
@@ -72,108 +245,35 @@ int main(int argc, char *argv[]) {
    matrix_c = &matrixes[2 * M*M];
 
    // inicializamos las matrices, una a una
-   for(i = 0; i < oldM; i++){
-      for(j = 0; j < oldM; j++){
-         matrix_a[i*M + j] = i*oldM + j+1;
-         matrix_b[j*M + i] = i*oldM + j+1;
+   for(i = 0; i < M; i++){
+      for(j = 0; j < M; j++){
+         matrix_a[i*M + j] = i*M + j+1;
+         matrix_b[j*M + i] = i*M + j+1;
       }
    }
 
+   print_mtrx(matrix_a, M);
    
-   print_mtrx(matrix_a, M, oldM);
-   
-   print_mtrx(matrix_b, M, oldM);
-   
-   // definimos el tamaño de la matriz y el tamaño del bloque que alberga la matriz
-   const size_t local_size[2] = { TILE_SIZE, TILE_SIZE };
-   const size_t global_size[2] = { M, M };
-   
-   // contruimos la esctructura program, la cual alberga una versión binaria que compila 
-   // el archivo de kernel a memoria para poder ser ejecutado 
-   program = build_program(context, device, PROGRAM_FILE);
+   print_mtrx(matrix_b, M);
 
-   // calculamos el número de grupos que podemos llegar a tener para distribuir las celdas de
-   // las matrices
-   num_groups = M / TILE_SIZE;
+   // la sesion rellena con ceros hasta un multiplo de TILE_SIZE, copia las
+   // matrices al device, ejecuta el kernel y devuelve el resultado
+   asp_gemm(session, matrix_a, matrix_b, matrix_c, M);
+   asp_print_time(session);
 
-   printf("Num groups: %d GlobalSize: %d LocalSize: %d\n", num_groups, M*M, TILE_SIZE*TILE_SIZE);
-   
-   // copiamos en memoria a modo de buffer las matrices con las que operamos en OpenCL.
-   // se utilizan para utilizarlos en el kernel.
-   matrix_a_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY |
-         CL_MEM_COPY_HOST_PTR, M*M * sizeof(cl_uint), matrix_a, &err);
-   matrix_b_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY |
-         CL_MEM_COPY_HOST_PTR, M*M * sizeof(cl_uint), matrix_b, &err);
-   matrix_c_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, M*M * sizeof(cl_uint), NULL, &err);
-   if(err < 0) {
-      perror("Couldn't create a buffer");
-      exit(1);   
-   };
-
-   // se crea el establecimiento de la comunicación con el kernel y así poder hacer una ejecución
-   // del kernel, como tal creamos un cola de comandos, las cuales son ejecuciones que nuestro kernel debe ejecutar
-   queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
-   if(err < 0) {
-      perror("Couldn't create a command queue");
-      exit(1);   
-   };
-
-   // creamos la versión binaria que combine el programa a ejecutar con la función del kernel.
-   kernel = clCreateKernel(program, KERNEL_FUNC, &err);
-   if(err < 0) {
-      perror("Couldn't create a kernel");
-      exit(1);
-   };
-
-   // settear los argumentos que se van a pasar al kernell pasaremos dos argumentos
-   // como entrada, 3 si contamos con que debemos pasar el tamaño de la matriz y una vez hecho esto
-   // tendremos como argumento de salida la matrix resultado que ha sido calculada por el kernel.
-   err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &matrix_a_buffer);
-   err = clSetKernelArg(kernel, 1, sizeof(cl_mem), &matrix_b_buffer);
-   err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &matrix_c_buffer); // <=====OUTPUT
-   err |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &M);
-   if(err < 0) {
-      perror("Couldn't create a kernel argument");
-      exit(1);
-   }
+   print_mtrx(matrix_c, M);
 
-   // se encolan mas actividades para el kernel.
-   cl_event event;
-   err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global_size, 
-         local_size, 0, NULL, &event); 
-   if(err < 0) {
-      perror("Couldn't enqueue the kernel");
-      printf("%d\n", err);
-      exit(1);
+   // comprobacion contra el backend de CPU (resultado exacto)
+   if(asp_verify_against_cpu(session, "gemm")) {
+      cl_uint* ref = (cl_uint*) malloc((size_t) M*M * sizeof(cl_uint));
+      cpu_gemm(matrix_a, matrix_b, ref, M);
+      ok = verify_exact("gemm", matrix_c, ref, (long) M*M);
+      free(ref);
    }
-   
-   // espera a que suceda el evento (una especie de synchrnize en CUDA)
-   clWaitForEvents(1, &event);
-   clFinish(queue);
-
-   print_time_exec(event);
-
-   // obtenemos el argumento de salida del kernel donde debería de estar nuestra
-   // matriz resultado
-   err = clEnqueueReadBuffer(queue, matrix_c_buffer, CL_TRUE, 0, 
-         M*M * sizeof(cl_uint), matrix_c, 0, NULL, NULL); // <=====GET OUTPUT
-   if(err < 0) {
-      perror("Couldn't read the buffer");
-      exit(1);
-   }
-
-   print_mtrx(matrix_c, M, oldM);
 
    // liberamos recursos
-   free(matrixes);
-   
-   clReleaseKernel(kernel);
-   clReleaseMemObject(matrix_a_buffer);
-   clReleaseMemObject(matrix_b_buffer);
-   clReleaseMemObject(matrix_c_buffer);
-   clReleaseCommandQueue(queue);
-   clReleaseProgram(program);
-   clReleaseContext(context);
-
-   return 0;
+   asp_release_host(session, matrixes);
+   asp_session_release(session);
+
+   return ok ? 0 : 1;
 }
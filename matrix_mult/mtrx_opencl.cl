@@ -1,9 +1,18 @@
 
+/* M and TILE_SIZE can be fixed at build time (-DM=... -DTILE_SIZE=...), 
+   then the K loop has a constant trip count and the work-group shape is 
+   known to the compiler; otherwise M is the runtime argument */
+#ifndef M
+#define M m
+#endif
 
+#ifdef TILE_SIZE
+__attribute__((reqd_work_group_size(TILE_SIZE, TILE_SIZE, 1)))
+#endif
 __kernel void mtrx_opencl(const __global int* A,
                       const __global int* B,
                       __global int* C,
-                      const int M) {
+                      const int m) {
     
     const int globalRow = get_global_id(0);
     const int globalCol = get_global_id(1);
@@ -14,3 +23,260 @@ __kernel void mtrx_opencl(const __global int* A,
  
     C[globalCol*M + globalRow] = acc;
 }
+
+/* Same product with TILE_SIZE x TILE_SIZE blocks of A and B staged in local
+   memory (needs -DTILE_SIZE, and M a multiple of it): each element is read
+   once from global memory per work-group instead of once per work-item, 
+   TILE_SIZE times less traffic than mtrx_opencl */
+#ifdef TILE_SIZE
+__attribute__((reqd_work_group_size(TILE_SIZE, TILE_SIZE, 1)))
+__kernel void mtrx_tiled(const __global int* A,
+                      const __global int* B,
+                      __global int* C,
+                      const int m) {
+
+    __local int Asub[TILE_SIZE][TILE_SIZE];
+    __local int Bsub[TILE_SIZE][TILE_SIZE];
+
+    const int row = get_local_id(0);
+    const int col = get_local_id(1);
+    const int globalRow = get_global_id(0);
+    const int globalCol = get_global_id(1);
+    const int firstCol = get_group_id(1) * TILE_SIZE;
+
+    int acc = 0;
+    for (int t=0; t < M; t += TILE_SIZE) {
+
+      // consecutive work-items read consecutive addresses of both tiles
+      Asub[col][row] = A[(t + col)*M + globalRow];
+      Bsub[col][row] = B[(t + col)*M + firstCol + row];
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      #pragma unroll
+      for (int k=0; k < TILE_SIZE; k++)
+        acc += Asub[k][row] * Bsub[k][col];
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    C[globalCol*M + globalRow] = acc;
+}
+#endif
+
+/* Register-blocked product: each work-item of a TILE_SIZE x TILE_SIZE group
+   keeps a WPT x WPT block of C in registers, so a work-group covers a
+   (TILE_SIZE*WPT)^2 block of C and M must be a multiple of that. Every 
+   step stages a TILE_SIZE-deep panel of A and of B in local memory with 
+   VW-wide vector loads (-DVW=1|2|4|8), and each value read from local 
+   memory is used WPT times. The work-item's rows and columns are strided 
+   by TILE_SIZE, which keeps the loads and the stores of C coalesced */
+#if defined(TILE_SIZE) && defined(WPT)
+#ifndef VW
+#define VW 1
+#endif
+#define CAT2(a, b) a ## b
+#define CAT(a, b) CAT2(a, b)
+#define PANEL (TILE_SIZE * WPT)
+
+__attribute__((reqd_work_group_size(TILE_SIZE, TILE_SIZE, 1)))
+__kernel void mtrx_blocked(const __global int* A,
+                      const __global int* B,
+                      __global int* C,
+                      const int m) {
+
+    __local int Asub[TILE_SIZE][PANEL];
+    __local int Bsub[TILE_SIZE][PANEL];
+
+    const int row = get_local_id(0);
+    const int col = get_local_id(1);
+    const int id = col*TILE_SIZE + row;
+    const int firstRow = get_group_id(0) * PANEL;
+    const int firstCol = get_group_id(1) * PANEL;
+
+    int acc[WPT][WPT], a[WPT], b;
+
+    #pragma unroll
+    for (int i=0; i < WPT; i++)
+      #pragma unroll
+      for (int j=0; j < WPT; j++)
+        acc[i][j] = 0;
+
+    for (int t=0; t < M; t += TILE_SIZE) {
+
+      // both panels are TILE_SIZE rows of PANEL consecutive ints
+      for (int v=id; v < TILE_SIZE*PANEL/VW; v += TILE_SIZE*TILE_SIZE) {
+        const int k = v / (PANEL/VW), r = v % (PANEL/VW) * VW;
+#if VW == 1
+        Asub[k][r] = A[(t + k)*M + firstRow + r];
+        Bsub[k][r] = B[(t + k)*M + firstCol + r];
+#else
+        CAT(vstore, VW)(CAT(vload, VW)(0, &A[(t + k)*M + firstRow + r]), 0, &Asub[k][r]);
+        CAT(vstore, VW)(CAT(vload, VW)(0, &B[(t + k)*M + firstCol + r]), 0, &Bsub[k][r]);
+#endif
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      #pragma unroll
+      for (int k=0; k < TILE_SIZE; k++) {
+        #pragma unroll
+        for (int i=0; i < WPT; i++)
+          a[i] = Asub[k][row + i*TILE_SIZE];
+        #pragma unroll
+        for (int j=0; j < WPT; j++) {
+          b = Bsub[k][col + j*TILE_SIZE];
+          #pragma unroll
+          for (int i=0; i < WPT; i++)
+            acc[i][j] += a[i] * b;
+        }
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    #pragma unroll
+    for (int j=0; j < WPT; j++)
+      #pragma unroll
+      for (int i=0; i < WPT; i++)
+        C[(firstCol + col + j*TILE_SIZE)*M + firstRow + row + i*TILE_SIZE] = acc[i][j];
+}
+#endif
+
+/* Block of `rows` rows of C = A * B for the chunked pipeline. Everything is
+   row-major n x n (A and C only hold the block), so nothing is padded: the
+   grid is rounded up and the extra work-items return */
+__kernel void mtrx_rows(const __global int* A,
+                      const __global int* B,
+                      __global int* C,
+                      const int n, const int rows) {
+
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+    if(col >= n || row >= rows)
+      return;
+
+    int acc = 0;
+    for (int k=0; k < n; k++)
+      acc += A[row*n + k] * B[k*n + col];
+
+    C[row*n + col] = acc;
+}
+
+/* C = alpha * op(A) * op(B) + beta * C for any m x k x n, everything 
+   row-major with leading dimensions (asp.h turns column-major calls 
+   around). Built with -DGEMM_TYPE (0 int, 2 float, 3 double, as in 
+   asp_cpu.h), -DTRANS_A, -DTRANS_B and -DTILE_SIZE. The tiles are staged 
+   in local memory like mtrx_tiled, loading zeros past the edges, and the 
+   work-items outside C only help with the loads; nothing is padded */
+#if defined(GEMM_TYPE) && defined(TILE_SIZE)
+#if GEMM_TYPE == 3
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+#elif GEMM_TYPE == 2
+typedef float real;
+#else
+typedef int real;
+#endif
+
+__attribute__((reqd_work_group_size(TILE_SIZE, TILE_SIZE, 1)))
+__kernel void mtrx_general(const int m, const int n, const int k, const real alpha,
+                      const __global real* A, const int lda,
+                      const __global real* B, const int ldb,
+                      const real beta, __global real* C, const int ldc) {
+
+    // one extra column avoids bank conflicts on the transposed stores
+    __local real Asub[TILE_SIZE][TILE_SIZE + 1];
+    __local real Bsub[TILE_SIZE][TILE_SIZE + 1];
+
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int firstRow = get_group_id(1) * TILE_SIZE;
+    const int firstCol = get_group_id(0) * TILE_SIZE;
+    const int row = firstRow + ly;
+    const int col = firstCol + lx;
+
+    real acc = 0;
+    for (int t=0; t < k; t += TILE_SIZE) {
+
+      // Asub[i][p] = op(A)[firstRow + i][t + p], Bsub[p][j] = op(B)[t + p][firstCol + j];
+      // consecutive work-items always read consecutive addresses
+#if TRANS_A
+      Asub[lx][ly] = firstRow + lx < m && t + ly < k ? A[(t + ly)*lda + firstRow + lx] : 0;
+#else
+      Asub[ly][lx] = row < m && t + lx < k ? A[row*lda + t + lx] : 0;
+#endif
+#if TRANS_B
+      Bsub[lx][ly] = firstCol + ly < n && t + lx < k ? B[(firstCol + ly)*ldb + t + lx] : 0;
+#else
+      Bsub[ly][lx] = col < n && t + ly < k ? B[(t + ly)*ldb + col] : 0;
+#endif
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      #pragma unroll
+      for (int p=0; p < TILE_SIZE; p++)
+        acc += Asub[ly][p] * Bsub[p][lx];
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (row < m && col < n)
+      C[row*ldc + col] = beta == 0 ? alpha * acc : alpha * acc + beta * C[row*ldc + col];
+}
+
+/* A batch of small products in one launch: matrix get_global_id(2) starts
+   stride_* elements after the previous one, and its C is covered by one or
+   more TILE_SIZE x TILE_SIZE groups. Each group stages PANEL_K-deep panels 
+   of its rows of op(A) and columns of op(B) in local memory; with k <= 
+   PANEL_K (the usual case, -DPANEL_K is k when it fits) the whole operands 
+   go in at once and there is a single pair of barriers */
+#ifdef PANEL_K
+__attribute__((reqd_work_group_size(TILE_SIZE, TILE_SIZE, 1)))
+__kernel void mtrx_batched(const int m, const int n, const int k, const real alpha,
+                      const __global real* A, const int lda, const ulong stride_a,
+                      const __global real* B, const int ldb, const ulong stride_b,
+                      const real beta, __global real* C, const int ldc, const ulong stride_c) {
+
+    __local real Asub[TILE_SIZE][PANEL_K + 1];
+    __local real Bsub[PANEL_K][TILE_SIZE + 1];
+
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int id = ly*TILE_SIZE + lx;
+    const int firstRow = get_group_id(1) * TILE_SIZE;
+    const int firstCol = get_group_id(0) * TILE_SIZE;
+    const int row = firstRow + ly;
+    const int col = firstCol + lx;
+
+    A += get_global_id(2) * stride_a;
+    B += get_global_id(2) * stride_b;
+    C += get_global_id(2) * stride_c;
+
+    real acc = 0;
+    for (int t=0; t < k; t += PANEL_K) {
+
+      // the index that is contiguous in memory runs fastest across work-items
+      for (int e=id; e < TILE_SIZE*PANEL_K; e += TILE_SIZE*TILE_SIZE) {
+#if TRANS_A
+        const int i = e % TILE_SIZE, p = e / TILE_SIZE;
+        Asub[i][p] = firstRow + i < m && t + p < k ? A[(t + p)*lda + firstRow + i] : 0;
+#else
+        const int i = e / PANEL_K, p = e % PANEL_K;
+        Asub[i][p] = firstRow + i < m && t + p < k ? A[(firstRow + i)*lda + t + p] : 0;
+#endif
+#if TRANS_B
+        const int j = e / PANEL_K, q = e % PANEL_K;
+        Bsub[q][j] = firstCol + j < n && t + q < k ? B[(firstCol + j)*ldb + t + q] : 0;
+#else
+        const int j = e % TILE_SIZE, q = e / TILE_SIZE;
+        Bsub[q][j] = firstCol + j < n && t + q < k ? B[(t + q)*ldb + firstCol + j] : 0;
+#endif
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      #pragma unroll
+      for (int p=0; p < PANEL_K; p++)
+        acc += Asub[ly][p] * Bsub[p][lx];
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (row < m && col < n)
+      C[row*ldc + col] = beta == 0 ? alpha * acc : alpha * acc + beta * C[row*ldc + col];
+}
+#endif
+#endif
@@ -0,0 +1,210 @@
+#define _DEFAULT_SOURCE
+
+#include <unistd.h>
+#include <mpi.h>
+#include "../asp.h"
+
+/* C = A * B spread over the MPI ranks with SUMMA
+
+   matrix_multMPI [M] [--shape MxKxN] [--type int|float|double] [--block B]
+
+   The ranks form a rows x cols grid (MPI_Dims_create) and each one keeps its
+   block of A, B and C. For every panel of K, the ranks owning it broadcast
+   their piece of A along the grid row and of B along the grid column, and
+   every rank accumulates its block of C with asp_gemm_streamed() over all
+   of its devices (--device all). Each rank builds its blocks from the
+   global indices, so nothing goes through rank 0.
+*/
+
+/* First index of part `p` of `n` split in `parts` */
+long part_start(long n, int parts, int p) {
+   return p * n / parts;
+}
+
+/* Part holding index `i` */
+int part_owner(long n, int parts, long i) {
+   int p = 0;
+   while(p + 1 < parts && part_start(n, parts, p + 1) <= i)
+      p++;
+   return p;
+}
+
+/* MPI_Bcast of any number of bytes: the count is an int, so big panels go
+   in pieces of at most 1 GB */
+void bcast_bytes(void* buffer, size_t bytes, int root, MPI_Comm comm) {
+   const size_t piece = 1 << 30;
+   for(size_t done = 0; done < bytes; done += piece)
+      MPI_Bcast((char*) buffer + done, bytes - done < piece ? (int) (bytes - done) : (int) piece, MPI_BYTE, root,
+            comm);
+}
+
+/* rows x cols block at (i0, j0) of the global matrix `seed` */
+void fill_block(void* X, int type, long i0, long j0, long rows, long cols, int seed) {
+   for(long i = 0; i < rows; i++)
+      for(long j = 0; j < cols; j++) {
+         const long v = ((i0 + i) * 7 + (j0 + j) * 13 + seed) % 10;
+         switch(type) {
+            case ASP_INT: ((int*) X)[i*cols + j] = v; break;
+            case ASP_FLOAT: ((float*) X)[i*cols + j] = v / 10.0f; break;
+            default: ((double*) X)[i*cols + j] = v / 10.0; break;
+         }
+      }
+}
+
+int main(int argc, char *argv[]) {
+
+   struct asp_session* sessions[MAX_DEVICES];
+   cl_device_id devices[MAX_DEVICES];
+   char hostname[100];
+   long m = 1024, n, k, block = 0;
+   int type = ASP_FLOAT, dims[2] = { 0, 0 }, num_sessions;
+   bool ok = true, shape = false;
+
+   double t = wall_time_ms();
+
+   gethostname(hostname, 100);
+
+   MPI_Init(NULL, NULL);
+
+   int world_size, world_rank;
+   MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+   MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+   parse_common_args(&argc, argv);
+   for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--shape") == 0 && i + 1 < argc)
+         ok = ok && (shape = sscanf(argv[++i], "%ldx%ldx%ld", &m, &k, &n) == 3);
+      else if(strcmp(argv[i], "--type") == 0 && i + 1 < argc) {
+         i++;
+         type = strcmp(argv[i], "float") == 0 ? ASP_FLOAT : strcmp(argv[i], "double") == 0 ? ASP_DOUBLE :
+               ASP_INT;
+         ok = ok && (type != ASP_INT || strcmp(argv[i], "int") == 0);
+      }
+      else if(strcmp(argv[i], "--block") == 0 && i + 1 < argc)
+         block = atol(argv[++i]);
+      else if(!shape)
+         m = atol(argv[i]);
+      else
+         ok = false;
+   }
+   if(!shape)
+      n = k = m;
+   if(!ok || m < 1 || n < 1 || k < 0) {
+      if(world_rank == 0)
+         fprintf(stderr, "Usage: %s [M] [--shape MxKxN] [--type int|float|double] [--block B]\n", argv[0]);
+      MPI_Finalize();
+      return 1;
+   }
+
+   /* Grid of ranks: the rows of A and C are split over dims[0] and the
+      columns of B and C over dims[1]; K is split over dims[1] in A and over
+      dims[0] in B */
+   MPI_Dims_create(world_size, 2, dims);
+   const int row = world_rank / dims[1], col = world_rank % dims[1];
+   MPI_Comm row_comm, col_comm;
+   MPI_Comm_split(MPI_COMM_WORLD, row, col, &row_comm);
+   MPI_Comm_split(MPI_COMM_WORLD, col, row, &col_comm);
+
+   const size_t elem = asp_type_sizes[type];
+   const long i0 = part_start(m, dims[0], row), rows = part_start(m, dims[0], row + 1) - i0;
+   const long j0 = part_start(n, dims[1], col), cols = part_start(n, dims[1], col + 1) - j0;
+   const long ka0 = part_start(k, dims[1], col), ka = part_start(k, dims[1], col + 1) - ka0;
+   const long kb0 = part_start(k, dims[0], row), kb = part_start(k, dims[0], row + 1) - kb0;
+   /* A panel never spans two owners, so it is no wider than the largest
+      part of K on either side of the grid */
+   long panel = block > 0 ? block : ASP_GEMM_STREAM_BLOCK;
+   if(panel > (k + dims[1] - 1) / dims[1])
+      panel = (k + dims[1] - 1) / dims[1];
+   if(panel > (k + dims[0] - 1) / dims[0])
+      panel = (k + dims[0] - 1) / dims[0];
+
+   char* A = (char*) malloc(rows * ka * elem + 1);
+   char* B = (char*) malloc(kb * cols * elem + 1);
+   char* C = (char*) calloc(rows * cols * elem + 1, 1);
+   char* A_panel = (char*) malloc(rows * panel * elem + 1);
+   char* B_panel = (char*) malloc(panel * cols * elem + 1);
+   fill_block(A, type, i0, ka0, rows, ka, 1);
+   fill_block(B, type, kb0, j0, kb, cols, 2);
+
+   /* Every device of the rank takes tiles of its block (CPU backend if none) */
+   num_sessions = select_devices(devices, MAX_DEVICES);
+   for(int d = 0; d < num_sessions; d++)
+      sessions[d] = asp_session_create(devices[d]);
+   if(num_sessions == 0)
+      sessions[num_sessions++] = asp_session_open();
+
+   double gemm_ms = 0;
+
+   /* SUMMA: each panel of K lies within one rank of the grid row (A) and one
+      of the grid column (B), which broadcast it */
+   for(long p0 = 0; p0 < k; ) {
+      const int a_owner = part_owner(k, dims[1], p0), b_owner = part_owner(k, dims[0], p0);
+      long p1 = p0 + panel;
+      if(p1 > part_start(k, dims[1], a_owner + 1))
+         p1 = part_start(k, dims[1], a_owner + 1);
+      if(p1 > part_start(k, dims[0], b_owner + 1))
+         p1 = part_start(k, dims[0], b_owner + 1);
+      const long w = p1 - p0;
+
+      if(col == a_owner)
+         asp_copy_block(A_panel, A + (p0 - ka0) * elem, rows, w, ka, elem, false);
+      if(row == b_owner)
+         memcpy(B_panel, B + (p0 - kb0) * cols * elem, w * cols * elem);
+      bcast_bytes(A_panel, rows * w * elem, a_owner, row_comm);
+      bcast_bytes(B_panel, w * cols * elem, b_owner, col_comm);
+
+      if(rows > 0 && cols > 0) {
+         asp_gemm_streamed(sessions, num_sessions, type, rows, cols, w, 1, A_panel, w, B_panel, cols, 1, C,
+               cols, block);
+         gemm_ms += sessions[0]->call_ms;
+      }
+      p0 = p1;
+   }
+
+   // comprobacion de cada bloque de C contra el backend de CPU
+   bool verified = true, all_verified;
+   int checked = 0, all_checked;
+   if(rows > 0 && cols > 0 && asp_verify_against_cpu(sessions[0], "gemm block")) {
+      char* A_rows = (char*) malloc(rows * k * elem + 1);
+      char* B_cols = (char*) malloc(k * cols * elem + 1);
+      char* ref = (char*) calloc(rows * cols * elem + 1, 1);
+      fill_block(A_rows, type, i0, 0, rows, k, 1);
+      fill_block(B_cols, type, 0, j0, k, cols, 2);
+      cpu_gemm_general(type, ASP_ROW_MAJOR, ASP_NO_TRANS, ASP_NO_TRANS, rows, cols, k, 1, A_rows,
+            k > 0 ? k : 1, B_cols, cols, 0, ref, cols);
+      verified = verify_matrix("gemm block", type, C, ref, rows * cols);
+      free(A_rows);
+      free(B_cols);
+      free(ref);
+      checked = 1;
+   }
+   MPI_Reduce(&verified, &all_verified, 1, MPI_C_BOOL, MPI_LAND, 0, MPI_COMM_WORLD);
+   MPI_Reduce(&checked, &all_checked, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+
+   printf("Hostname: %s -> bloque (%d, %d) %ldx%ld, %d dispositivos, %.2f ms\n", hostname, row, col, rows, cols,
+         num_sessions, gemm_ms);
+
+   MPI_Barrier(MPI_COMM_WORLD);
+   if(world_rank == 0) {
+      const double total = wall_time_ms() - t;
+      printf("Grid %dx%d, %s %ldx%ldx%ld\n", dims[0], dims[1], asp_type_names[type], m, k, n);
+      printf("Total tiempo: %f s (%.3f GFLOP/s)\n", total / 1000.0, 2.0 * m * n * k / (total * 1e6));
+      if(verify_enabled() && all_checked == 0)
+         printf("Verify gemm: skipped (CPU backend on every rank)\n");
+      else if(verify_enabled())
+         printf("Verify gemm: %s (%d of %d blocks)\n", all_verified ? "OK" : "FAILED", all_checked, world_size);
+   }
+
+   MPI_Comm_free(&row_comm);
+   MPI_Comm_free(&col_comm);
+   MPI_Finalize();
+
+   free(A);
+   free(B);
+   free(C);
+   free(A_panel);
+   free(B_panel);
+   for(int d = 0; d < num_sessions; d++)
+      asp_session_release(sessions[d]);
+   return world_rank != 0 || all_verified ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+#include "../asp.h"
+
+/* Monte Carlo integration of an expression with asp_integrate()
+
+   montecarlo EXPR [M] [--dim D] [--bounds A:B] ... [--seed S]
+
+   EXPR is OpenCL C in x[0] .. x[D-1], for example "exp(-x[0]*x[0])". A
+   single --bounds applies to every dimension; repeated, they go to x[0],
+   x[1]... in order. The default box is [0, 1)^D.
+*/
+int main(int argc, char *argv[]) {
+
+   struct asp_session* session;
+   struct asp_integral res;
+   double lower[ASP_MC_MAX_DIM], upper[ASP_MC_MAX_DIM];
+   unsigned long M = 1ul << 24, seed = 0;
+   const char* integrand = NULL;
+   int dim = 1, num_bounds = 0;
+   bool ok = true;
+
+   double t = wall_time_ms();
+
+   parse_common_args(&argc, argv);
+   for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--dim") == 0 && i + 1 < argc)
+         dim = atoi(argv[++i]);
+      else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+         seed = strtoul(argv[++i], NULL, 10);
+      else if(strcmp(argv[i], "--bounds") == 0 && i + 1 < argc && num_bounds < ASP_MC_MAX_DIM) {
+         ok = ok && sscanf(argv[++i], "%lf:%lf", &lower[num_bounds], &upper[num_bounds]) == 2;
+         num_bounds++;
+      }
+      else if(integrand == NULL)
+         integrand = argv[i];
+      else
+         M = strtoul(argv[i], NULL, 10);
+   }
+   if(integrand == NULL || !ok || dim < 1 || dim > ASP_MC_MAX_DIM || (num_bounds > 1 && num_bounds != dim)) {
+      fprintf(stderr, "Usage: %s EXPR [M] [--dim 1..%d] [--bounds A:B] ... [--seed S]\n", argv[0],
+            ASP_MC_MAX_DIM);
+      return 1;
+   }
+
+   // sin limites, [0, 1) en cada dimension; con uno solo, el mismo para todas
+   for(int i = num_bounds; i < dim; i++) {
+      lower[i] = num_bounds == 1 ? lower[0] : 0;
+      upper[i] = num_bounds == 1 ? upper[0] : 1;
+   }
+
+   session = asp_session_open();
+   session->verbose = true;
+
+   res = asp_integrate(session, integrand, dim, lower, upper, M, seed);
+   asp_print_time(session);
+
+   printf("Integral = %.15g +- %.3e (%lu puntos)\n", res.value, res.error, res.points);
+   printf("Total tiempo: %f s\n", (wall_time_ms() - t) / 1000.0);
+
+   asp_session_release(session);
+
+   return 0;
+}
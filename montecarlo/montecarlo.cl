@@ -0,0 +1,137 @@
+/* Generic Monte Carlo integration
+
+   The integrand comes as a line before the source and the rest as build
+   options:
+      #define INTEGRAND (expr)   expression of x[0] .. x[DIM-1]
+      -DDIM=1..16          dimensions
+      -DUSE_DOUBLE=0|1     real is double (with cl_khr_fp64) or float
+      -DWG_SIZE=n          work-group size, a power of two
+      -DREDUCE_VARIANT=0..2  work-group stage, as in pi_opencl.cl
+   Point i of the stream `seed` takes its coordinates from the Philox words
+   of (i, block) for blocks 0 .. (DIM-1)/4, scaled to [lower, lower+width).
+   Each work-group leaves the sum of f and of f*f over its points; asp.h
+   folds them on the device and derives the estimate and its error.
+*/
+#if USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+#define UNIT_BITS 32
+#else
+typedef float real;
+#define UNIT_BITS 23      // w + 0.5 must fit the 24 bits of a float or the top rounds to 1
+#endif
+
+#if REDUCE_VARIANT > 0
+   #if REDUCE_VARIANT == 2 && (defined(cl_khr_subgroups) || defined(cl_intel_subgroups))
+      #define USE_SUBGROUPS
+   #endif
+   #if WG_SIZE >= 1024
+      #define FOLD 32
+   #elif WG_SIZE >= 256
+      #define FOLD 16
+   #elif WG_SIZE >= 16
+      #define FOLD 4
+   #else
+      #define FOLD 1
+   #endif
+   #define LANES (WG_SIZE / FOLD)
+#endif
+
+/* Philox4x32-10 as in pi_opencl.cl, with the third counter word selecting
+   the block of 4 coordinates */
+uint4 philox(ulong ctr, uint block, uint2 key) {
+
+   uint4 c = (uint4)((uint) ctr, (uint) (ctr >> 32), block, 0);
+
+   for(int r = 0; r < 10; r++) {
+      uint hi0 = mul_hi(0xD2511F53u, c.s0), lo0 = 0xD2511F53u * c.s0;
+      uint hi1 = mul_hi(0xCD9E8D57u, c.s2), lo1 = 0xCD9E8D57u * c.s2;
+      c = (uint4)(hi1 ^ c.s1 ^ key.s0, lo1, hi0 ^ c.s3 ^ key.s1, lo0);
+      key += (uint2)(0x9E3779B9u, 0xBB67AE85u);
+   }
+   return c;
+}
+
+/* Sum of `v` over the work-group, valid in work-item 0 */
+real group_sum(real v, __local real* scratch) {
+
+   uint lid = get_local_id(0);
+
+#if defined(USE_SUBGROUPS)
+   v = sub_group_reduce_add(v);
+   if(get_sub_group_local_id() == 0)
+      scratch[get_sub_group_id()] = v;
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if(lid == 0)
+      for(uint g = 1; g < get_num_sub_groups(); g++)
+         v += scratch[g];
+#elif defined(LANES)
+   scratch[lid] = v;
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if(lid < LANES) {
+      #pragma unroll
+      for(uint s = 1; s < FOLD; s++)
+         v += scratch[lid + s*LANES];
+      scratch[lid] = v;
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if(lid == 0) {
+      #pragma unroll
+      for(uint s = 1; s < LANES; s++)
+         v += scratch[s];
+   }
+#else
+   scratch[lid] = v;
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   #pragma unroll
+   for(uint s = WG_SIZE / 2; s > 0; s >>= 1) {
+      if(lid < s)
+         scratch[lid] += scratch[lid + s];
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+   v = scratch[0];
+#endif
+   return v;
+}
+
+__attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+__kernel void mc_integrate(__local real* scratch,
+               __global real* group_sum_f,
+               __global real* group_sum_f2,
+               __constant real* lower,
+               __constant real* width,
+               ulong first, ulong M, ulong seed) {
+
+   const uint2 key = (uint2)((uint) seed, (uint) (seed >> 32));
+   const real scale = (real) 1 / (real) (1UL << UNIT_BITS);
+   real x[DIM], f, sum_f = 0, sum_f2 = 0;
+
+   for(ulong i = first + get_global_id(0); i < first + M; i += get_global_size(0)) {
+
+      #pragma unroll
+      for(int b = 0; b < (DIM + 3) / 4; b++) {
+         uint4 r = philox(i, b, key) >> (32 - UNIT_BITS);
+         uint w[4] = { r.s0, r.s1, r.s2, r.s3 };
+         #pragma unroll
+         for(int k = 0; k < 4 && 4*b + k < DIM; k++)
+            x[4*b + k] = lower[4*b + k] + width[4*b + k] * (((real) w[k] + (real) 0.5) * scale);
+      }
+
+      f = INTEGRAND;
+      sum_f += f;
+      sum_f2 += f * f;
+   }
+
+   sum_f = group_sum(sum_f, scratch);
+   barrier(CLK_LOCAL_MEM_FENCE);
+   sum_f2 = group_sum(sum_f2, scratch);
+
+   if(get_local_id(0) == 0) {
+      group_sum_f[get_group_id(0)] = sum_f;
+      group_sum_f2[get_group_id(0)] = sum_f2;
+   }
+}
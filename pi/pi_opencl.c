@@ -1,160 +1,82 @@
-#define PROGRAM_FILE "pi_opencl.cl"
-#define KERNEL_FUNC "pi_opencl"
-
-#include "../utils.h"
+#include "../asp.h"
 #include <limits.h>
 
-#define WG_SIZE 32
-
-int main() {
-
-   /* OpenCL structures */
-   cl_device_id device;
-   cl_context context;
-   cl_program program;
-   cl_kernel kernel;
-   cl_command_queue queue;
-   cl_int i, j, err;
-   size_t local_size, global_size;
-
-   /* Data and buffers    */
-   unsigned int *seeds, *part_dentros, total_dentros;
-   cl_mem seeds_buffer, part_dentros_buffer;
-   cl_int num_groups;
-
-   static unsigned int M = INT_MAX / 2;
-
-   local_size = WG_SIZE;
-   global_size = WG_SIZE * 128;
-
-   /* Initialize seeds */
-   seeds = (unsigned int*) calloc(global_size, sizeof(unsigned int));
-   for(i=0; i< global_size; i++)
-      seeds[i] = time(NULL) ^ i;
-
-   /* Create device and context 
-
-   Creates a context containing only one device — the device structure 
-   created earlier.
-   */
-   device = create_device();
-   context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-   if(err < 0) {
-      perror("Couldn't create a context");
-      exit(1);   
+/* Monte Carlo pi
+
+   pi_opencl [M] [--seed S] [--sampler philox|sobol]
+             [--error E] [--rel-error R] [--time-budget MS]
+
+   The points come from a counter-based generator, so the same M and seed 
+   give the same count on any device. With --error, --rel-error or 
+   --time-budget the number of points is not fixed: batches run until the 
+   standard error reaches E (or R times pi) or MS miliseconds have passed,
+   with M as the maximum number of points if it is given. --sampler sobol 
+   uses scrambled quasi-random points (at most 2^32, fixed M only).
+*/
+int main(int argc, char *argv[]) {
+
+   struct asp_session* session;
+   struct asp_pi_target target = { 0, 0, 0, 0, 0 };
+   struct asp_pi_estimate e;
+
+   unsigned long M = INT_MAX / 2, seed = 0;
+   bool adaptive = false, fixed_M = false;
+   int sampler = ASP_SAMPLER_PHILOX;
+
+   parse_common_args(&argc, argv);
+   for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+         seed = strtoul(argv[++i], NULL, 10);
+      else if(strcmp(argv[i], "--sampler") == 0 && i + 1 < argc)
+         sampler = strcmp(argv[++i], "sobol") == 0 ? ASP_SAMPLER_SOBOL : 
+               strcmp(argv[i], "philox") == 0 ? ASP_SAMPLER_PHILOX : -1;
+      else if(strcmp(argv[i], "--error") == 0 && i + 1 < argc)
+         target.abs_error = atof(argv[++i]);
+      else if(strcmp(argv[i], "--rel-error") == 0 && i + 1 < argc)
+         target.rel_error = atof(argv[++i]);
+      else if(strcmp(argv[i], "--time-budget") == 0 && i + 1 < argc)
+         target.time_ms = atof(argv[++i]);
+      else {
+         M = strtoul(argv[i], NULL, 10);
+         fixed_M = true;
+      }
    }
-
-   /* Build program */
-   program = build_program(context, device, PROGRAM_FILE);
-
-   /* Create data buffer 
-
-   • `global_size`: total number of work items that will be 
-      executed on the GPU (e.g. total size of your array)
-   • `local_size`: size of local workgroup. Each workgroup contains 
-      several work items and goes to a compute unit 
-
-   In this example, the kernel is executed by eight work-items divided into 
-   two work-groups of four work-items each. Returning to my analogy, 
-   this corresponds to a school containing eight students divided into 
-   two classrooms of four students each.   
-
-     Notes: 
-   • Intel recommends workgroup size of 64-128. Often 128 is minimum to 
-   get good performance on GPU
-   • On NVIDIA Fermi, workgroup size must be at least 192 for full 
-   utilization of cores
-   • Optimal workgroup size differs across applications
-   */
-   num_groups = global_size / local_size;
-   printf("Num groups: %d GlobalSize: %ld LocalSize: %ld\n", num_groups, global_size, local_size);
-   seeds_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY |
-         CL_MEM_COPY_HOST_PTR, global_size * sizeof(unsigned int), seeds, &err); // <=====INPUT
-   part_dentros_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, num_groups * sizeof(unsigned int), NULL, &err);
-   if(err < 0) {
-      perror("Couldn't create a buffer");
-      exit(1);   
-   };
-
-   free(seeds);
-
-   /* Create a command queue 
-
-   Does not support profiling or out-of-order-execution
-   */
-   queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
-   if(err < 0) {
-      perror("Couldn't create a command queue");
-      exit(1);   
-   };
-
-   /* Create a kernel */
-   kernel = clCreateKernel(program, KERNEL_FUNC, &err);
-   if(err < 0) {
-      perror("Couldn't create a kernel");
-      exit(1);
-   };
-
-   /* Create kernel arguments */
-   err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &seeds_buffer); // <=====INPUT
-   err |= clSetKernelArg(kernel, 1, local_size * sizeof(unsigned int), NULL);
-   err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &part_dentros_buffer); // <=====OUTPUT
-   err |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &M);
-   if(err < 0) {
-      perror("Couldn't create a kernel argument");
-      exit(1);
+   adaptive = target.abs_error > 0 || target.rel_error > 0 || target.time_ms > 0;
+   if(sampler < 0 || (adaptive && sampler == ASP_SAMPLER_SOBOL)) {
+      fprintf(stderr, "Usage: %s [M] [--seed S] [--sampler philox|sobol] "
+            "[--error E] [--rel-error R] [--time-budget MS] (the adaptive mode uses philox)\n", argv[0]);
+      return 1;
    }
 
-   /* Enqueue kernel 
-
-   At this point, the application has created all the data structures 
-   (device, kernel, program, command queue, and context) needed by an 
-   OpenCL host application. Now, it deploys the kernel to a device.
+   session = asp_session_open();
+   session->verbose = true;
 
-   Of the OpenCL functions that run on the host, clEnqueueNDRangeKernel 
-   is probably the most important to understand. Not only does it deploy 
-   kernels to devices, it also identifies how many work-items should 
-   be generated to execute the kernel (global_size) and the number of 
-   work-items in each work-group (local_size).
-   */
-   cl_event event;
-   err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_size, 
-         &local_size, 0, NULL, &event); 
-   if(err < 0) {
-      perror("Couldn't enqueue the kernel");
-      exit(1);
+   if(adaptive) {
+      target.max_points = fixed_M ? M : 0;
+      e = asp_pi_adaptive(session, &target, seed);
    }
-
-   part_dentros = (unsigned int*) calloc(num_groups, sizeof(unsigned int));
-
-   clWaitForEvents(1, &event);
-   clFinish(queue);
-
-   print_time_exec(event);
-
-   /* Read the kernel's output    */
-   err = clEnqueueReadBuffer(queue, part_dentros_buffer, CL_TRUE, 0, 
-         sizeof(unsigned int) * num_groups, part_dentros, 0, NULL, NULL); // <=====GET OUTPUT
-   if(err < 0) {
-      perror("Couldn't read the buffer");
-      exit(1);
+   else {
+      e.points = M;
+      e.hits = asp_pi_hits(session, 0, M, seed, sampler);
+      e.pi = M > 0 ? 4.0 * e.hits / M : 0.0;
+      e.error = M > 0 ? 4.0 * sqrt(e.pi / 4 * (1 - e.pi / 4) / M) : 0.0;
    }
+   asp_print_time(session);
 
-   total_dentros = 0;
-   for(j=0; j<num_groups; j++)
-      total_dentros += part_dentros[j];
+   printf("%.50f\n", e.pi);
+   if(sampler == ASP_SAMPLER_SOBOL)   // sin muestras independientes no hay error estimado
+      printf("Error respecto a pi: %.3e (%lu puntos Sobol)\n", fabs(e.pi - 3.14159265358979323846), e.points);
+   else
+      printf("Error estimado: %.3e (%lu puntos)\n", e.error, e.points);
 
-   printf("%.50f\n", (4.0 * total_dentros) / M);
+   // una estimacion de Monte Carlo no es exacta: se acepta a 5 desviaciones,
+   // pero la cuenta de puntos si tiene que coincidir con la de la CPU
+   bool ok = !verify_enabled() || verify_pi(e.pi, e.points, 5.0);
+   if(ok && asp_verify_against_cpu(session, "pi points"))
+      ok = verify_long("pi points", e.hits, sampler == ASP_SAMPLER_SOBOL ?
+            cpu_pi_hits_sobol(0, e.points, seed) : cpu_pi_hits(0, e.points, seed));
 
-   free(part_dentros);
-   
-   /* Deallocate resources */
-   clReleaseKernel(kernel);
-   clReleaseMemObject(seeds_buffer);
-   clReleaseMemObject(part_dentros_buffer);
-   clReleaseCommandQueue(queue);
-   clReleaseProgram(program);
-   clReleaseContext(context);
+   asp_session_release(session);
 
-   return 0;
+   return ok ? 0 : 1;
 }
@@ -1,53 +1,160 @@
+/* Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 
+   3"): the 4 words of point pair `ctr` of the stream `key` depend on nothing 
+   else, so the samples do not depend on the grid and any range of them can 
+   be computed anywhere. Same function as cpu_philox() in asp_cpu.h */
+uint4 philox(ulong ctr, uint2 key) {
 
-uint wang_hash(uint seed)
-{
-        seed = (seed ^ 61) ^ (seed >> 16);
-        seed *= 9;
-        seed = seed ^ (seed >> 4);
-        seed *= 0x27d4eb2d;
-        seed = seed ^ (seed >> 15);
-        return seed;
- }
-
-  float random_num(uint* seed)                
- {
-     uint maxint=0;
-     maxint--; // not ok but works
-     uint rndint=wang_hash(*seed);
-     *seed=rndint;
-     return ((float)rndint)/(float)maxint;
- }
-
-__kernel void pi_opencl(__global unsigned int * seeds,
-               __local unsigned int* local_result,
-               __global unsigned int* group_dentros,
-               unsigned int M) {
-
-   uint gid, num_puntos, part_dentro, seed, max_hilos;
+   uint4 c = (uint4)((uint) ctr, (uint) (ctr >> 32), 0, 0);
+
+   for(int r = 0; r < 10; r++) {
+      uint hi0 = mul_hi(0xD2511F53u, c.s0), lo0 = 0xD2511F53u * c.s0;
+      uint hi1 = mul_hi(0xCD9E8D57u, c.s2), lo1 = 0xCD9E8D57u * c.s2;
+      c = (uint4)(hi1 ^ c.s1 ^ key.s0, lo1, hi0 ^ c.s3 ^ key.s1, lo0);
+      key += (uint2)(0x9E3779B9u, 0xBB67AE85u);
+   }
+   return c;
+}
+
+/* x, y with 31 bits each, compared in integers so every device (and the 
+   CPU) counts exactly the same points */
+#define DENTRO(x, y) ((ulong) ((x) >> 1) * ((x) >> 1) + (ulong) ((y) >> 1) * ((y) >> 1) <= (1ul << 62))
+
+/* -DSAMPLER=1: Sobol points instead of Philox (dimensions 1 and 2, 32 bits,
+   so at most 2^32 points), scrambled with a random digital shift taken from
+   philox(0, seed). A Sobol coordinate is the XOR of direction numbers over 
+   the bits of the index, so point 8b+j is point 8b XOR point j: each 
+   work-item builds a block of 8 points with uint8 operations. Same points as
+   cpu_pi_hits_sobol() in asp_cpu.h */
+#if SAMPLER == 1
+uint sobol_x(uint i) {
+   // primera dimension: los bits del indice al reves (van der Corput)
+   i = ((i >> 1) & 0x55555555u) | ((i & 0x55555555u) << 1);
+   i = ((i >> 2) & 0x33333333u) | ((i & 0x33333333u) << 2);
+   i = ((i >> 4) & 0x0F0F0F0Fu) | ((i & 0x0F0F0F0Fu) << 4);
+   i = ((i >> 8) & 0x00FF00FFu) | ((i & 0x00FF00FFu) << 8);
+   return (i >> 16) | (i << 16);
+}
+
+uint sobol_y(uint i) {
+   // segunda dimension: polinomio x+1, v_k = v_(k-1) ^ (v_(k-1) >> 1)
+   uint y = 0, v = 0x80000000u;
+   for(; i; i >>= 1, v ^= v >> 1)
+      if(i & 1)
+         y ^= v;
+   return y;
+}
+#endif
+
+/* With -DWG_SIZE=... the work-group size is fixed, so the reduction below 
+   has a constant trip count and is unrolled. -DREDUCE_VARIANT picks the 
+   work-group stage as in add_numbers.cl: 0 tree, 1 two barriers with 
+   FOLD-wide unrolled sums, 2 subgroups when the compiler has them */
+#if defined(WG_SIZE) && REDUCE_VARIANT > 0
+   #if REDUCE_VARIANT == 2 && (defined(cl_khr_subgroups) || defined(cl_intel_subgroups))
+      #define USE_SUBGROUPS
+   #endif
+   #if WG_SIZE >= 1024
+      #define FOLD 32
+   #elif WG_SIZE >= 256
+      #define FOLD 16
+   #elif WG_SIZE >= 16
+      #define FOLD 4
+   #else
+      #define FOLD 1
+   #endif
+   #define LANES (WG_SIZE / FOLD)
+#endif
+
+#ifdef WG_SIZE
+__attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+#endif
+__kernel void pi_opencl(__local ulong* local_result,
+               __global ulong* group_dentros,
+               ulong first, ulong M, ulong seed) {
+
+   ulong gid, max_hilos, part_dentro, end;
 
    gid = get_global_id(0);
    max_hilos = get_global_size(0);
 
-   num_puntos = M /max_hilos;
-   if (gid == 0)
-      num_puntos += M % max_hilos;
-
-   seed = seeds[gid];
+   /* Los puntos first .. first+M-1 del flujo `seed`; cada llamada a philox 
+      da dos puntos (2p y 2p+1), asi que se recorren pares con paso de rejilla */
+   const uint2 key = (uint2)((uint) seed, (uint) (seed >> 32));
+   end = first + M;
 
    part_dentro = 0;
-   for(uint i=0; i < num_puntos; i++){
-      float x = random_num(&seed);
-      float y = random_num(&seed);
-      if (x*x + y*y <= 1)
+#if SAMPLER == 1
+   const uint4 shift = philox(0, key);
+   const uint8 lane_x = (uint8)(0, 0x80000000u, 0x40000000u, 0xC0000000u, 
+         0x20000000u, 0xA0000000u, 0x60000000u, 0xE0000000u);
+   const uint8 lane_y = (uint8)(0, 0x80000000u, 0xC0000000u, 0x40000000u, 
+         0xA0000000u, 0x20000000u, 0x60000000u, 0xE0000000u);
+   const ulong8 lane = (ulong8)(0, 1, 2, 3, 4, 5, 6, 7);
+
+   // bloques de 8 puntos consecutivos; los de los extremos se enmascaran
+   for(ulong b = first / 8 + gid; b <= (end - 1) / 8; b += max_hilos) {
+      uint8 x = (uint8)(sobol_x(8*b) ^ shift.s0) ^ lane_x;
+      uint8 y = (uint8)(sobol_y(8*b) ^ shift.s1) ^ lane_y;
+      ulong8 xx = convert_ulong8(x >> 1), yy = convert_ulong8(y >> 1);
+      ulong8 i = (ulong8)(8*b) + lane;
+      long8 in = (xx*xx + yy*yy <= (ulong8)(1ul << 62)) & (i >= (ulong8)(first)) & (i < (ulong8)(end));
+      part_dentro -= in.s0 + in.s1 + in.s2 + in.s3 + in.s4 + in.s5 + in.s6 + in.s7;
+   }
+#else
+   for(ulong p = first / 2 + gid; p <= (end - 1) / 2; p += max_hilos) {
+      uint4 r = philox(p, key);
+      if(2*p >= first && DENTRO(r.s0, r.s1))
+         part_dentro++;
+      if(2*p + 1 < end && DENTRO(r.s2, r.s3))
          part_dentro++;
    }
+#endif
 
    uint local_indx = get_local_id(0);
+
+#if defined(USE_SUBGROUPS)
+   part_dentro = sub_group_reduce_add(part_dentro);
+   if(get_sub_group_local_id() == 0)
+      local_result[get_sub_group_id()] = part_dentro;
+
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if(local_indx == 0) {
+      for(uint g = 1; g < get_num_sub_groups(); g++)
+         part_dentro += local_result[g];
+      group_dentros[get_group_id(0)] = part_dentro;
+   }
+#elif defined(LANES)
+   local_result[local_indx] = part_dentro;
+
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if(local_indx < LANES) {
+      #pragma unroll
+      for(uint s = 1; s < FOLD; s++)
+         part_dentro += local_result[local_indx + s*LANES];
+      local_result[local_indx] = part_dentro;
+   }
+
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if(local_indx == 0) {
+      #pragma unroll
+      for(uint s = 1; s < LANES; s++)
+         part_dentro += local_result[s];
+      group_dentros[get_group_id(0)] = part_dentro;
+   }
+#else
    local_result[local_indx] = part_dentro;
 
    barrier(CLK_LOCAL_MEM_FENCE);
 
+#ifdef WG_SIZE
+   #pragma unroll
+   for (uint s=WG_SIZE/2; s>0; s>>=1) {
+#else
    for (uint s=get_local_size(0)/2; s>0; s>>=1) {
+#endif
       if (local_indx < s)
          local_result[local_indx] += local_result[local_indx + s];
       barrier(CLK_LOCAL_MEM_FENCE);
@@ -55,4 +162,5 @@ __kernel void pi_opencl(__global unsigned int * seeds,
 
    if(local_indx == 0)
       group_dentros[get_group_id(0)] = local_result[0];
+#endif
 }
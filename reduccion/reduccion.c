@@ -0,0 +1,137 @@
+#include "../asp.h"
+
+/* Reduction of N random values with asp_reduce()
+
+   reduccion [N] [--type int|long|float|double] 
+             [--op sum|min|max|argmin|argmax|count_if] [--where CMP:VALUE]
+             [--save FILE] [--file FILE [--chunk MB]]
+
+   --where sets the predicate of count_if: CMP is lt, le, eq, ne, ge or gt
+   (by default gt:0). --save writes the N values as a raw binary file and 
+   --file streams such a file through the device in chunks of --chunk MB 
+   (asp_reduce_file()) instead of generating values.
+*/
+
+int find_name(const char* name, const char** names, int count) {
+   for(int i = 0; i < count; i++)
+      if(strcmp(name, names[i]) == 0)
+         return i;
+   return -1;
+}
+
+/* Values in [-500, 500) so min, max and count-if have something to find */
+void random_values(void* v, long N, int type) {
+
+   srand(time(NULL));
+   for(long i = 0; i < N; i++) {
+      int r = rand() % 1000 - 500;
+      switch(type) {
+         case ASP_INT: ((int*) v)[i] = r; break;
+         case ASP_LONG: ((long*) v)[i] = (long) r * 1000003; break;
+         case ASP_FLOAT: ((float*) v)[i] = r / 7.0f; break;
+         default: ((double*) v)[i] = r / 7.0; break;
+      }
+   }
+}
+
+void save_values(const char* path, const void* data, size_t size) {
+
+   FILE* f = fopen(path, "wb");
+   if(f == NULL || fwrite(data, 1, size, f) != size) {
+      perror("Couldn't write the output file");
+      exit(1);
+   }
+   fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+
+   struct asp_session* session;
+   struct asp_predicate pred = { ASP_GT, 0 };
+   struct asp_reduction res;
+   int type = ASP_INT, op = ASP_REDUCE_SUM;
+   long N = 1 << 20;
+   bool ok = true;
+   const char *file = NULL, *save = NULL;
+   size_t chunk = 0, size;
+   void* data = NULL;
+   char cmp[8];
+
+   double t = wall_time_ms();
+
+   parse_common_args(&argc, argv);
+   for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "--type") == 0 && i + 1 < argc)
+         type = find_name(argv[++i], asp_type_names, ASP_NUM_TYPES);
+      else if(strcmp(argv[i], "--op") == 0 && i + 1 < argc)
+         op = find_name(argv[++i], asp_reduce_names, ASP_NUM_REDUCE_OPS);
+      else if(strcmp(argv[i], "--where") == 0 && i + 1 < argc) {
+         i++;
+         if(sscanf(argv[i], "%7[a-z]:%lf", cmp, &pred.threshold) == 2)
+            pred.compare = find_name(cmp, asp_compare_names, ASP_NUM_COMPARES);
+         else
+            ok = false;
+      }
+      else if(strcmp(argv[i], "--file") == 0 && i + 1 < argc)
+         file = argv[++i];
+      else if(strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+         save = argv[++i];
+      else if(strcmp(argv[i], "--chunk") == 0 && i + 1 < argc)
+         chunk = strtol(argv[++i], NULL, 10) << 20;
+      else if(argv[i][0] != '-')
+         N = strtol(argv[i], NULL, 10);
+      else
+         type = -1;
+   }
+   if(!ok || type < 0 || op < 0 || pred.compare < 0) {
+      fprintf(stderr, "Usage: %s [N] [--type int|long|float|double] "
+            "[--op sum|min|max|argmin|argmax|count_if] [--where lt|le|eq|ne|ge|gt:VALUE] "
+            "[--save FILE] [--file FILE [--chunk MB]]\n", argv[0]);
+      return 1;
+   }
+
+   session = asp_session_open();
+   session->verbose = true;
+
+   if(file != NULL) {
+      res = asp_reduce_file(session, file, type, op, &pred, chunk);
+      asp_print_time(session);
+   }
+   else {
+      // memoria de host fijada (pinned) del pool de la sesion
+      data = asp_acquire_host(session, N * asp_type_sizes[type]);
+      random_values(data, N, type);
+      if(save != NULL)
+         save_values(save, data, N * asp_type_sizes[type]);
+
+      res = asp_reduce(session, data, N, type, op, &pred);
+      asp_print_time(session);
+   }
+
+   if(type <= ASP_LONG || op == ASP_REDUCE_COUNT_IF)
+      printf("Computed %s(%s) = %ld", asp_reduce_names[op], asp_type_names[type], res.ivalue);
+   else
+      printf("Computed %s(%s) = %.17g", asp_reduce_names[op], asp_type_names[type], res.fvalue);
+   if(res.index >= 0)
+      printf(" at %ld", res.index);
+   printf("\n");
+   printf("Total tiempo: %f s\n", (wall_time_ms() - t) / 1000.0);
+
+   // comprobacion contra el backend de CPU (otra pasada sobre el fichero)
+   if(file != NULL) {
+      if(asp_verify_against_cpu(session, asp_reduce_names[op])) {
+         const void* mapped = map_file(file, &size);
+         N = size / asp_type_sizes[type];
+         ok = verify_reduction(asp_reduce_names[op], res, cpu_reduce(mapped, N, type, op, &pred), type, op);
+         unmap_file(mapped, size);
+      }
+   }
+   else {
+      if(asp_verify_against_cpu(session, asp_reduce_names[op]))
+         ok = verify_reduction(asp_reduce_names[op], res, cpu_reduce(data, N, type, op, &pred), type, op);
+      asp_release_host(session, data);
+   }
+   asp_session_release(session);
+
+   return ok ? 0 : 1;
+}
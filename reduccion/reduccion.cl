@@ -0,0 +1,277 @@
+/* Generic reduction
+
+   One program per type and operator, chosen at build time:
+      -DREDUCE_TYPE=0..3   input int, long, float, double
+      -DREDUCE_OP=0..5     sum, min, max, argmin, argmax, count-if
+      -DREDUCE_CMP=0..5    count-if predicate x < t, <=, ==, !=, >=, > t
+      -DWG_SIZE=n          work-group size, a power of two
+      -DREDUCE_VARIANT=0..2  work-group stage, chosen per device by asp.h
+   reduce_first reads the input with a grid-stride loop and leaves one
+   partial per work-group; reduce_next folds partials the same way until a
+   single work-group writes the result, so the whole reduction stays on the
+   device. Sums of int and counts accumulate in long.
+
+   Variant 0 is the tree with a barrier per step. Variant 1 loads the input 
+   as 4-vectors into four accumulators per work-item and reduces the group 
+   with two barriers: LANES work-items fold FOLD values each, then work-item 
+   0 folds the LANES results, both loops unrolled. Variant 2 replaces the 
+   group stage by subgroup reductions when the compiler offers 
+   cl_khr_subgroups or cl_intel_subgroups, and is variant 1 otherwise.
+*/
+#if REDUCE_TYPE == 3
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#if REDUCE_TYPE == 0
+typedef int T;
+typedef int4 T4;
+#elif REDUCE_TYPE == 1
+typedef long T;
+typedef long4 T4;
+#elif REDUCE_TYPE == 2
+typedef float T;
+typedef float4 T4;
+#else
+typedef double T;
+typedef double4 T4;
+#endif
+
+#if REDUCE_VARIANT > 0
+   #if REDUCE_VARIANT == 2 && (defined(cl_khr_subgroups) || defined(cl_intel_subgroups))
+      #define USE_SUBGROUPS
+   #endif
+   #if WG_SIZE >= 1024
+      #define FOLD 32
+   #elif WG_SIZE >= 256
+      #define FOLD 16
+   #elif WG_SIZE >= 16
+      #define FOLD 4
+   #else
+      #define FOLD 1
+   #endif
+   #define LANES (WG_SIZE / FOLD)
+#endif
+
+#if REDUCE_OP == 5 || REDUCE_TYPE <= 1
+typedef long ACC;
+#define ACC_MAX LONG_MAX
+#define ACC_MIN LONG_MIN
+#elif REDUCE_TYPE == 2
+typedef float ACC;
+#define ACC_MAX INFINITY
+#define ACC_MIN (-INFINITY)
+#else
+typedef double ACC;
+#define ACC_MAX INFINITY
+#define ACC_MIN (-INFINITY)
+#endif
+
+#if REDUCE_OP == 0 || REDUCE_OP == 5
+#define IDENTITY 0
+#elif REDUCE_OP == 1 || REDUCE_OP == 3
+#define IDENTITY ACC_MAX
+#else
+#define IDENTITY ACC_MIN
+#endif
+
+#define HAS_INDEX (REDUCE_OP == 3 || REDUCE_OP == 4)
+
+/* Fold (b, ib) into (a, ia). Ties keep the first position */
+void combine(ACC* a, long* ia, ACC b, long ib) {
+#if REDUCE_OP == 0 || REDUCE_OP == 5
+   *a += b;
+#elif REDUCE_OP == 1
+   *a = b < *a ? b : *a;
+#elif REDUCE_OP == 2
+   *a = b > *a ? b : *a;
+#elif REDUCE_OP == 3
+   if(b < *a || (b == *a && ib < *ia)) { *a = b; *ia = ib; }
+#else
+   if(b > *a || (b == *a && ib < *ia)) { *a = b; *ia = ib; }
+#endif
+}
+
+/* Input element as accumulator (the predicate for count-if) */
+ACC load(T x, T threshold) {
+#if REDUCE_OP == 5
+   #if REDUCE_CMP == 0
+   return x < threshold;
+   #elif REDUCE_CMP == 1
+   return x <= threshold;
+   #elif REDUCE_CMP == 2
+   return x == threshold;
+   #elif REDUCE_CMP == 3
+   return x != threshold;
+   #elif REDUCE_CMP == 4
+   return x >= threshold;
+   #else
+   return x > threshold;
+   #endif
+#else
+   return x;
+#endif
+}
+
+/* Reduction of one value per work-item, result of the group to out */
+void reduce_group(__local ACC* values, __local long* positions, ACC acc, long at,
+      __global ACC* out, __global long* out_index) {
+
+   const int lid = get_local_id(0);
+
+#if defined(USE_SUBGROUPS)
+   /* Each subgroup reduces in registers, its first work-item keeps the result. 
+      For argmin/argmax the position is the lowest one holding the extreme */
+   #if REDUCE_OP == 0 || REDUCE_OP == 5
+   ACC best = sub_group_reduce_add(acc);
+   #elif REDUCE_OP == 1 || REDUCE_OP == 3
+   ACC best = sub_group_reduce_min(acc);
+   #else
+   ACC best = sub_group_reduce_max(acc);
+   #endif
+   #if HAS_INDEX
+   at = sub_group_reduce_min(acc == best ? at : LONG_MAX);
+   #endif
+   if(get_sub_group_local_id() == 0) {
+      values[get_sub_group_id()] = best;
+   #if HAS_INDEX
+      positions[get_sub_group_id()] = at;
+   #endif
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if(lid == 0) {
+      acc = values[0];
+   #if HAS_INDEX
+      at = positions[0];
+   #endif
+      for(uint g = 1; g < get_num_sub_groups(); g++)
+   #if HAS_INDEX
+         combine(&acc, &at, values[g], positions[g]);
+   #else
+         combine(&acc, &at, values[g], 0);
+   #endif
+   }
+#elif defined(LANES)
+   values[lid] = acc;
+   #if HAS_INDEX
+   positions[lid] = at;
+   #endif
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   /* LANES work-items fold FOLD values each, reading with stride LANES */
+   if(lid < LANES) {
+      #pragma unroll
+      for(int k = 1; k < FOLD; k++)
+   #if HAS_INDEX
+         combine(&acc, &at, values[lid + k*LANES], positions[lid + k*LANES]);
+   #else
+         combine(&acc, &at, values[lid + k*LANES], 0);
+   #endif
+      values[lid] = acc;
+   #if HAS_INDEX
+      positions[lid] = at;
+   #endif
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if(lid == 0) {
+      #pragma unroll
+      for(int k = 1; k < LANES; k++)
+   #if HAS_INDEX
+         combine(&acc, &at, values[k], positions[k]);
+   #else
+         combine(&acc, &at, values[k], 0);
+   #endif
+   }
+#else
+   values[lid] = acc;
+   #if HAS_INDEX
+   positions[lid] = at;
+   #endif
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   #pragma unroll
+   for(int s = WG_SIZE / 2; s > 0; s >>= 1) {
+      if(lid < s) {
+         ACC a = values[lid];
+         long ia = 0;
+   #if HAS_INDEX
+         ia = positions[lid];
+         combine(&a, &ia, values[lid + s], positions[lid + s]);
+         positions[lid] = ia;
+   #else
+         combine(&a, &ia, values[lid + s], 0);
+   #endif
+         values[lid] = a;
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+
+   acc = values[0];
+   #if HAS_INDEX
+   at = positions[0];
+   #endif
+#endif
+
+   if(lid == 0) {
+      out[get_group_id(0)] = acc;
+#if HAS_INDEX
+      out_index[get_group_id(0)] = at;
+#endif
+   }
+}
+
+__attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+__kernel void reduce_first(const __global T* in, const long n, const T threshold,
+      __global ACC* out, __global long* out_index) {
+
+   __local ACC values[WG_SIZE];
+   __local long positions[HAS_INDEX ? WG_SIZE : 1];
+   ACC acc = IDENTITY;
+   long at = LONG_MAX;
+
+#ifdef LANES
+   /* 4-vector loads into four independent accumulators */
+   ACC acc1 = IDENTITY, acc2 = IDENTITY, acc3 = IDENTITY;
+   long at1 = LONG_MAX, at2 = LONG_MAX, at3 = LONG_MAX;
+   const long n4 = n / 4;
+
+   for(long i = get_global_id(0); i < n4; i += get_global_size(0)) {
+      const T4 v = vload4(i, in);
+      combine(&acc, &at, load(v.s0, threshold), 4*i);
+      combine(&acc1, &at1, load(v.s1, threshold), 4*i + 1);
+      combine(&acc2, &at2, load(v.s2, threshold), 4*i + 2);
+      combine(&acc3, &at3, load(v.s3, threshold), 4*i + 3);
+   }
+   for(long i = 4*n4 + get_global_id(0); i < n; i += get_global_size(0))
+      combine(&acc, &at, load(in[i], threshold), i);
+
+   combine(&acc, &at, acc1, at1);
+   combine(&acc, &at, acc2, at2);
+   combine(&acc, &at, acc3, at3);
+#else
+   for(long i = get_global_id(0); i < n; i += get_global_size(0))
+      combine(&acc, &at, load(in[i], threshold), i);
+#endif
+
+   reduce_group(values, positions, acc, at, out, out_index);
+}
+
+__attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+__kernel void reduce_next(const __global ACC* in, const __global long* in_index, const long n,
+      __global ACC* out, __global long* out_index) {
+
+   __local ACC values[WG_SIZE];
+   __local long positions[HAS_INDEX ? WG_SIZE : 1];
+   ACC acc = IDENTITY;
+   long at = LONG_MAX;
+
+   for(long i = get_global_id(0); i < n; i += get_global_size(0))
+#if HAS_INDEX
+      combine(&acc, &at, in[i], in_index[i]);
+#else
+      combine(&acc, &at, in[i], i);
+#endif
+
+   reduce_group(values, positions, acc, at, out, out_index);
+}
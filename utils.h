@@ -3,12 +3,24 @@
 
 #define CL_TARGET_OPENCL_VERSION 120
 
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #ifdef MAC
     #include <OpenCL/cl.h>
@@ -32,28 +44,729 @@ void print_time_exec(cl_event event){
    printf("OpenCl Execution time is: %0.3f mili seconds \n", nanoSeconds );
 }
 
+/* Wall clock in miliseconds (clock() only counts CPU time) */
+double wall_time_ms() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
 
-cl_device_id create_device() {
 
-   cl_platform_id platform;
-   cl_device_id dev;
-   int err;
+/* Read-only mapping of a whole file for the streaming reductions. The pages 
+   are read from disk when touched; map_file_done() drops the ones already 
+   used so a pass over a file larger than memory keeps a constant footprint */
+const void* map_file(const char* path, size_t* size) {
 
-   /* Identify a platform */
-   err = clGetPlatformIDs(1, &platform, NULL);
-   if(err < 0) {
-      perror("Couldn't identify a platform");
+   struct stat st;
+   void* data;
+   int fd;
+
+   fd = open(path, O_RDONLY);
+   if(fd < 0 || fstat(fd, &st) < 0) {
+      perror("Couldn't open the input file");
       exit(1);
-   } 
+   }
+   *size = st.st_size;
+   if(*size == 0) {
+      close(fd);
+      return NULL;
+   }
 
-   // Access a device
-   // GPU
-   err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &dev, NULL);
-   if(err == CL_DEVICE_NOT_FOUND) {
-      // CPU
-      err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_CPU, 1, &dev, NULL);
+   data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(data == MAP_FAILED) {
+      perror("Couldn't map the input file");
+      exit(1);
    }
-   if(err < 0) {
+   madvise(data, *size, MADV_SEQUENTIAL);
+   return data;
+}
+
+/* `offset` must be a multiple of the page size */
+void map_file_done(const void* data, size_t offset, size_t size) {
+   madvise((char*) data + offset, size, MADV_DONTNEED);
+}
+
+/* Writable shared mapping of a file of `size` bytes, created or resized,
+   for results larger than memory (the pages go back to the file) */
+void* map_file_rw(const char* path, size_t size) {
+
+   void* data;
+   int fd;
+
+   fd = open(path, O_RDWR | O_CREAT, 0644);
+   if(fd < 0 || ftruncate(fd, size) < 0) {
+      perror("Couldn't create the output file");
+      exit(1);
+   }
+   if(size == 0) {
+      close(fd);
+      return NULL;
+   }
+
+   data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if(data == MAP_FAILED) {
+      perror("Couldn't map the output file");
+      exit(1);
+   }
+   return data;
+}
+
+void unmap_file(const void* data, size_t size) {
+   if(data != NULL)
+      munmap((void*) data, size);
+}
+
+
+/* Streaming image files
+
+   Binary PGM (P5, gray) and PPM (P6, RGB) with 8 or 16-bit samples, or raw
+   frames of 8-bit interleaved samples whose size comes from the command 
+   line. A file can hold several images one after the other (a video as 
+   raw frames or concatenated PNMs): image_next() moves to the next one.
+   image_read_rows() reads the next rows of the current image into planar
+   floats (channel c of row r at dst[c * plane + r * width]), so an image
+   goes through memory a band of rows at a time. image_create() and 
+   image_write_rows() do the opposite, clamping and rounding the samples. */
+struct image_file {
+   FILE* f;
+   bool raw;                     // headerless frames of width x height x channels
+   int width, height, channels, maxval;
+   int row;                      // next row of the current image
+   unsigned char* line;          // one row of samples as stored
+};
+
+int image_header_int(FILE* f) {
+
+   int c, v;
+
+   for(c = fgetc(f); c != EOF && (isspace(c) || c == '#'); c = fgetc(f))
+      if(c == '#')
+         while(c != EOF && c != '\n')
+            c = fgetc(f);
+   ungetc(c, f);
+   return fscanf(f, "%d", &v) == 1 ? v : -1;
+}
+
+size_t image_line_size(const struct image_file* img) {
+   return (size_t) img->width * img->channels * (img->maxval > 255 ? 2 : 1);
+}
+
+/* Next image of the file; false at the end */
+bool image_next(struct image_file* img) {
+
+   char magic[3] = { 0, 0, 0 };
+   int c;
+
+   if(img->raw) {
+      c = fgetc(img->f);
+      if(c == EOF)
+         return false;
+      ungetc(c, img->f);
+   }
+   else {
+      if(fscanf(img->f, " %2s", magic) != 1)
+         return false;
+      if(strcmp(magic, "P5") != 0 && strcmp(magic, "P6") != 0) {
+         fprintf(stderr, "Only binary PGM (P5) and PPM (P6) images are supported\n");
+         exit(1);
+      }
+      img->channels = magic[1] == '5' ? 1 : 3;
+      img->width = image_header_int(img->f);
+      img->height = image_header_int(img->f);
+      img->maxval = image_header_int(img->f);
+      fgetc(img->f);             // the single whitespace before the samples
+      if(img->width < 1 || img->height < 1 || img->maxval < 1 || img->maxval > 65535) {
+         fprintf(stderr, "Bad PNM header\n");
+         exit(1);
+      }
+   }
+
+   free(img->line);
+   img->line = (unsigned char*) malloc(image_line_size(img));
+   img->row = 0;
+   return true;
+}
+
+/* `raw` is "WxH" or "WxHxC" for raw frames, NULL for PGM/PPM; "-" is stdin */
+void image_open(struct image_file* img, const char* path, const char* raw) {
+
+   memset(img, 0, sizeof(*img));
+   img->f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+   if(img->f == NULL) {
+      perror("Couldn't open the input image");
+      exit(1);
+   }
+   if(raw != NULL) {
+      img->raw = true;
+      img->channels = 1;
+      img->maxval = 255;
+      if(sscanf(raw, "%dx%dx%d", &img->width, &img->height, &img->channels) < 2 || img->width < 1 || 
+            img->height < 1 || img->channels < 1) {
+         fprintf(stderr, "Bad raw frame size %s\n", raw);
+         exit(1);
+      }
+   }
+}
+
+void image_read_rows(struct image_file* img, float* dst, int rows, size_t plane) {
+
+   const size_t n = (size_t) img->width * img->channels;
+
+   for(int r = 0; r < rows; r++, img->row++) {
+      if(fread(img->line, 1, image_line_size(img), img->f) != image_line_size(img)) {
+         fprintf(stderr, "The image ends before row %d\n", img->row);
+         exit(1);
+      }
+      for(size_t i = 0; i < n; i++) {
+         const float v = img->maxval > 255 ? (img->line[2*i] << 8) | img->line[2*i + 1] : img->line[i];
+         dst[(i % img->channels) * plane + (size_t) r * img->width + i / img->channels] = v;
+      }
+   }
+}
+
+/* PGM or PPM by the number of channels, or raw frames with `raw` */
+void image_create(struct image_file* img, const char* path, bool raw, int width, int height, int channels, 
+      int maxval) {
+
+   /* PGM is one channel and PPM three; anything else only as raw frames */
+   if(!raw && channels != 1 && channels != 3) {
+      fprintf(stderr, "Images of %d channels can only be written raw (.raw)\n", channels);
+      exit(1);
+   }
+
+   memset(img, 0, sizeof(*img));
+   img->f = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+   if(img->f == NULL) {
+      perror("Couldn't create the output image");
+      exit(1);
+   }
+   img->raw = raw;
+   img->maxval = maxval;
+   img->channels = channels;
+   img->width = width;
+   img->height = height;
+   img->line = (unsigned char*) malloc(image_line_size(img));
+}
+
+void image_write_rows(struct image_file* img, const float* src, int rows, size_t plane) {
+
+   const size_t n = (size_t) img->width * img->channels;
+
+   if(img->row == 0 && !img->raw)
+      fprintf(img->f, "P%c\n%d %d\n%d\n", img->channels == 1 ? '5' : '6', img->width, img->height, 
+            img->maxval);
+
+   for(int r = 0; r < rows; r++) {
+      for(size_t i = 0; i < n; i++) {
+         float v = src[(i % img->channels) * plane + (size_t) r * img->width + i / img->channels] + 0.5f;
+         const int s = v < 0 ? 0 : v > img->maxval ? img->maxval : (int) v;
+         if(img->maxval > 255) {
+            img->line[2*i] = s >> 8;
+            img->line[2*i + 1] = s & 0xff;
+         }
+         else
+            img->line[i] = s;
+      }
+      fwrite(img->line, 1, image_line_size(img), img->f);
+   }
+   img->row = (img->row + rows) % img->height;     // the next image starts with its header
+}
+
+void image_close(struct image_file* img) {
+   if(img->f != stdin && img->f != stdout)
+      fclose(img->f);
+   free(img->line);
+}
+
+
+/* Command timeline
+
+   getTimeExec() only sees START->END of one kernel. When tracing is on 
+   (--trace FILE / ASP_TRACE=FILE, or --profile / ASP_PROFILE=1) every 
+   enqueued command passed to trace_event() keeps its QUEUED, SUBMIT, 
+   START and END timestamps, and host phases (build, init...) are recorded 
+   with trace_host(). At exit the timeline is written as Chrome trace JSON 
+   (chrome://tracing, Perfetto) and/or summarized per phase.
+
+   Device timestamps use the device clock; each queue is shifted onto the 
+   host clock using the host time at which its first traced command was 
+   enqueued.
+*/
+#define TRACE_MAX_QUEUES 16
+
+struct trace_record {
+   char name[64];
+   char phase[16];               // write, kernel, read, map, build, init...
+   cl_event event;               // NULL for host phases
+   cl_command_queue queue;
+   double host_enqueue;          // wall_time_ms() when it was recorded
+   double queued, submit, start, end;
+   int lane;                     // 0 host, n the n-th queue seen
+};
+
+struct trace_state {
+   bool enabled, summary;
+   char path[512];
+   struct trace_record* records;
+   int num_records, capacity;
+
+   /* Queues with unresolved commands and their device->host clock offset */
+   cl_command_queue queues[TRACE_MAX_QUEUES];
+   double offsets[TRACE_MAX_QUEUES];
+   int lanes[TRACE_MAX_QUEUES];
+   int num_queues, next_lane;
+} trace_state;
+
+bool trace_active() {
+
+   static bool initialized = false;
+   const char* env;
+
+   if(!initialized) {
+      initialized = true;
+      env = getenv("ASP_TRACE");
+      if(env != NULL && env[0] != '\0' && trace_state.path[0] == '\0')
+         snprintf(trace_state.path, sizeof(trace_state.path), "%s", env);
+      env = getenv("ASP_PROFILE");
+      if(env != NULL && strcmp(env, "0") != 0)
+         trace_state.summary = true;
+      trace_state.enabled = trace_state.path[0] != '\0' || trace_state.summary;
+   }
+   return trace_state.enabled;
+}
+
+struct trace_record* trace_new_record(const char* name, const char* phase) {
+
+   struct trace_record* record;
+
+   if(trace_state.num_records == trace_state.capacity) {
+      trace_state.capacity = trace_state.capacity ? 2 * trace_state.capacity : 256;
+      trace_state.records = (struct trace_record*) realloc(trace_state.records, 
+            trace_state.capacity * sizeof(struct trace_record));
+   }
+   record = &trace_state.records[trace_state.num_records++];
+   memset(record, 0, sizeof(*record));
+   snprintf(record->name, sizeof(record->name), "%s", name);
+   snprintf(record->phase, sizeof(record->phase), "%s", phase);
+   record->host_enqueue = wall_time_ms();
+   return record;
+}
+
+/* Record an enqueued command. The event is retained until the timeline is 
+   resolved, so the caller may release its own reference */
+void trace_event(cl_event event, const char* name, const char* phase) {
+
+   struct trace_record* record;
+
+   if(event == NULL || !trace_active())
+      return;
+
+   record = trace_new_record(name, phase);
+   record->event = event;
+   clRetainEvent(event);
+   clGetEventInfo(event, CL_EVENT_COMMAND_QUEUE, sizeof(cl_command_queue), &record->queue, NULL);
+}
+
+/* Record a host phase that ran from `start` to `end` (wall_time_ms()) */
+void trace_host(const char* name, const char* phase, double start, double end) {
+
+   struct trace_record* record;
+
+   if(!trace_active())
+      return;
+
+   record = trace_new_record(name, phase);
+   record->queued = record->submit = record->start = start;
+   record->end = end;
+}
+
+/* Read the profiling info of the recorded events and move it to the host 
+   clock. Must run before the queues are released, see trace_release_queue() */
+void trace_resolve() {
+
+   int q;
+   cl_ulong stamps[4];
+   const cl_profiling_info params[4] = { CL_PROFILING_COMMAND_QUEUED, 
+         CL_PROFILING_COMMAND_SUBMIT, CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END };
+
+   for(int i = 0; i < trace_state.num_records; i++) {
+      struct trace_record* record = &trace_state.records[i];
+      if(record->event == NULL)
+         continue;
+
+      clWaitForEvents(1, &record->event);
+      for(int p = 0; p < 4; p++) {
+         stamps[p] = 0;
+         clGetEventProfilingInfo(record->event, params[p], sizeof(cl_ulong), &stamps[p], NULL);
+      }
+      clReleaseEvent(record->event);
+      record->event = NULL;
+
+      for(q = 0; q < trace_state.num_queues && trace_state.queues[q] != record->queue; q++);
+      if(q == trace_state.num_queues) {
+         if(q == TRACE_MAX_QUEUES)
+            q = TRACE_MAX_QUEUES - 1;
+         else
+            trace_state.num_queues++;
+         trace_state.queues[q] = record->queue;
+         trace_state.offsets[q] = record->host_enqueue - stamps[0] / 1000000.0;
+         trace_state.lanes[q] = ++trace_state.next_lane;
+      }
+
+      record->queued = stamps[0] / 1000000.0 + trace_state.offsets[q];
+      record->submit = stamps[1] / 1000000.0 + trace_state.offsets[q];
+      record->start = stamps[2] / 1000000.0 + trace_state.offsets[q];
+      record->end = stamps[3] / 1000000.0 + trace_state.offsets[q];
+      record->lane = trace_state.lanes[q];
+   }
+}
+
+/* Resolve what is pending on a queue that is about to be released, and 
+   forget it so a new queue at the same address gets its own lane */
+void trace_release_queue(cl_command_queue queue) {
+
+   if(!trace_active())
+      return;
+
+   trace_resolve();
+   for(int q = 0; q < trace_state.num_queues; q++)
+      if(trace_state.queues[q] == queue) {
+         trace_state.num_queues--;
+         trace_state.queues[q] = trace_state.queues[trace_state.num_queues];
+         trace_state.offsets[q] = trace_state.offsets[trace_state.num_queues];
+         trace_state.lanes[q] = trace_state.lanes[trace_state.num_queues];
+         break;
+      }
+}
+
+void trace_write_chrome(const char* path) {
+
+   FILE* handle;
+   double origin = 0;
+
+   handle = fopen(path, "w");
+   if(handle == NULL) {
+      perror("Couldn't write the trace file");
+      return;
+   }
+
+   for(int i = 0; i < trace_state.num_records; i++)
+      if(i == 0 || trace_state.records[i].queued < origin)
+         origin = trace_state.records[i].queued;
+
+   /* Complete ("X") events in microseconds: tid 0 is the host, tid n the n-th queue */
+   fprintf(handle, "{\"traceEvents\":[\n");
+   for(int i = 0; i < trace_state.num_records; i++) {
+      struct trace_record* record = &trace_state.records[i];
+      fprintf(handle, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"queued_us\":%.3f,\"submit_us\":%.3f}}",
+            i > 0 ? ",\n" : "", record->name, record->phase, record->lane,
+            (record->start - origin) * 1000.0, (record->end - record->start) * 1000.0,
+            (record->queued - origin) * 1000.0, (record->submit - origin) * 1000.0);
+   }
+   fprintf(handle, "\n],\"displayTimeUnit\":\"ms\"}\n");
+   fclose(handle);
+}
+
+/* Per-phase totals, plus how long commands waited between QUEUED and START */
+void trace_print_summary() {
+
+   char phases[32][16];
+   int counts[32] = { 0 }, num_phases = 0, p;
+   double busy[32] = { 0 }, waiting[32] = { 0 };
+   double first = 0, last = 0;
+
+   for(int i = 0; i < trace_state.num_records; i++) {
+      struct trace_record* record = &trace_state.records[i];
+
+      for(p = 0; p < num_phases && strcmp(phases[p], record->phase) != 0; p++);
+      if(p == num_phases) {
+         if(num_phases == 32)
+            continue;
+         strcpy(phases[num_phases++], record->phase);
+      }
+      counts[p]++;
+      busy[p] += record->end - record->start;
+      waiting[p] += record->start - record->queued;
+
+      if(i == 0 || record->queued < first) first = record->queued;
+      if(i == 0 || record->end > last) last = record->end;
+   }
+
+   printf("%-10s %7s %12s %12s %12s\n", "Phase", "Count", "Total ms", "Avg ms", "Waiting ms");
+   for(p = 0; p < num_phases; p++)
+      printf("%-10s %7d %12.3f %12.3f %12.3f\n", phases[p], counts[p], busy[p], 
+            busy[p] / counts[p], waiting[p]);
+   printf("Traced wall time: %.3f ms\n", last - first);
+}
+
+void trace_finish() {
+
+   if(!trace_active() || trace_state.num_records == 0)
+      return;
+
+   trace_resolve();
+   if(trace_state.path[0] != '\0')
+      trace_write_chrome(trace_state.path);
+   if(trace_state.summary)
+      trace_print_summary();
+
+   free(trace_state.records);
+   trace_state.records = NULL;
+   trace_state.num_records = trace_state.capacity = 0;
+}
+
+
+/* Device discovery and selection
+
+   All platforms and all their devices are enumerated, in platform order. 
+   The devices to use come from `--device SPEC` on the command line or the 
+   ASP_DEVICE environment variable. SPEC is a comma separated list of:
+      all | gpu | cpu | accel    every device (of that type)
+      N                          device N of the --list-devices report
+      P:D                        device D of platform P
+      text                       devices whose name or platform contains text
+      host                       no OpenCL device: the native CPU backend
+   Without SPEC the first GPU is used, falling back to the first CPU. When
+   nothing matches (or there is no OpenCL platform at all) the programs run
+   on the CPU backend of asp_cpu.h.
+*/
+#define MAX_DEVICES 32
+
+const char* device_selection = NULL;
+bool autotune_requested = false;      // --autotune, see the tuning database below
+bool verify_requested = false;        // --verify, check results against the CPU backend
+
+int pipeline_requested = 0;           // --pipeline[=CHUNKS], chunked GEMM and convolution
+
+bool verify_enabled() {
+   const char* env = getenv("ASP_VERIFY");
+   return verify_requested || (env != NULL && strcmp(env, "0") != 0);
+}
+
+/* Number of chunks of the overlapped pipeline, 0 when it is off */
+int pipeline_chunks() {
+   const char* env = getenv("ASP_PIPELINE");
+   if(pipeline_requested > 0)
+      return pipeline_requested;
+   return env != NULL ? atoi(env) : 0;
+}
+
+const char* device_type_name(cl_device_type type) {
+   if(type & CL_DEVICE_TYPE_GPU) return "GPU";
+   if(type & CL_DEVICE_TYPE_CPU) return "CPU";
+   if(type & CL_DEVICE_TYPE_ACCELERATOR) return "ACCEL";
+   return "OTHER";
+}
+
+/* Case insensitive strstr */
+bool contains_nocase(const char* haystack, const char* needle) {
+   size_t n = strlen(needle);
+   for(; *haystack != '\0'; haystack++) {
+      size_t i = 0;
+      while(i < n && haystack[i] != '\0' && 
+            tolower((unsigned char) haystack[i]) == tolower((unsigned char) needle[i]))
+         i++;
+      if(i == n)
+         return true;
+   }
+   return n == 0;
+}
+
+/* Every device of every platform. platform_index/device_index may be NULL.
+   Without an OpenCL platform the list is just empty */
+int enumerate_devices(cl_device_id* devices, int* platform_index, int* device_index, int max_devices) {
+
+   cl_platform_id platforms[MAX_DEVICES];
+   cl_uint num_platforms, num_devices;
+   int count = 0;
+   int err;
+
+   err = clGetPlatformIDs(MAX_DEVICES, platforms, &num_platforms);
+   if(err < 0 || num_platforms == 0)
+      return 0;
+   if(num_platforms > MAX_DEVICES)
+      num_platforms = MAX_DEVICES;
+
+   for(cl_uint p = 0; p < num_platforms && count < max_devices; p++) {
+      err = clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, max_devices - count, 
+            &devices[count], &num_devices);
+      if(err < 0)
+         continue;
+      if(num_devices > max_devices - count)
+         num_devices = max_devices - count;
+      for(cl_uint d = 0; d < num_devices; d++) {
+         if(platform_index) platform_index[count + d] = p;
+         if(device_index) device_index[count + d] = d;
+      }
+      count += num_devices;
+   }
+
+   return count;
+}
+
+/* Does one token of a selection spec match the device? */
+bool device_matches(cl_device_id dev, int index, int platform, int device, const char* token) {
+
+   cl_platform_id platform_id;
+   cl_device_type type;
+   char name[256], platform_name[256];
+   int p, d;
+   char* end;
+
+   clGetDeviceInfo(dev, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+
+   if(strcmp(token, "all") == 0) return true;
+   if(strcmp(token, "gpu") == 0) return (type & CL_DEVICE_TYPE_GPU) != 0;
+   if(strcmp(token, "cpu") == 0) return (type & CL_DEVICE_TYPE_CPU) != 0;
+   if(strcmp(token, "accel") == 0) return (type & CL_DEVICE_TYPE_ACCELERATOR) != 0;
+   if(strcmp(token, "host") == 0) return false;
+
+   long n = strtol(token, &end, 10);
+   if(end != token && *end == '\0')
+      return n == index;
+   if(sscanf(token, "%d:%d", &p, &d) == 2 && strchr(token, ' ') == NULL)
+      return p == platform && d == device;
+
+   name[0] = platform_name[0] = '\0';
+   clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(name), name, NULL);
+   clGetDeviceInfo(dev, CL_DEVICE_PLATFORM, sizeof(platform_id), &platform_id, NULL);
+   clGetPlatformInfo(platform_id, CL_PLATFORM_NAME, sizeof(platform_name), platform_name, NULL);
+   return contains_nocase(name, token) || contains_nocase(platform_name, token);
+}
+
+/* Devices picked by --device / ASP_DEVICE, in enumeration order */
+int select_devices(cl_device_id* selected, int max_devices) {
+
+   cl_device_id devices[MAX_DEVICES];
+   int platform_index[MAX_DEVICES], device_index[MAX_DEVICES];
+   const char* spec = device_selection ? device_selection : getenv("ASP_DEVICE");
+   cl_device_type type;
+   int num_devices, count = 0;
+
+   num_devices = enumerate_devices(devices, platform_index, device_index, MAX_DEVICES);
+
+   if(spec == NULL || spec[0] == '\0') {
+      /* Default: first GPU, or the first CPU when there is none */
+      const cl_device_type preference[] = { CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_CPU };
+      for(int t = 0; t < 2 && count == 0; t++)
+         for(int i = 0; i < num_devices && count == 0; i++) {
+            clGetDeviceInfo(devices[i], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+            if(type & preference[t])
+               selected[count++] = devices[i];
+         }
+      return count;
+   }
+
+   for(int i = 0; i < num_devices && count < max_devices; i++) {
+      char tokens[256], *token, *save;
+      snprintf(tokens, sizeof(tokens), "%s", spec);
+      for(token = strtok_r(tokens, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+         if(device_matches(devices[i], i, platform_index[i], device_index[i], token)) {
+            selected[count++] = devices[i];
+            break;
+         }
+   }
+
+   return count;
+}
+
+/* --list-devices report */
+void print_devices() {
+
+   cl_device_id devices[MAX_DEVICES], selected[MAX_DEVICES];
+   int platform_index[MAX_DEVICES], device_index[MAX_DEVICES];
+   int num_devices, num_selected;
+   cl_platform_id platform;
+   cl_device_type type;
+   cl_uint compute_units;
+   cl_ulong local_mem, global_mem;
+   size_t max_workgroup;
+   char name[256], platform_name[256];
+
+   num_devices = enumerate_devices(devices, platform_index, device_index, MAX_DEVICES);
+   num_selected = select_devices(selected, MAX_DEVICES);
+   if(num_devices == 0) {
+      printf("No OpenCL platform found: the programs run on the CPU backend (host)\n");
+      return;
+   }
+
+   printf("  #  P:D  Type   CUs  Local mem  Max WG  Global mem  Device [Platform]\n");
+   for(int i = 0; i < num_devices; i++) {
+      bool is_selected = false;
+      for(int j = 0; j < num_selected; j++)
+         is_selected |= selected[j] == devices[i];
+
+      name[0] = platform_name[0] = '\0';
+      clGetDeviceInfo(devices[i], CL_DEVICE_NAME, sizeof(name), name, NULL);
+      clGetDeviceInfo(devices[i], CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+      clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(platform_name), platform_name, NULL);
+      clGetDeviceInfo(devices[i], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+      clGetDeviceInfo(devices[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+      clGetDeviceInfo(devices[i], CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+      clGetDeviceInfo(devices[i], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+      clGetDeviceInfo(devices[i], CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_workgroup), &max_workgroup, NULL);
+
+      printf("%c%2d  %d:%d  %-5s %4u  %6lu KB  %6zu  %7lu MB  %s [%s]\n", 
+            is_selected ? '*' : ' ', i, platform_index[i], device_index[i], 
+            device_type_name(type), compute_units, (unsigned long) (local_mem / 1024), 
+            max_workgroup, (unsigned long) (global_mem / (1024 * 1024)), name, platform_name);
+   }
+}
+
+/* Consume the options shared by every program (--device SPEC, --list-devices, 
+   --trace FILE, --profile, --autotune, --verify, --pipeline[=CHUNKS]) from the 
+   command line, so the remaining arguments keep their positions for the program */
+void parse_common_args(int* argc, char* argv[]) {
+
+   int kept = 1;
+   bool list = false;
+
+   for(int i = 1; i < *argc; i++) {
+      if(strcmp(argv[i], "--device") == 0 && i + 1 < *argc)
+         device_selection = argv[++i];
+      else if(strncmp(argv[i], "--device=", 9) == 0)
+         device_selection = argv[i] + 9;
+      else if(strcmp(argv[i], "--list-devices") == 0)
+         list = true;
+      else if(strcmp(argv[i], "--trace") == 0 && i + 1 < *argc)
+         snprintf(trace_state.path, sizeof(trace_state.path), "%s", argv[++i]);
+      else if(strcmp(argv[i], "--profile") == 0)
+         trace_state.summary = true;
+      else if(strcmp(argv[i], "--autotune") == 0)
+         autotune_requested = true;
+      else if(strcmp(argv[i], "--verify") == 0)
+         verify_requested = true;
+      else if(strcmp(argv[i], "--pipeline") == 0)
+         pipeline_requested = 8;
+      else if(strncmp(argv[i], "--pipeline=", 11) == 0)
+         pipeline_requested = atoi(argv[i] + 11);
+      else
+         argv[kept++] = argv[i];
+   }
+   *argc = kept;
+   argv[kept] = NULL;
+
+   if(list) {
+      print_devices();
+      exit(0);
+   }
+
+   /* Write the timeline when the program ends */
+   if(trace_active())
+      atexit(trace_finish);
+}
+
+/* First selected device, for code that needs a real OpenCL device: it 
+   exits when there is none. The programs call asp_session_open() instead, 
+   which falls back to the CPU backend */
+cl_device_id create_device() {
+
+   cl_device_id dev;
+
+   if(select_devices(&dev, 1) == 0) {
       perror("Couldn't access any devices");
       exit(1);   
    }
@@ -61,16 +774,265 @@ cl_device_id create_device() {
    return dev;
 }
 
+/* Split `total` items between devices in proportion to their measured 
+   throughput. What rounding leaves over goes to the fastest device */
+void split_work(long total, const double* throughput, int num_devices, long* counts) {
 
-/* Create program from a file and compile it */
-cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename) {
+   double sum = 0;
+   long assigned = 0;
+   int fastest = 0;
+
+   for(int i = 0; i < num_devices; i++) {
+      sum += throughput[i] > 0 ? throughput[i] : 0;
+      if(throughput[i] > throughput[fastest])
+         fastest = i;
+   }
+
+   for(int i = 0; i < num_devices; i++) {
+      double share = sum > 0 ? (throughput[i] > 0 ? throughput[i] : 0) / sum : 1.0 / num_devices;
+      counts[i] = (long) (total * share);
+      assigned += counts[i];
+   }
+   counts[fastest] += total - assigned;
+}
+
+
+/* Binary cache for compiled programs
+
+   Building the .cl file on every launch is often slower than the kernel 
+   itself on CPU runtimes such as PoCL. After a successful build the device 
+   binary (CL_PROGRAM_BINARIES) is stored in ASP_CACHE_DIR (by default 
+   $HOME/.cache/asp-opencl) under a key that hashes the source, the build 
+   options, the platform/device names and the driver version. Later launches 
+   load it with clCreateProgramWithBinary and any mismatch falls back to a 
+   normal build.
+
+   ASP_CACHE=0 disables the cache. ASP_CACHE_STATS=1 prints the hit/miss 
+   counters and the startup time saved when the program exits.
+*/
+#define PROGRAM_CACHE_MAGIC "ASPCLBIN"
+
+struct program_cache_header {
+   char magic[8];
+   unsigned long long key;
+   double build_ms;              // time the source build took
+   unsigned long long size;      // bytes of binary after the header
+};
+
+struct program_cache_stats {
+   unsigned int hits, misses, rejected;
+   double saved_ms;
+} program_cache_stats;
+
+void print_program_cache_stats() {
+   printf("Program cache: %u hits, %u misses, %u rejected, %.3f ms of build time saved\n",
+         program_cache_stats.hits, program_cache_stats.misses, 
+         program_cache_stats.rejected, program_cache_stats.saved_ms);
+}
+
+unsigned long long fnv1a(unsigned long long hash, const void* data, size_t size) {
+   const unsigned char* bytes = (const unsigned char*) data;
+   for(size_t i = 0; i < size; i++) {
+      hash ^= bytes[i];
+      hash *= 0x100000001b3ULL;
+   }
+   return hash;
+}
+
+/* Hash a NUL terminated string including the terminator, so "ab"+"c" != "a"+"bc" */
+unsigned long long fnv1a_str(unsigned long long hash, const char* str) {
+   return fnv1a(hash, str ? str : "", strlen(str ? str : "") + 1);
+}
+
+/* Everything that makes a binary valid for a device: source, options and driver */
+unsigned long long program_cache_key(cl_device_id dev, const char* source, const char* options) {
+
+   cl_platform_id platform;
+   char info[1024];
+   unsigned long long key = 0xcbf29ce484222325ULL;
+   const cl_device_info dev_params[] = { CL_DEVICE_NAME, CL_DEVICE_VENDOR, 
+         CL_DEVICE_VERSION, CL_DRIVER_VERSION };
+
+   key = fnv1a_str(key, source);
+   key = fnv1a_str(key, options);
+
+   clGetDeviceInfo(dev, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+   info[0] = '\0';
+   clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(info), info, NULL);
+   key = fnv1a_str(key, info);
+   info[0] = '\0';
+   clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(info), info, NULL);
+   key = fnv1a_str(key, info);
+
+   for(int i = 0; i < sizeof(dev_params) / sizeof(dev_params[0]); i++) {
+      info[0] = '\0';
+      clGetDeviceInfo(dev, dev_params[i], sizeof(info), info, NULL);
+      key = fnv1a_str(key, info);
+   }
+
+   return key;
+}
+
+bool program_cache_enabled() {
+   const char* env = getenv("ASP_CACHE");
+   return env == NULL || strcmp(env, "0") != 0;
+}
+
+/* Directory holding the cache files, created on demand. Returns false if unusable */
+bool program_cache_dir(char* path, size_t size) {
+
+   const char* dir = getenv("ASP_CACHE_DIR");
+   const char* home = getenv("HOME");
+
+   if(dir != NULL && dir[0] != '\0')
+      snprintf(path, size, "%s", dir);
+   else if(home != NULL && home[0] != '\0') {
+      snprintf(path, size, "%s/.cache", home);
+      mkdir(path, 0755);
+      snprintf(path, size, "%s/.cache/asp-opencl", home);
+   }
+   else
+      snprintf(path, size, "/tmp/asp-opencl");
+
+   return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+/* Load and build a cached binary. Returns NULL on any mismatch so the caller 
+   builds from source */
+cl_program program_cache_load(cl_context ctx, cl_device_id dev, const char* path,
+      unsigned long long key, const char* options, double* build_ms) {
+
+   struct program_cache_header header;
+   unsigned char* binary;
+   cl_program program;
+   cl_int err, status;
+   FILE* handle;
+
+   handle = fopen(path, "rb");
+   if(handle == NULL)
+      return NULL;
+
+   if(fread(&header, sizeof(header), 1, handle) != 1 ||
+         memcmp(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+         header.key != key || header.size == 0) {
+      fclose(handle);
+      program_cache_stats.rejected++;
+      return NULL;
+   }
+
+   binary = (unsigned char*) malloc(header.size);
+   if(fread(binary, 1, header.size, handle) != header.size) {
+      free(binary);
+      fclose(handle);
+      program_cache_stats.rejected++;
+      return NULL;
+   }
+   fclose(handle);
+
+   size_t size = header.size;
+   program = clCreateProgramWithBinary(ctx, 1, &dev, &size, 
+         (const unsigned char**)&binary, &status, &err);
+   free(binary);
+   if(err < 0 || status < 0) {
+      program_cache_stats.rejected++;
+      return NULL;
+   }
+
+   /* A binary still needs clBuildProgram, but it skips the compiler front-end */
+   err = clBuildProgram(program, 1, &dev, options, NULL, NULL);
+   if(err < 0) {
+      clReleaseProgram(program);
+      program_cache_stats.rejected++;
+      return NULL;
+   }
+
+   *build_ms = header.build_ms;
+   return program;
+}
+
+/* Store the binary of a freshly built program. Failures only cost the next launch */
+void program_cache_store(cl_program program, cl_device_id dev, const char* path,
+      unsigned long long key, double build_ms) {
+
+   struct program_cache_header header;
+   cl_uint num_devices, i;
+   cl_device_id* devices;
+   size_t* sizes;
+   unsigned char** binaries;
+   char tmp_path[1024];
+   FILE* handle;
+
+   clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(num_devices), &num_devices, NULL);
+   devices = (cl_device_id*) malloc(num_devices * sizeof(cl_device_id));
+   sizes = (size_t*) calloc(num_devices, sizeof(size_t));
+   binaries = (unsigned char**) calloc(num_devices, sizeof(unsigned char*));
+   clGetProgramInfo(program, CL_PROGRAM_DEVICES, num_devices * sizeof(cl_device_id), devices, NULL);
+   clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, num_devices * sizeof(size_t), sizes, NULL);
+
+   /* CL_PROGRAM_BINARIES wants one buffer per device of the program */
+   for(i = 0; i < num_devices; i++)
+      binaries[i] = (unsigned char*) malloc(sizes[i] > 0 ? sizes[i] : 1);
+
+   if(clGetProgramInfo(program, CL_PROGRAM_BINARIES, num_devices * sizeof(unsigned char*), 
+         binaries, NULL) == CL_SUCCESS) {
+      for(i = 0; i < num_devices; i++) {
+         if(devices[i] != dev || sizes[i] == 0)
+            continue;
+
+         memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic));
+         header.key = key;
+         header.build_ms = build_ms;
+         header.size = sizes[i];
+
+         /* Write aside and rename, so a concurrent launch never reads half a file */
+         snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long) getpid());
+         handle = fopen(tmp_path, "wb");
+         if(handle == NULL)
+            break;
+         if(fwrite(&header, sizeof(header), 1, handle) == 1 &&
+               fwrite(binaries[i], 1, sizes[i], handle) == sizes[i] &&
+               fclose(handle) == 0)
+            rename(tmp_path, path);
+         else
+            remove(tmp_path);
+         break;
+      }
+   }
+
+   for(i = 0; i < num_devices; i++)
+      free(binaries[i]);
+   free(binaries);
+   free(sizes);
+   free(devices);
+}
+
+
+/* Create program from a file and compile it with the given options, going 
+   through the binary cache when it is enabled. `prefix`, if not NULL, is 
+   source text placed before the file (see format_source_defines()) */
+cl_program build_program_source_opts(cl_context ctx, cl_device_id dev, const char* filename,
+      const char* prefix, const char* options) {
 
    cl_program program;
    FILE *program_handle;
    char *program_buffer, *program_log;
-   size_t program_size, log_size;
+   char cache_path[1024];
+   size_t program_size, prefix_size, log_size;
+   unsigned long long key;
+   bool use_cache;
+   double start, cached_build_ms;
    int err;
 
+   static bool stats_registered = false;
+   if(!stats_registered) {
+      stats_registered = true;
+      const char* env = getenv("ASP_CACHE_STATS");
+      if(env != NULL && strcmp(env, "0") != 0)
+         atexit(print_program_cache_stats);
+   }
+
+   start = wall_time_ms();
+
    /* Read program file and place content into buffer */
    program_handle = fopen(filename, "r");
    if(program_handle == NULL) {
@@ -80,13 +1042,35 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename)
    fseek(program_handle, 0, SEEK_END);
    program_size = ftell(program_handle);
    rewind(program_handle);
-   program_buffer = (char*)malloc(program_size + 1);
-   program_buffer[program_size] = '\0';
-   if(fread(program_buffer, sizeof(char), program_size, program_handle) == 1){
+   prefix_size = prefix != NULL ? strlen(prefix) : 0;
+   program_buffer = (char*)malloc(prefix_size + program_size + 1);
+   if(prefix_size > 0)
+      memcpy(program_buffer, prefix, prefix_size);
+   program_buffer[prefix_size + program_size] = '\0';
+   if(fread(program_buffer + prefix_size, sizeof(char), program_size, program_handle) == 1){
       perror("Error al leer el fichero de OpenCL");
       exit(1);
    }
    fclose(program_handle);
+   program_size += prefix_size;
+
+   /* Try the binary cache first */
+   use_cache = program_cache_enabled() && program_cache_dir(cache_path, sizeof(cache_path));
+   if(use_cache) {
+      key = program_cache_key(dev, program_buffer, options);
+      size_t len = strlen(cache_path);
+      snprintf(cache_path + len, sizeof(cache_path) - len, "/%016llx.bin", key);
+
+      program = program_cache_load(ctx, dev, cache_path, key, options, &cached_build_ms);
+      if(program != NULL) {
+         trace_host(filename, "build", start, wall_time_ms());
+         program_cache_stats.hits++;
+         program_cache_stats.saved_ms += cached_build_ms - (wall_time_ms() - start);
+         free(program_buffer);
+         return program;
+      }
+      program_cache_stats.misses++;
+   }
 
    /* Create program from file 
 
@@ -109,7 +1093,7 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename)
    define a macro with the option -DMACRO=VALUE and turn off optimization 
    with -cl-opt-disable.
    */
-   err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+   err = clBuildProgram(program, 1, &dev, options, NULL, NULL);
    if(err < 0) {
 
       /* Find size of log and print to std output */
@@ -124,7 +1108,325 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename)
       exit(1);
    }
 
+   trace_host(filename, "build", start, wall_time_ms());
+   if(use_cache)
+      program_cache_store(program, dev, cache_path, key, wall_time_ms() - start);
+
+   return program;
+}
+
+cl_program build_program_opts(cl_context ctx, cl_device_id dev, const char* filename,
+      const char* options) {
+   return build_program_source_opts(ctx, dev, filename, NULL, options);
+}
+
+/* Create program from a file and compile it */
+cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename) {
+   return build_program_opts(ctx, dev, filename, NULL);
+}
+
+
+/* Compile-time specialization
+
+   Values that never change during a run (the convolution radius, the matrix 
+   size, the work-group size...) can be turned into kernel constants with 
+   -DNAME=VALUE, so the compiler unrolls loops and fixes local array sizes. 
+   Each distinct define set is a different program variant; variants are 
+   kept in a per-process table keyed by file, device and define set (and on 
+   disk by the binary cache above).
+
+   A define with `text` (an expression, such as an integrand) does not go 
+   through the build options, which the compiler splits at spaces: it is 
+   written into the source as "#define NAME (text)" before the file.
+*/
+struct build_define {
+   const char* name;
+   long value;
+   const char* text;    // source text (an expression) instead of `value` when set
+};
+
+#define MAX_PROGRAM_VARIANTS 32
+
+struct program_variant {
+   cl_context ctx;
+   cl_device_id dev;
+   char filename[256];
+   char options[512];
+   char* prefix;        // source defines, NULL if none
+   cl_program program;
+} program_variants[MAX_PROGRAM_VARIANTS];
+int num_program_variants = 0;
+
+int compare_defines(const void* a, const void* b) {
+   return strcmp(((const struct build_define*) a)->name, ((const struct build_define*) b)->name);
+}
+
+/* Source prefixes are equal, NULL being no prefix */
+bool same_prefix(const char* a, const char* b) {
+   return strcmp(a != NULL ? a : "", b != NULL ? b : "") == 0;
+}
+
+/* Format the numeric defines of a set as build options. The defines are 
+   sorted by name so the same set always produces the same options string 
+   (and the same cache key) */
+void format_defines(char* options, size_t size, const struct build_define* defines, int num_defines) {
+
+   struct build_define* sorted;
+   size_t len = 0;
+
+   options[0] = '\0';
+   if(num_defines <= 0)
+      return;
+
+   sorted = (struct build_define*) malloc(num_defines * sizeof(struct build_define));
+   memcpy(sorted, defines, num_defines * sizeof(struct build_define));
+   qsort(sorted, num_defines, sizeof(struct build_define), compare_defines);
+
+   for(int i = 0; i < num_defines; i++) {
+      if(sorted[i].text != NULL)
+         continue;
+      len += snprintf(options + len, size - len, "%s-D%s=%ld", 
+            len > 0 ? " " : "", sorted[i].name, sorted[i].value);
+      if(len >= size) {
+         fprintf(stderr, "Build options too long for %s\n", sorted[i].name);
+         exit(1);
+      }
+   }
+
+   free(sorted);
+}
+
+/* The text defines of a set as "#define NAME (text)" lines, sorted by name 
+   and followed by #line 1 so the build log keeps the line numbers of the 
+   file. NULL if there are none; the caller frees it */
+char* format_source_defines(const struct build_define* defines, int num_defines) {
+
+   struct build_define* sorted;
+   size_t size = sizeof("#line 1\n"), len = 0;
+   char* prefix;
+
+   for(int i = 0; i < num_defines; i++)
+      if(defines[i].text != NULL)
+         size += strlen(defines[i].name) + strlen(defines[i].text) + sizeof("#define  ()\n");
+   if(size == sizeof("#line 1\n"))
+      return NULL;
+
+   sorted = (struct build_define*) malloc(num_defines * sizeof(struct build_define));
+   memcpy(sorted, defines, num_defines * sizeof(struct build_define));
+   qsort(sorted, num_defines, sizeof(struct build_define), compare_defines);
+
+   prefix = (char*) malloc(size);
+   for(int i = 0; i < num_defines; i++)
+      if(sorted[i].text != NULL)
+         len += snprintf(prefix + len, size - len, "#define %s (%s)\n", sorted[i].name, sorted[i].text);
+   snprintf(prefix + len, size - len, "#line 1\n");
+
+   free(sorted);
+   return prefix;
+}
+
+/* Return the program built with the given source prefix and options, building 
+   it the first time. The table keeps its own reference, so the caller releases 
+   the returned one as with build_program() */
+cl_program build_program_variant_source(cl_context ctx, cl_device_id dev, const char* filename,
+      const char* prefix, const char* options) {
+
+   struct program_variant* variant;
+   cl_program program;
+
+   if(options == NULL)
+      options = "";
+
+   for(int i = 0; i < num_program_variants; i++) {
+      variant = &program_variants[i];
+      if(variant->ctx == ctx && variant->dev == dev && 
+            strcmp(variant->filename, filename) == 0 && strcmp(variant->options, options) == 0 &&
+            same_prefix(variant->prefix, prefix)) {
+         clRetainProgram(variant->program);
+         return variant->program;
+      }
+   }
+
+   program = build_program_source_opts(ctx, dev, filename, prefix, options);
+
+   if(num_program_variants < MAX_PROGRAM_VARIANTS && 
+         strlen(filename) < sizeof(variant->filename) && strlen(options) < sizeof(variant->options)) {
+      variant = &program_variants[num_program_variants++];
+      variant->ctx = ctx;
+      variant->dev = dev;
+      strcpy(variant->filename, filename);
+      strcpy(variant->options, options);
+      variant->prefix = prefix != NULL ? strdup(prefix) : NULL;
+      variant->program = program;
+      clRetainProgram(program);
+   }
+
    return program;
 }
 
+cl_program build_program_variant_opts(cl_context ctx, cl_device_id dev, const char* filename,
+      const char* options) {
+   return build_program_variant_source(ctx, dev, filename, NULL, options);
+}
+
+/* Build (or reuse) the variant of a program specialized for a define set */
+cl_program build_program_defines(cl_context ctx, cl_device_id dev, const char* filename,
+      const struct build_define* defines, int num_defines) {
+
+   char options[512];
+   char* prefix;
+   cl_program program;
+
+   format_defines(options, sizeof(options), defines, num_defines);
+   prefix = format_source_defines(defines, num_defines);
+   program = build_program_variant_source(ctx, dev, filename, prefix, options);
+   free(prefix);
+   return program;
+}
+
+/* Drop the table references, call before releasing the context */
+void release_program_variants() {
+   for(int i = 0; i < num_program_variants; i++) {
+      clReleaseProgram(program_variants[i].program);
+      free(program_variants[i].prefix);
+   }
+   num_program_variants = 0;
+}
+
+/* Same, but only for the variants built on one context */
+void release_context_variants(cl_context ctx) {
+   int kept = 0;
+   for(int i = 0; i < num_program_variants; i++) {
+      if(program_variants[i].ctx == ctx) {
+         clReleaseProgram(program_variants[i].program);
+         free(program_variants[i].prefix);
+      }
+      else
+         program_variants[kept++] = program_variants[i];
+   }
+   num_program_variants = kept;
+}
+
+
+/* Tuning database
+
+   Launch configurations found by the auto-tuner (see asp.h) are stored one 
+   per line in ASP_TUNING_DB (by default tuning.db in the cache folder), 
+   keyed by device (names and driver version) and kernel:
+      <device key> <kernel> <local size> <num groups> <tile> <items> <ms> <variant> <width>
+   (entries written before the variant or width columns read them as 0). Normal 
+   runs read it automatically; --autotune or ASP_AUTOTUNE=1 sweeps 
+   the configurations again and overwrites the entry. Updates hold an 
+   exclusive flock() on <db>.lock while they read, rewrite and rename the 
+   file, so concurrent tuners do not drop each other's entries; lookups 
+   need no lock, since the rename replaces the file whole.
+*/
+struct tune_config {
+   size_t local_size;            // work-group size
+   size_t num_groups;            // 0 = derived from the problem size
+   int tile;                     // tile edge (2D kernels)
+   int items;                    // items per work-item
+   double ms;                    // kernel time when it was tuned
+   int variant;                  // kernel variant (-DREDUCE_VARIANT of the reductions)
+   int width;                    // vector width of the loads (0 = scalar)
+};
+
+bool autotune_enabled() {
+   const char* env = getenv("ASP_AUTOTUNE");
+   return autotune_requested || (env != NULL && strcmp(env, "0") != 0);
+}
+
+unsigned long long tuning_device_key(cl_device_id dev) {
+   return program_cache_key(dev, "", "tuning");
+}
+
+bool tuning_db_path(char* path, size_t size) {
+
+   const char* env = getenv("ASP_TUNING_DB");
+
+   if(env != NULL && env[0] != '\0') {
+      snprintf(path, size, "%s", env);
+      return true;
+   }
+   if(!program_cache_dir(path, size))
+      return false;
+
+   size_t len = strlen(path);
+   snprintf(path + len, size - len, "/tuning.db");
+   return true;
+}
+
+bool tuning_lookup(cl_device_id dev, const char* kernel, struct tune_config* config) {
+
+   char path[1024], line[512], name[128];
+   unsigned long long key, dev_key;
+   struct tune_config found;
+   bool hit = false;
+   FILE* handle;
+
+   if(!tuning_db_path(path, sizeof(path)) || (handle = fopen(path, "r")) == NULL)
+      return false;
+
+   dev_key = tuning_device_key(dev);
+   while(fgets(line, sizeof(line), handle) != NULL) {
+      found.variant = 0;
+      found.width = 0;
+      if(sscanf(line, "%llx %127s %zu %zu %d %d %lf %d %d", &key, name, &found.local_size, 
+            &found.num_groups, &found.tile, &found.items, &found.ms, &found.variant, &found.width) >= 7 &&
+            key == dev_key && strcmp(name, kernel) == 0) {
+         *config = found;
+         hit = true;
+      }
+   }
+   fclose(handle);
+   return hit;
+}
+
+/* Replace (or append) the entry of this device and kernel */
+void tuning_store(cl_device_id dev, const char* kernel, const struct tune_config* config) {
+
+   char path[1024], tmp_path[1100], lock_path[1100], line[512], name[128];
+   unsigned long long key, dev_key;
+   FILE *in, *out;
+   int lock;
+
+   if(!tuning_db_path(path, sizeof(path)))
+      return;
+
+   /* The lock file outlives the renames of the database itself */
+   snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+   lock = open(lock_path, O_RDWR | O_CREAT, 0644);
+   if(lock < 0 || flock(lock, LOCK_EX) != 0) {
+      perror("Couldn't lock the tuning database");
+      if(lock >= 0)
+         close(lock);
+      return;
+   }
+
+   snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long) getpid());
+   out = fopen(tmp_path, "w");
+   if(out == NULL) {
+      perror("Couldn't write the tuning database");
+      close(lock);
+      return;
+   }
+
+   dev_key = tuning_device_key(dev);
+   in = fopen(path, "r");
+   if(in != NULL) {
+      while(fgets(line, sizeof(line), in) != NULL)
+         if(sscanf(line, "%llx %127s", &key, name) != 2 || key != dev_key || strcmp(name, kernel) != 0)
+            fputs(line, out);
+      fclose(in);
+   }
+
+   fprintf(out, "%016llx %s %zu %zu %d %d %.6f %d %d\n", dev_key, kernel, config->local_size, 
+         config->num_groups, config->tile, config->items, config->ms, config->variant, config->width);
+   if(fclose(out) == 0)
+      rename(tmp_path, path);
+   else
+      remove(tmp_path);
+   close(lock);
+}
+
 #endif
\ No newline at end of file